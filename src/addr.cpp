@@ -34,7 +34,7 @@ Addr &Addr::port(uint16_t port_num) {
 static string addr2ipstr(int family, const char *data) {
     if (family == AF_INET) {
         return tz::strfmt("%u.%u.%u.%u",
-            (uint8_t)data[0], (uint8_t)data[1], (uint8_t)data[2], (uint8_t)data[2]);
+            (uint8_t)data[0], (uint8_t)data[1], (uint8_t)data[2], (uint8_t)data[3]);
     } else {
         char buf[INET6_ADDRSTRLEN];
         if (const char *ip = inet_ntop(family, data, buf, sizeof(buf))) {
@@ -70,6 +70,21 @@ string Addr::str() const {
     return tz::strfmt("%s:%u", this->ip().c_str(), this->port());
 }
 
+const char *Addr::str(char *buf, size_t size) const {
+    const char *data = this->ip_data();
+    if (this->family() == AF_INET) {
+        stbsp_snprintf(buf, (int)size, "%u.%u.%u.%u:%u",
+            (uint8_t)data[0], (uint8_t)data[1], (uint8_t)data[2], (uint8_t)data[3], this->port());
+    } else {
+        char ip[INET6_ADDRSTRLEN];
+        if (inet_ntop(this->family(), data, ip, sizeof(ip)) == NULL) {
+            ip[0] = '\0';
+        }
+        stbsp_snprintf(buf, (int)size, "%s:%u", ip, this->port());
+    }
+    return buf;
+}
+
 int Addr::family() const {
     return this->data.ss_family;
 }
@@ -18,6 +18,8 @@ namespace evsocks {
         Addr &port(uint16_t port_num);
         string ip() const;
         string str() const;
+        // "ip:port" into buf without allocation
+        const char *str(char *buf, size_t size) const;
         int family() const;
         const struct sockaddr *sockaddr() const;
         struct sockaddr *sockaddr();
@@ -39,6 +41,8 @@ namespace evsocks {
         static bool ip_eq(const Addr &lhs, const Addr &rhs);
 
         static socklen_t max_size() { return sizeof(struct sockaddr_storage); }
+        // buffer size for str(buf, size)
+        static const size_t k_str_size = 64;
     };
 
 }
@@ -6,13 +6,79 @@
 using namespace evsocks;
 
 
-uint8_t DefaultServerHandler::auth_begin(const std::set<uint8_t> &methods) {
+std::set<uint8_t> MethodSet::to_set() const {
+    std::set<uint8_t> methods;
+    for (size_t m = 0; m < 256; ++m) {
+        if (this->has((uint8_t)m)) {
+            methods.insert((uint8_t)m);
+        }
+    }
+    return methods;
+}
+
+Error evsocks::parse_userpass(const char *data, size_t size, size_t &used,
+    const char *&user, uint8_t &user_len, const char *&pass, uint8_t &pass_len)
+{
+    used = 0;
+    if (size < 1) {
+        return Ok();
+    }
+
+    // ver
+    if (data[0] != 0x01) {
+        return Error(ERR_BAD_USERNAME_AUTH_VERSION, 0, "parse_userpass() error");
+    }
+    // username, the shortest request with empty ones is 3 bytes
+    if (size < 2) {
+        return Ok();
+    }
+    user_len = (uint8_t)data[1];
+    size_t p_idx = 1 + 1 + user_len + 1;
+    if (size < p_idx) {
+        return Ok();
+    }
+    // password
+    pass_len = (uint8_t)data[1 + 1 + user_len];
+    if (size < p_idx + pass_len) {
+        return Ok();
+    }
+    user = &data[1 + 1];
+    pass = &data[p_idx];
+    used = p_idx + pass_len;
+    return Ok();
+}
+
+Error evsocks::reply_userpass(ClientConn &client, bool ok) {
+    char response[2] = {0x01, (char)(ok ? 0x00 : 0x01)};
+    return client.iochan.write(response, 2);
+}
+
+
+uint8_t IServerHandler::auth_begin(const MethodSet &methods) {
+    return this->auth_begin(methods.to_set());
+}
+
+uint8_t IServerHandler::auth_begin(const std::set<uint8_t> &methods) {
+    (void)methods;
+    return METHOD_REJECT;
+}
+
+void IServerHandler::auth_result(ClientConn &client, uint32_t state) {
+    (void)client;
+    (void)state;
+}
+
+
+uint8_t DefaultServerHandler::auth_begin(const MethodSet &methods) {
     (void)methods;
     return METHOD_NONE;
 }
 
-Error DefaultServerHandler::auth_perform(ClientConn &client, uint32_t &state) {
+Error DefaultServerHandler::auth_perform(ClientConn &client, const char *data, size_t size, size_t &used, uint32_t &state) {
     (void)client;
+    (void)data;
+    (void)size;
+    used = 0;
     state = IServerHandler::AUTH_STATE_DONE;
     return Ok();
 }
@@ -21,54 +87,39 @@ void DefaultServerHandler::auth_end(ClientConn &client) {
     (void)client;
 }
 
-uint8_t PasswordServerHandler::auth_begin(const std::set<uint8_t> &methods) {
-    if (methods.count(METHOD_USERNAME)) {
+uint8_t PasswordServerHandler::auth_begin(const MethodSet &methods) {
+    if (methods.has(METHOD_USERNAME)) {
         return METHOD_USERNAME;
     } else {
         return METHOD_NONE;
     }
 }
 
-Error PasswordServerHandler::auth_perform(ClientConn &client, uint32_t &state) {
-    if (client.input.size() < 5) {
-        state = IServerHandler::AUTH_STATE_CONT;
-        return Ok();
+Error PasswordServerHandler::auth_perform(ClientConn &client, const char *data, size_t size, size_t &used, uint32_t &state) {
+    const char *user = NULL;
+    const char *pass = NULL;
+    uint8_t ulen = 0;
+    uint8_t plen = 0;
+    Error err = parse_userpass(data, size, used, user, ulen, pass, plen);
+    if (!err.ok()) {
+        return err;
     }
-
-    // ver
-    if (client.input[0] != 0x01) {
-        return Error(ERR_BAD_USERNAME_AUTH_VERSION, 0,
-            "PasswordServerHandler::auth_perform() error");
-    }
-    // username
-    uint8_t ulen = client.input[1];
-    size_t p_idx = 1 + 1 + ulen + 1;
-    if (client.input.size() < p_idx + 1) {
-        state = IServerHandler::AUTH_STATE_CONT;
-        return Ok();
-    }
-    // password
-    uint8_t plen = client.input[1 + 1 + ulen];
-    if (client.input.size() < p_idx + plen) {
+    if (used == 0) {
         state = IServerHandler::AUTH_STATE_CONT;
         return Ok();
     }
-    // check
-    std::string user(&client.input[1 + 1], &client.input[1 + 1 + ulen]);
-    std::string pass(&client.input[p_idx], &client.input[p_idx] + plen);
-    char response[2] = {0x01, 0x00};
-    if (this->user2pass.count(user) && this->user2pass.at(user) == pass) {
-        state = IServerHandler::AUTH_STATE_DONE;
-    } else {
-        state = IServerHandler::AUTH_STATE_FAIL;
-        response[1] = 0x01;
-    }
-    // pop input
-    client.input.pop(p_idx + plen);
-    // reply
-    return client.iochan.write(response, 2);
+
+    // check, a reload may swap the store meanwhile
+    boost::shared_ptr<const CredentialStore> creds = boost::atomic_load(&this->creds);
+    bool ok = creds && creds->verify(user, ulen, pass, plen);
+    state = ok ? IServerHandler::AUTH_STATE_DONE : IServerHandler::AUTH_STATE_FAIL;
+    return reply_userpass(client, ok);
 }
 
 void PasswordServerHandler::auth_end(ClientConn &client) {
     (void)client;
 }
+
+void PasswordServerHandler::set_credentials(const boost::shared_ptr<const CredentialStore> &creds) {
+    boost::atomic_store(&this->creds, creds);
+}
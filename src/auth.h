@@ -2,10 +2,13 @@
 #define EVSOCKS_AUTH_H
 
 #include <stdint.h>
+#include <cstddef>
 #include <string>
 #include <set>
-#include <map>
 
+#include <boost/shared_ptr.hpp>
+
+#include "credentials.h"
 #include "error.h"
 
 
@@ -13,40 +16,82 @@ namespace evsocks {
 
     class ClientConn;
 
+    // set of auth methods offered by a greeting, no allocation
+    struct MethodSet {
+        uint32_t bits[8];
+
+        MethodSet() {
+            for (size_t i = 0; i < 8; ++i) {
+                this->bits[i] = 0;
+            }
+        }
+
+        void add(uint8_t method) {
+            this->bits[method >> 5] |= 1u << (method & 31);
+        }
+        bool has(uint8_t method) const {
+            return (this->bits[method >> 5] >> (method & 31)) & 1;
+        }
+        std::set<uint8_t> to_set() const;
+    };
+
     struct IServerHandler {
         enum AuthState {
             AUTH_STATE_NONE = 0,
             AUTH_STATE_DONE = 1,
             AUTH_STATE_FAIL = 2,
             AUTH_STATE_CONT = 3,
+            // decided later, reading is paused until the handler calls Server::on_auth_result()
+            // from the loop thread of the client. auth_end() cancels it if the session ends first.
+            AUTH_STATE_PENDING = 4,
+            // failed without a decision on the credentials, e.g. the backend is unreachable.
+            // Ends the session like AUTH_STATE_FAIL, but is not a result to remember.
+            AUTH_STATE_ERROR = 5,
         };
 
         // choose auth method.
-        // If METHOD_REJECT is chosen, auth_perform or auth_end will not be called
-        virtual uint8_t auth_begin(const std::set<uint8_t> &methods) = 0;
-        // perform authentication
-        virtual Error auth_perform(ClientConn &client, uint32_t &state) = 0;
+        // If METHOD_REJECT is chosen, auth_perform or auth_end will not be called.
+        // Called by the server, defaults to the std::set overload.
+        virtual uint8_t auth_begin(const MethodSet &methods);
+        // for handlers predating MethodSet, rejects by default
+        virtual uint8_t auth_begin(const std::set<uint8_t> &methods);
+        // perform authentication on the data received so far, used is set to the bytes consumed.
+        // data is only valid during the call, bytes not consumed are passed again with more data.
+        virtual Error auth_perform(ClientConn &client, const char *data, size_t size, size_t &used, uint32_t &state) = 0;
+        // result of an AUTH_STATE_PENDING auth passed to Server::on_auth_result(), before auth_end()
+        virtual void auth_result(ClientConn &client, uint32_t state);
         // clean up ClientConn.auth_ctx
         virtual void auth_end(ClientConn &client) = 0;
 
         virtual ~IServerHandler() {}
     };
 
+    // username/password auth request (RFC 1929), used is 0 if incomplete
+    Error parse_userpass(const char *data, size_t size, size_t &used,
+        const char *&user, uint8_t &user_len, const char *&pass, uint8_t &pass_len);
+    // reply to the username/password auth request
+    Error reply_userpass(ClientConn &client, bool ok);
+
     // No authentication
     struct DefaultServerHandler : IServerHandler {
-        virtual uint8_t auth_begin(const std::set<uint8_t> &methods);
-        virtual Error auth_perform(ClientConn &client, uint32_t &state);
+        using IServerHandler::auth_begin;
+        virtual uint8_t auth_begin(const MethodSet &methods);
+        virtual Error auth_perform(ClientConn &client, const char *data, size_t size, size_t &used, uint32_t &state);
         virtual void auth_end(ClientConn &client);
     };
 
     // Username/password authentication
     struct PasswordServerHandler : IServerHandler {
-        virtual uint8_t auth_begin(const std::set<uint8_t> &methods);
-        virtual Error auth_perform(ClientConn &client, uint32_t &state);
+        using IServerHandler::auth_begin;
+        virtual uint8_t auth_begin(const MethodSet &methods);
+        virtual Error auth_perform(ClientConn &client, const char *data, size_t size, size_t &used, uint32_t &state);
         virtual void auth_end(ClientConn &client);
 
-        // param
-        std::map<std::string, std::string> user2pass;
+        // replaces all users, safe while other threads perform auth
+        void set_credentials(const boost::shared_ptr<const CredentialStore> &creds);
+
+        // private
+        boost::shared_ptr<const CredentialStore> creds;
     };
 
 }
@@ -0,0 +1,170 @@
+#include <cstring>
+
+#include "authcache.h"
+#include "crypto_util.h"
+#include "sha256.h"
+#include "socksdef.h"
+#include "server.h"
+
+
+using namespace evsocks;
+
+
+Error CachingServerHandler::init() {
+    assert(this->inner != NULL);
+    Error err = random_bytes(this->secret, sizeof(this->secret));
+    if (!err.ok()) {
+        return err;
+    }
+
+    size_t n = k_ways;
+    while (n < this->capacity) {
+        n <<= 1;
+    }
+    Entry empty;
+    ::memset(&empty, 0, sizeof(empty));
+    this->entries.assign(n, empty);
+    this->mask = n - 1;
+    return Ok();
+}
+
+void CachingServerHandler::clear() {
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    this->generation++;
+    for (size_t i = 0; i < this->entries.size(); ++i) {
+        this->entries[i].expires = 0;
+    }
+}
+
+uint8_t CachingServerHandler::auth_begin(const MethodSet &methods) {
+    return this->inner->auth_begin(methods);
+}
+
+Error CachingServerHandler::auth_perform(ClientConn &client, const char *data, size_t size, size_t &used, uint32_t &state) {
+    if (client.auth_method != METHOD_USERNAME) {
+        return this->inner->auth_perform(client, data, size, used, state);
+    }
+
+    const char *user = NULL;
+    const char *pass = NULL;
+    uint8_t ulen = 0;
+    uint8_t plen = 0;
+    Error err = parse_userpass(data, size, used, user, ulen, pass, plen);
+    if (!err.ok()) {
+        return err;
+    }
+    if (used == 0) {
+        state = IServerHandler::AUTH_STATE_CONT;
+        return Ok();
+    }
+
+    Key key = this->make_key(user, ulen, pass, plen);
+    ev_tstamp now = ev_now(client.server->loop);
+    // taken before the inner handler looks at the users
+    uint64_t generation = 0;
+    int cached = this->lookup(key, now, generation);
+    if (cached >= 0) {
+        this->hits.fetch_add(1, boost::memory_order_relaxed);
+        state = cached ? IServerHandler::AUTH_STATE_DONE : IServerHandler::AUTH_STATE_FAIL;
+        return reply_userpass(client, cached != 0);
+    }
+    this->misses.fetch_add(1, boost::memory_order_relaxed);
+
+    err = this->inner->auth_perform(client, data, size, used, state);
+    if (!err.ok()) {
+        return err;
+    }
+    if (state == IServerHandler::AUTH_STATE_DONE || state == IServerHandler::AUTH_STATE_FAIL) {
+        this->store(key, state == IServerHandler::AUTH_STATE_DONE, now, generation);
+    } else if (state == IServerHandler::AUTH_STATE_PENDING) {
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        Pending &pending = this->pending[&client];
+        pending.key = key;
+        pending.generation = generation;
+    }
+    return Ok();
+}
+
+void CachingServerHandler::auth_result(ClientConn &client, uint32_t state) {
+    if (client.auth_method == METHOD_USERNAME) {
+        boost::unique_lock<boost::mutex> lock(this->mutex);
+        map<const ClientConn *, Pending>::iterator it = this->pending.find(&client);
+        if (it != this->pending.end()) {
+            Pending pending = it->second;
+            this->pending.erase(it);
+            lock.unlock();
+            if (state == IServerHandler::AUTH_STATE_DONE || state == IServerHandler::AUTH_STATE_FAIL) {
+                this->store(pending.key, state == IServerHandler::AUTH_STATE_DONE,
+                            ev_now(client.server->loop), pending.generation);
+            }
+        }
+    }
+    this->inner->auth_result(client, state);
+}
+
+void CachingServerHandler::auth_end(ClientConn &client) {
+    if (client.auth_method == METHOD_USERNAME) {
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        this->pending.erase(&client);
+    }
+    this->inner->auth_end(client);
+}
+
+// SHA-256 of secret + user + pass, lengths prefixed
+CachingServerHandler::Key CachingServerHandler::make_key(
+    const char *user, uint8_t user_len, const char *pass, uint8_t pass_len) const
+{
+    Sha256 ctx;
+    ctx.update(this->secret, sizeof(this->secret));
+    ctx.update(&user_len, 1);
+    ctx.update(user, user_len);
+    ctx.update(&pass_len, 1);
+    ctx.update(pass, pass_len);
+    uint8_t digest[Sha256::k_size];
+    ctx.final(digest);
+
+    Key key;
+    ::memcpy(key.h, digest, sizeof(key.h));
+    return key;
+}
+
+int CachingServerHandler::lookup(const Key &key, ev_tstamp now, uint64_t &generation) {
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    generation = this->generation;
+    size_t base = key.h[0] & this->mask & ~(k_ways - 1);
+    for (size_t i = base; i < base + k_ways; ++i) {
+        const Entry &entry = this->entries[i];
+        if (entry.expires > now && entry.key == key) {
+            return entry.ok ? 1 : 0;
+        }
+    }
+    return -1;
+}
+
+void CachingServerHandler::store(const Key &key, bool ok, ev_tstamp now, uint64_t generation) {
+    ev_tstamp ttl = ok ? this->positive_ttl : this->negative_ttl;
+    if (ttl <= 0) {
+        return;
+    }
+
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    if (generation != this->generation) {
+        return;     // made with the users before a reload
+    }
+    size_t base = key.h[0] & this->mask & ~(k_ways - 1);
+    // same key, else the one expiring first, expired and empty ones included
+    Entry *victim = &this->entries[base];
+    for (size_t i = base; i < base + k_ways; ++i) {
+        Entry &entry = this->entries[i];
+        if (entry.expires > 0 && entry.key == key) {
+            victim = &entry;
+            break;
+        }
+        if (entry.expires < victim->expires) {
+            victim = &entry;
+        }
+    }
+    victim->key = key;
+    victim->expires = now + ttl;
+    victim->ok = ok;
+}
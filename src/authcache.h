@@ -0,0 +1,92 @@
+#ifndef EVSOCKS_AUTHCACHE_H
+#define EVSOCKS_AUTHCACHE_H
+
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+
+#include <ev.h>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "auth.h"
+#include "error.h"
+
+
+namespace evsocks {
+    using namespace std;
+
+
+    // Caches username/password auth decisions of another handler, shared by all loops.
+    // Entries are keyed by a hash of the username and password with a random secret,
+    // neither is kept. Each key maps to a few slots, the entry expiring first is evicted.
+    // Only decisions are cached, AUTH_STATE_ERROR of the inner handler is not.
+    // clear() starts a new generation, decisions made before it are not stored.
+    struct CachingServerHandler : IServerHandler {
+        static const size_t k_ways = 8;
+
+        struct Key {
+            uint64_t h[2];
+
+            bool operator==(const Key &rhs) const {
+                return this->h[0] == rhs.h[0] && this->h[1] == rhs.h[1];
+            }
+        };
+
+        struct Entry {
+            Key key;
+            ev_tstamp expires;  // 0 for empty
+            bool ok;
+        };
+
+        // param
+        IServerHandler *inner;
+        ev_tstamp positive_ttl;
+        ev_tstamp negative_ttl;
+        size_t capacity;            // rounded up to a power of 2
+
+        // readonly
+        boost::atomic<uint64_t> hits;
+        boost::atomic<uint64_t> misses;
+
+        // private
+        struct Pending {
+            Key key;
+            uint64_t generation;
+        };
+
+        boost::mutex mutex;
+        uint8_t secret[16];
+        vector<Entry> entries;      // guarded by mutex
+        size_t mask;
+        uint64_t generation;        // guarded by mutex, bumped by clear()
+        map<const ClientConn *, Pending> pending;   // guarded by mutex, AUTH_STATE_PENDING of inner
+
+        // public
+        CachingServerHandler()
+            : inner(NULL), positive_ttl(60), negative_ttl(5), capacity(65536), hits(0), misses(0), mask(0)
+            , generation(0)
+        {}
+
+        Error init();
+        // drop all decisions, e.g. after the users changed, and those still being made
+        void clear();
+
+        using IServerHandler::auth_begin;
+        virtual uint8_t auth_begin(const MethodSet &methods);
+        virtual Error auth_perform(ClientConn &client, const char *data, size_t size, size_t &used, uint32_t &state);
+        virtual void auth_result(ClientConn &client, uint32_t state);
+        virtual void auth_end(ClientConn &client);
+
+        // private
+        Key make_key(const char *user, uint8_t user_len, const char *pass, uint8_t pass_len) const;
+        // 1 for ok, 0 for failed, -1 if not cached, generation is set to the current one
+        int lookup(const Key &key, ev_tstamp now, uint64_t &generation);
+        // dropped if the decision was made in an older generation
+        void store(const Key &key, bool ok, ev_tstamp now, uint64_t generation);
+    };
+}
+
+
+#endif //EVSOCKS_AUTHCACHE_H
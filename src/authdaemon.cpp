@@ -0,0 +1,258 @@
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "authdaemon.h"
+#include "crypto_util.h"
+#include "socksdef.h"
+#include "server.h"
+#include "net.h"
+#include "ctxlog/ctxlog_evsocks.hpp"
+
+
+using namespace evsocks;
+
+
+// Conn is not standard-layout, watchers point back with their data field
+static void conn_reader_cb(EV_P_ ev_io *io, int revents) {
+    (void)revents;
+    AuthDaemonHandler::Conn &conn = *(AuthDaemonHandler::Conn *)io->data;
+    conn.handler->on_readable(conn);
+}
+
+static void conn_writer_cb(EV_P_ ev_io *io, int revents) {
+    (void)revents;
+    AuthDaemonHandler::Conn &conn = *(AuthDaemonHandler::Conn *)io->data;
+    conn.handler->on_writable(conn);
+}
+
+// nothing to wait for, do not keep the loop alive
+static void check_idle(AuthDaemonHandler::Conn &conn) {
+    if (conn.pending.empty()) {
+        ev_io_stop(conn.loop, &conn.reader_io);
+        ev_io_stop(conn.loop, &conn.writer_io);
+    }
+}
+
+
+AuthDaemonHandler::~AuthDaemonHandler() {
+    for (map<struct ev_loop *, Conn *>::iterator it = this->conns.begin(); it != this->conns.end(); ++it) {
+        Conn *conn = it->second;
+        assert(conn->pending.empty());
+        if (conn->fd >= 0) {
+            ::close(conn->fd);
+        }
+        delete conn;
+    }
+}
+
+uint8_t AuthDaemonHandler::auth_begin(const MethodSet &methods) {
+    return methods.has(METHOD_USERNAME) ? (uint8_t)METHOD_USERNAME : (uint8_t)METHOD_REJECT;
+}
+
+AuthDaemonHandler::Conn &AuthDaemonHandler::get_conn(struct ev_loop *loop) {
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    Conn *&conn = this->conns[loop];
+    if (conn == NULL) {
+        conn = new Conn();
+        conn->loop = loop;
+        conn->handler = this;
+        ev_io_init(&conn->reader_io, conn_reader_cb, -1, EV_READ);
+        ev_io_init(&conn->writer_io, conn_writer_cb, -1, EV_WRITE);
+        conn->reader_io.data = conn;
+        conn->writer_io.data = conn;
+    }
+    return *conn;
+}
+
+Error AuthDaemonHandler::connect(Conn &conn) {
+    struct sockaddr_un sa;
+    ::memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (this->path.size() >= sizeof(sa.sun_path)) {
+        return Error(ERR_CONNECT, ENAMETOOLONG, strfmt("bad auth daemon [path:%s]", this->path.c_str()));
+    }
+    ::memcpy(sa.sun_path, this->path.data(), this->path.size());
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return Error(ERR_SOCKET, errno, "socket() failed for the auth daemon");
+    }
+    // completes at once or fails for unix sockets
+    if (::connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        int err = errno;
+        ::close(fd);
+        return Error(ERR_CONNECT, err, strfmt("connect() failed for the auth daemon [path:%s]", this->path.c_str()));
+    }
+
+    conn.fd = fd;
+    conn.input.clear();
+    ev_io_set(&conn.reader_io, fd, EV_READ);
+    ev_io_set(&conn.writer_io, fd, EV_WRITE);
+    return Ok();
+}
+
+Error AuthDaemonHandler::auth_perform(ClientConn &client, const char *data, size_t size, size_t &used, uint32_t &state) {
+    const char *user = NULL;
+    const char *pass = NULL;
+    uint8_t ulen = 0;
+    uint8_t plen = 0;
+    Error err = parse_userpass(data, size, used, user, ulen, pass, plen);
+    if (!err.ok()) {
+        return err;
+    }
+    if (used == 0) {
+        state = IServerHandler::AUTH_STATE_CONT;
+        return Ok();
+    }
+
+    Conn &conn = this->get_conn(client.server->loop);
+    if (conn.pending.size() >= this->max_pending) {
+        CTXLOG_WARN("too many pending auths. [max_pending:%zu]", this->max_pending);
+        state = IServerHandler::AUTH_STATE_ERROR;
+        return reply_userpass(client, false);
+    }
+    if (conn.fd < 0) {
+        err = this->connect(conn);
+        if (!err.ok()) {
+            CTXLOG_ERR("%s", err.str().c_str());
+            state = IServerHandler::AUTH_STATE_ERROR;
+            return reply_userpass(client, false);
+        }
+    }
+
+    uint64_t id = conn.next_id++;
+    conn.output += strfmt("%llu ", (unsigned long long)id);
+    append_hex(conn.output, user, ulen);
+    conn.output += ' ';
+    append_hex(conn.output, pass, plen);
+    conn.output += '\n';
+
+    err = this->send(conn);
+    if (!err.ok()) {
+        // this client is not pending yet, fail_all() resumes the others
+        this->fail_all(conn, err);
+        state = IServerHandler::AUTH_STATE_ERROR;
+        return reply_userpass(client, false);
+    }
+
+    conn.pending[id] = &client;
+    client.auth_ctx = (void *)(uintptr_t)id;
+    ev_io_start(conn.loop, &conn.reader_io);
+    state = IServerHandler::AUTH_STATE_PENDING;
+    return Ok();
+}
+
+void AuthDaemonHandler::auth_end(ClientConn &client) {
+    if (client.auth_ctx == NULL) {
+        return;
+    }
+    // the response is dropped when it comes
+    Conn &conn = this->get_conn(client.server->loop);
+    conn.pending.erase((uint64_t)(uintptr_t)client.auth_ctx);
+    client.auth_ctx = NULL;
+    check_idle(conn);
+}
+
+Error AuthDaemonHandler::send(Conn &conn) {
+    size_t written = 0;
+    while (written < conn.output.size()) {
+        ssize_t n = ::write(conn.fd, conn.output.data() + written, conn.output.size() - written);
+        if (n < 0) {
+            if (net_is_again(errno)) {
+                break;
+            }
+            return Error(ERR_WRITE, errno, "write() failed for the auth daemon");
+        }
+        written += (size_t)n;
+    }
+    conn.output.erase(0, written);
+
+    if (conn.output.empty()) {
+        ev_io_stop(conn.loop, &conn.writer_io);
+    } else {
+        ev_io_start(conn.loop, &conn.writer_io);
+    }
+    return Ok();
+}
+
+void AuthDaemonHandler::on_writable(Conn &conn) {
+    CTXLOG_PUSH_FUNC();
+    Error err = this->send(conn);
+    if (!err.ok()) {
+        return this->fail_all(conn, err);
+    }
+}
+
+void AuthDaemonHandler::on_readable(Conn &conn) {
+    CTXLOG_PUSH_FUNC();
+    char buf[4096];
+    ssize_t n = ::read(conn.fd, buf, sizeof(buf));
+    if (n < 0) {
+        if (net_is_again(errno)) {
+            return;
+        }
+        return this->fail_all(conn, Error(ERR_READ, errno, "read() failed for the auth daemon"));
+    }
+    if (n == 0) {
+        return this->fail_all(conn, Error(ERR_EOF, 0, "auth daemon closed the connection"));
+    }
+    conn.input.append(buf, (size_t)n);
+
+    // "ID OK" or "ID FAIL" per line
+    size_t pos = 0;
+    size_t eol;
+    while ((eol = conn.input.find('\n', pos)) != string::npos) {
+        string line = conn.input.substr(pos, eol - pos);
+        pos = eol + 1;
+
+        char *end = NULL;
+        uint64_t id = ::strtoull(line.c_str(), &end, 10);
+        string result = end != NULL && *end == ' ' ? string(end + 1) : string();
+        if (result != "OK" && result != "FAIL") {
+            conn.input.erase(0, pos);
+            return this->fail_all(conn, Error(ERR_BAD_PACKET, 0, strfmt("bad auth daemon response [line:%s]", line.c_str())));
+        }
+        this->on_result(conn, id, result == "OK");
+    }
+    conn.input.erase(0, pos);
+}
+
+void AuthDaemonHandler::on_result(Conn &conn, uint64_t id, bool ok) {
+    map<uint64_t, ClientConn *>::iterator it = conn.pending.find(id);
+    if (it == conn.pending.end()) {
+        return;     // session gone
+    }
+    ClientConn &client = *it->second;
+    conn.pending.erase(it);
+    client.auth_ctx = NULL;
+    check_idle(conn);
+
+    CTXLOG_PUSH_FUNC().set("client", client.addr_str);
+    Error err = reply_userpass(client, ok);
+    if (!err.ok()) {
+        return client.server->on_client_error(client, err);
+    }
+    client.server->on_auth_result(client, ok ? AUTH_STATE_DONE : AUTH_STATE_FAIL);
+}
+
+void AuthDaemonHandler::fail_all(Conn &conn, const Error &err) {
+    CTXLOG_ERR("%s, failing [pending:%zu]", err.str().c_str(), conn.pending.size());
+    ev_io_stop(conn.loop, &conn.reader_io);
+    ev_io_stop(conn.loop, &conn.writer_io);
+    ::close(conn.fd);
+    conn.fd = -1;
+    conn.input.clear();
+    conn.output.clear();
+
+    map<uint64_t, ClientConn *> pending;
+    pending.swap(conn.pending);
+    for (map<uint64_t, ClientConn *>::iterator it = pending.begin(); it != pending.end(); ++it) {
+        ClientConn &client = *it->second;
+        client.auth_ctx = NULL;
+        reply_userpass(client, false);
+        client.server->on_auth_result(client, AUTH_STATE_ERROR);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef EVSOCKS_AUTHDAEMON_H
+#define EVSOCKS_AUTHDAEMON_H
+
+
+#include <stdint.h>
+#include <string>
+#include <map>
+
+#include <ev.h>
+#include <boost/thread/mutex.hpp>
+
+#include "auth.h"
+#include "error.h"
+
+
+namespace evsocks {
+    using namespace std;
+
+
+    // Username/password authentication decided by a local daemon over a unix stream socket.
+    // Each loop has its own connection, requests are pipelined and answered in any order:
+    //      request:    "ID USER PASS\n"    USER and PASS in hex
+    //      response:   "ID OK\n" or "ID FAIL\n"
+    // Pending requests fail with AUTH_STATE_ERROR when the connection is lost, the next auth reconnects.
+    struct AuthDaemonHandler : IServerHandler {
+        // connection of one loop, used by its thread only
+        struct Conn {
+            ev_io reader_io;
+            ev_io writer_io;
+            struct ev_loop *loop;
+            AuthDaemonHandler *handler;
+            int fd;
+            uint64_t next_id;
+            map<uint64_t, ClientConn *> pending;
+            string output;
+            string input;
+
+            Conn() : loop(NULL), handler(NULL), fd(-1), next_id(1) {}
+        };
+
+        // param
+        string path;
+        size_t max_pending;     // per loop, auths over it fail right away
+
+        // private
+        boost::mutex mutex;
+        map<struct ev_loop *, Conn *> conns;    // guarded by mutex
+
+        // public
+        AuthDaemonHandler() : max_pending(256) {}
+        // after the loops are stopped
+        ~AuthDaemonHandler();
+
+        using IServerHandler::auth_begin;
+        virtual uint8_t auth_begin(const MethodSet &methods);
+        virtual Error auth_perform(ClientConn &client, const char *data, size_t size, size_t &used, uint32_t &state);
+        virtual void auth_end(ClientConn &client);
+
+        // private
+        Conn &get_conn(struct ev_loop *loop);
+        Error connect(Conn &conn);
+        Error send(Conn &conn);
+        void on_readable(Conn &conn);
+        void on_writable(Conn &conn);
+        void on_result(Conn &conn, uint64_t id, bool ok);
+        void fail_all(Conn &conn, const Error &err);
+    };
+}
+
+
+#endif //EVSOCKS_AUTHDAEMON_H
@@ -0,0 +1,133 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <boost/thread/tss.hpp>
+
+#include "chunkqueue.h"
+
+
+using namespace evsocks;
+
+
+static const size_t k_max_idle_chunks = 256;
+
+namespace {
+    struct FreeList {
+        Chunk *head;
+        size_t count;
+
+        FreeList() : head(NULL), count(0) {}
+        ~FreeList() {
+            while (this->head != NULL) {
+                Chunk *next = this->head->next;
+                ::free(this->head);
+                this->head = next;
+            }
+        }
+    };
+}
+
+static boost::thread_specific_ptr<FreeList> g_free_list;
+
+static FreeList &free_list() {
+    FreeList *fl = g_free_list.get();
+    if (fl == NULL) {
+        fl = new FreeList();
+        g_free_list.reset(fl);
+    }
+    return *fl;
+}
+
+
+Chunk *ChunkPool::alloc() {
+    FreeList &fl = free_list();
+    Chunk *chunk = fl.head;
+    if (chunk != NULL) {
+        fl.head = chunk->next;
+        fl.count--;
+    } else {
+        chunk = (Chunk *)::malloc(sizeof(Chunk));
+        if (chunk == NULL) {
+            throw std::bad_alloc();
+        }
+    }
+    chunk->next = NULL;
+    chunk->begin = chunk->end = 0;
+    return chunk;
+}
+
+void ChunkPool::release(Chunk *chunk) {
+    FreeList &fl = free_list();
+    if (fl.count >= k_max_idle_chunks) {
+        ::free(chunk);
+        return;
+    }
+    chunk->next = fl.head;
+    fl.head = chunk;
+    fl.count++;
+}
+
+size_t ChunkPool::idle() {
+    return free_list().count;
+}
+
+
+void ChunkQueue::push(const char *data, size_t count) {
+    while (count > 0) {
+        if (this->tail == NULL || this->tail->end == Chunk::k_size) {
+            Chunk *chunk = ChunkPool::alloc();
+            if (this->tail == NULL) {
+                this->head = this->tail = chunk;
+            } else {
+                this->tail->next = chunk;
+                this->tail = chunk;
+            }
+        }
+
+        size_t n = std::min(count, Chunk::k_size - this->tail->end);
+        ::memcpy(this->tail->data + this->tail->end, data, n);
+        this->tail->end += n;
+        this->bytes += n;
+        data += n;
+        count -= n;
+    }
+}
+
+size_t ChunkQueue::peekv(struct iovec *iov, size_t iovcnt) const {
+    size_t i = 0;
+    for (Chunk *chunk = this->head; chunk != NULL && i < iovcnt; chunk = chunk->next, ++i) {
+        iov[i].iov_base = chunk->data + chunk->begin;
+        iov[i].iov_len = chunk->end - chunk->begin;
+    }
+    return i;
+}
+
+void ChunkQueue::pop(size_t count) {
+    assert(count <= this->bytes);
+    this->bytes -= count;
+    while (count > 0) {
+        assert(this->head != NULL);
+        size_t n = std::min(count, this->head->end - this->head->begin);
+        this->head->begin += n;
+        count -= n;
+        if (this->head->begin == this->head->end) {
+            Chunk *next = this->head->next;
+            ChunkPool::release(this->head);
+            this->head = next;
+        }
+    }
+    if (this->head == NULL) {
+        this->tail = NULL;
+    }
+}
+
+void ChunkQueue::clear() {
+    while (this->head != NULL) {
+        Chunk *next = this->head->next;
+        ChunkPool::release(this->head);
+        this->head = next;
+    }
+    this->tail = NULL;
+    this->bytes = 0;
+}
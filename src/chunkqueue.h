@@ -0,0 +1,75 @@
+#ifndef EVSOCKS_CHUNKQUEUE_H
+#define EVSOCKS_CHUNKQUEUE_H
+
+#include <cassert>
+#include <cstddef>
+#include <algorithm>
+#include <sys/uio.h>
+
+
+namespace evsocks {
+
+    struct Chunk {
+        static const size_t k_size = 16 * 1024;
+
+        Chunk *next;
+        size_t begin;
+        size_t end;
+        char data[k_size];
+    };
+
+    // fixed-size chunks recycled through a per-thread free list.
+    // A chunk may be released by a thread other than the allocating one.
+    struct ChunkPool {
+        static Chunk *alloc();
+        static void release(Chunk *chunk);
+        static size_t idle();   // of the calling thread
+    };
+
+    // a chain of chunks, push never moves queued data
+    class ChunkQueue {
+    public:
+        ChunkQueue() : head(NULL), tail(NULL), bytes(0) {}
+        ~ChunkQueue() { this->clear(); }
+
+        void push(const char *data, size_t count);
+
+        // the first contiguous block
+        void peek(const char *&data, size_t &count) const {
+            if (this->head == NULL) {
+                data = NULL;
+                count = 0;
+            } else {
+                data = this->head->data + this->head->begin;
+                count = this->head->end - this->head->begin;
+            }
+        }
+
+        // fill up to iovcnt blocks, returns the number filled
+        size_t peekv(struct iovec *iov, size_t iovcnt) const;
+
+        // drained chunks go back to the pool
+        void pop(size_t count);
+        void clear();
+
+        size_t size() const { return this->bytes; }
+        bool empty() const { return this->bytes == 0; }
+
+        void swap(ChunkQueue &rhs) {
+            std::swap(this->head, rhs.head);
+            std::swap(this->tail, rhs.tail);
+            std::swap(this->bytes, rhs.bytes);
+        }
+
+    private:
+        Chunk *head;
+        Chunk *tail;
+        size_t bytes;
+
+        // noncopyable
+        ChunkQueue(const ChunkQueue &);
+        ChunkQueue &operator=(const ChunkQueue &);
+    };
+}
+
+#endif //EVSOCKS_CHUNKQUEUE_H
@@ -0,0 +1,208 @@
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+
+#include "credentials.h"
+#include "crypto_util.h"
+#include "conv_util.hpp"
+
+
+using namespace evsocks;
+
+
+// PBKDF2, or the salted SHA-256 of $s256$ with 0 iterations
+static void derive(const uint8_t *salt, uint32_t iterations, const char *pass, size_t pass_len,
+                   uint8_t hash[Sha256::k_size])
+{
+    if (iterations == 0) {
+        Sha256 ctx;
+        ctx.update(salt, CredentialStore::k_salt_size);
+        ctx.update(pass, pass_len);
+        ctx.final(hash);
+        return;
+    }
+    pbkdf2_sha256(pass, pass_len, salt, CredentialStore::k_salt_size, iterations, hash, Sha256::k_size);
+}
+
+
+Error CredentialStore::add(const string &user, const string &password) {
+    uint8_t salt[k_salt_size];
+    Error err = random_bytes(salt, sizeof(salt));
+    if (!err.ok()) {
+        return err;
+    }
+    uint8_t hash[Sha256::k_size];
+    derive(salt, this->iterations, password.data(), password.size(), hash);
+    this->add_hashed(user, this->iterations, salt, hash);
+    return Ok();
+}
+
+void CredentialStore::add_hashed(const string &user, uint32_t iterations,
+                                 const uint8_t salt[k_salt_size], const uint8_t hash[Sha256::k_size])
+{
+    Cred cred;
+    cred.name_off = (uint32_t)this->names.size();
+    cred.name_len = (uint32_t)user.size();
+    cred.iterations = iterations;
+    ::memcpy(cred.salt, salt, k_salt_size);
+    ::memcpy(cred.hash, hash, Sha256::k_size);
+    this->names.insert(this->names.end(), user.begin(), user.end());
+    this->creds.push_back(cred);
+}
+
+Error CredentialStore::load(const string &path) {
+    std::ifstream file(path.c_str());
+    if (!file) {
+        return Error(ERR_OPEN, errno, strfmt("can not open [path:%s]", path.c_str()));
+    }
+
+    string line;
+    size_t lineno = 0;
+    while (std::getline(file, line)) {
+        lineno++;
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        // lengths are limited by the username/password auth messages
+        size_t colon = line.find(':');
+        if (colon == string::npos || colon == 0 || colon > 255 || line.size() - colon - 1 > 255) {
+            return Error(ERR_BAD_FILE, 0, strfmt("bad user at [path:%s][line:%zu]", path.c_str(), lineno));
+        }
+        string user = line.substr(0, colon);
+        string secret = line.substr(colon + 1);
+
+        bool pbkdf2 = secret.compare(0, 6, "$p256$") == 0;
+        if (!pbkdf2 && secret.compare(0, 6, "$s256$") != 0) {
+            Error err = this->add(user, secret);
+            if (!err.ok()) {
+                return err;
+            }
+            continue;
+        }
+        size_t pos = 6;
+        uint32_t iterations = 0;
+        if (pbkdf2) {
+            size_t end = secret.find('$', pos);
+            string digits = secret.substr(pos, end == string::npos ? string::npos : end - pos);
+            iterations = tz::cast<string, uint32_t>(digits, 0u);
+            if (end == string::npos || digits.find_first_not_of("0123456789") != string::npos
+                || iterations == 0 || iterations > k_max_iterations)
+            {
+                return Error(ERR_BAD_FILE, 0, strfmt("bad password hash at [path:%s][line:%zu]", path.c_str(), lineno));
+            }
+            pos = end + 1;
+        }
+        size_t dollar = secret.find('$', pos);
+        uint8_t salt[k_salt_size];
+        uint8_t hash[Sha256::k_size];
+        if (dollar == string::npos
+            || !from_hex(secret.substr(pos, dollar - pos), salt, sizeof(salt))
+            || !from_hex(secret.substr(dollar + 1), hash, sizeof(hash)))
+        {
+            return Error(ERR_BAD_FILE, 0, strfmt("bad password hash at [path:%s][line:%zu]", path.c_str(), lineno));
+        }
+        this->add_hashed(user, iterations, salt, hash);
+    }
+    if (file.bad()) {
+        return Error(ERR_READ, errno, strfmt("read error [path:%s]", path.c_str()));
+    }
+    return Ok();
+}
+
+// FNV-1a
+size_t CredentialStore::hash_name(const char *name, size_t size) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void CredentialStore::build() {
+    // load factor <= 1/2
+    size_t n = 16;
+    while (n < this->creds.size() * 2) {
+        n <<= 1;
+    }
+    this->slots.assign(n, 0);
+    this->mask = n - 1;
+    this->nobody_iterations = this->creds.empty() ? this->iterations : 0;
+
+    for (size_t idx = 0; idx < this->creds.size(); ++idx) {
+        const Cred &cred = this->creds[idx];
+        this->nobody_iterations = std::max(this->nobody_iterations, cred.iterations);
+        const char *name = this->name_of(cred);
+        size_t i = hash_name(name, cred.name_len) & this->mask;
+        for (;;) {
+            uint32_t slot = this->slots[i];
+            if (slot == 0) {
+                break;
+            }
+            const Cred &other = this->creds[slot - 1];
+            if (other.name_len == cred.name_len
+                && ::memcmp(this->name_of(other), name, cred.name_len) == 0)
+            {
+                break;  // duplicate
+            }
+            i = (i + 1) & this->mask;
+        }
+        this->slots[i] = (uint32_t)idx + 1;
+    }
+}
+
+const CredentialStore::Cred *CredentialStore::find(const char *user, size_t user_len) const {
+    if (this->slots.empty()) {
+        return NULL;
+    }
+    size_t i = hash_name(user, user_len) & this->mask;
+    for (;;) {
+        uint32_t slot = this->slots[i];
+        if (slot == 0) {
+            return NULL;
+        }
+        const Cred &cred = this->creds[slot - 1];
+        if (cred.name_len == user_len && ::memcmp(this->name_of(cred), user, user_len) == 0) {
+            return &cred;
+        }
+        i = (i + 1) & this->mask;
+    }
+}
+
+bool CredentialStore::verify(const char *user, size_t user_len, const char *pass, size_t pass_len) const {
+    Cred nobody = Cred();
+    const Cred *cred = this->find(user, user_len);
+    bool found = cred != NULL;
+    if (!found) {
+        nobody.iterations = this->nobody_iterations;
+        cred = &nobody;     // hash anyway
+    }
+
+    uint8_t hash[Sha256::k_size];
+    derive(cred->salt, cred->iterations, pass, pass_len, hash);
+    uint8_t diff = 0;
+    for (size_t i = 0; i < Sha256::k_size; ++i) {
+        diff |= hash[i] ^ cred->hash[i];
+    }
+    return found & (diff == 0);
+}
+
+Error CredentialStore::hash_password(const string &password, uint32_t iterations, string &out) {
+    uint8_t salt[k_salt_size];
+    Error err = random_bytes(salt, sizeof(salt));
+    if (!err.ok()) {
+        return err;
+    }
+    uint8_t hash[Sha256::k_size];
+    derive(salt, iterations, password.data(), password.size(), hash);
+
+    out = strfmt("$p256$%u$", iterations);
+    append_hex(out, salt, sizeof(salt));
+    out += '$';
+    append_hex(out, hash, sizeof(hash));
+    return Ok();
+}
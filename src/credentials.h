@@ -0,0 +1,81 @@
+#ifndef EVSOCKS_CREDENTIALS_H
+#define EVSOCKS_CREDENTIALS_H
+
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "sha256.h"
+#include "error.h"
+
+
+namespace evsocks {
+    using namespace std;
+
+
+    // Users with PBKDF2-HMAC-SHA256 password hashes, read only once built.
+    // User names are interned in one buffer and indexed by an open addressing table.
+    //
+    // File format, one user per line, empty lines and lines starting with '#' are skipped:
+    //      user:password
+    //      user:$p256$ITERATIONS$SALT$HASH
+    //      user:$s256$SALT$HASH
+    // SALT is 16 bytes in hex, HASH is hex of PBKDF2-HMAC-SHA256(password, SALT, ITERATIONS),
+    // see hash_password(). $s256$ hashes of SHA-256(SALT + password) are still read.
+    struct CredentialStore {
+        static const size_t k_salt_size = 16;
+        static const uint32_t k_default_iterations = 1000;
+        static const uint32_t k_max_iterations = 10000000;
+
+        struct Cred {
+            uint32_t name_off;
+            uint32_t name_len;
+            uint32_t iterations;    // 0 for $s256$
+            uint8_t salt[k_salt_size];
+            uint8_t hash[Sha256::k_size];
+        };
+
+        // param
+        uint32_t iterations;    // of the passwords hashed by add()
+
+        // private
+        vector<char> names;
+        vector<Cred> creds;
+        vector<uint32_t> slots;     // index into creds + 1, 0 for empty
+        size_t mask;
+        uint32_t nobody_iterations;     // unknown users cost as much as the most expensive hash
+
+        // public
+        CredentialStore() : iterations(k_default_iterations), mask(0), nobody_iterations(0) {}
+
+        // salted with random bytes
+        Error add(const string &user, const string &password);
+        void add_hashed(const string &user, uint32_t iterations,
+                        const uint8_t salt[k_salt_size], const uint8_t hash[Sha256::k_size]);
+        // appends the users of a file
+        Error load(const string &path);
+        // index users after adding, a later duplicate replaces the earlier one
+        void build();
+
+        size_t size() const {
+            return this->creds.size();
+        }
+        // constant time in the password, unknown users cost the same
+        bool verify(const char *user, size_t user_len, const char *pass, size_t pass_len) const;
+
+        // "$p256$ITERATIONS$SALT$HASH" of password with a random salt
+        static Error hash_password(const string &password, uint32_t iterations, string &out);
+
+        // private
+        const Cred *find(const char *user, size_t user_len) const;
+        // names is empty if all users have empty names
+        const char *name_of(const Cred &cred) const {
+            return this->names.empty() ? "" : &this->names[0] + cred.name_off;
+        }
+        static size_t hash_name(const char *name, size_t size);
+    };
+}
+
+
+#endif //EVSOCKS_CREDENTIALS_H
@@ -0,0 +1,59 @@
+#include <sys/random.h>
+
+#include "crypto_util.h"
+
+
+using namespace evsocks;
+
+
+Error evsocks::random_bytes(uint8_t *buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::getrandom(buf, size, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return Error(ERR_OPEN, errno, "getrandom() failed");
+        }
+        buf += n;
+        size -= (size_t)n;
+    }
+    return Ok();
+}
+
+void evsocks::append_hex(string &out, const void *data, size_t size) {
+    static const char k_digits[] = "0123456789abcdef";
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; ++i) {
+        out += k_digits[bytes[i] >> 4];
+        out += k_digits[bytes[i] & 0xf];
+    }
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool evsocks::from_hex(const string &hex, uint8_t *out, size_t size) {
+    if (hex.size() != size * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        int hi = hex_digit(hex[i * 2]);
+        int lo = hex_digit(hex[i * 2 + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return true;
+}
@@ -0,0 +1,24 @@
+#ifndef EVSOCKS_CRYPTO_UTIL_H
+#define EVSOCKS_CRYPTO_UTIL_H
+
+
+#include <stdint.h>
+#include <cstddef>
+#include <string>
+
+#include "error.h"
+
+
+namespace evsocks {
+    using namespace std;
+
+    // from getrandom(), blocks until the pool is initialized
+    Error random_bytes(uint8_t *buf, size_t size);
+    // lower case hex digits of data appended to out
+    void append_hex(string &out, const void *data, size_t size);
+    // exactly size bytes as size * 2 hex digits of either case
+    bool from_hex(const string &hex, uint8_t *out, size_t size);
+}
+
+
+#endif //EVSOCKS_CRYPTO_UTIL_H
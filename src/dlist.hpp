@@ -201,6 +201,11 @@ namespace tz {
         // TODO: erase range
         // TODO: splice
 
+        // erase without the list
+        static void unlink(reference value) {
+            get_node(value).detach();
+        }
+
         bool empty() const {
             return this->sentry.prev == &this->sentry;
         }
@@ -33,6 +33,7 @@ namespace evsocks {
         ERR_ACCEPT,
         ERR_LISTEN,
         ERR_SETSOCKOPT,
+        ERR_GETSOCKOPT,
         ERR_FD_NOT_FOUND,
         ERR_FD_INVALID,
         ERR_SHUTDOWN,
@@ -50,6 +51,13 @@ namespace evsocks {
         ERR_UNEXPECTED_DATA,
         ERR_BAD_PACKET,
         ERR_BAD_USERNAME_AUTH_VERSION,
+        ERR_EV_LOOP,
+        ERR_THREAD,
+        ERR_SPLICE,
+        ERR_OPEN,
+        ERR_MMAP,
+        ERR_BAD_FILE,
+        ERR_URING,
     };
 
     inline const char *ErrType2Str(ErrorType errtype) {
@@ -70,6 +78,7 @@ namespace evsocks {
         CASE_ARM(ERR_ACCEPT);
         CASE_ARM(ERR_LISTEN);
         CASE_ARM(ERR_SETSOCKOPT);
+        CASE_ARM(ERR_GETSOCKOPT);
         CASE_ARM(ERR_FD_NOT_FOUND);
         CASE_ARM(ERR_FD_INVALID);
         CASE_ARM(ERR_SHUTDOWN);
@@ -87,6 +96,13 @@ namespace evsocks {
         CASE_ARM(ERR_UNEXPECTED_DATA);
         CASE_ARM(ERR_BAD_PACKET);
         CASE_ARM(ERR_BAD_USERNAME_AUTH_VERSION);
+        CASE_ARM(ERR_EV_LOOP);
+        CASE_ARM(ERR_THREAD);
+        CASE_ARM(ERR_SPLICE);
+        CASE_ARM(ERR_OPEN);
+        CASE_ARM(ERR_MMAP);
+        CASE_ARM(ERR_BAD_FILE);
+        CASE_ARM(ERR_URING);
 #undef CASE_ARM
         default:
             assert(!"Unreachable");
@@ -0,0 +1,229 @@
+#include <cassert>
+#include <cstddef>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <boost/thread/locks.hpp>
+
+#include "eyeballs.h"
+#include "net.h"
+#include "ctxlog/ctxlog_evsocks.hpp"
+
+
+using namespace evsocks;
+
+
+
+EyeballStats::Family &EyeballStats::family_of(const string &name, int family) {
+    map<string, Dest>::iterator it = this->dests.find(name);
+    if (it == this->dests.end()) {
+        if (this->dests.size() >= this->max_entries) {
+            this->dests.clear();    // crude, history only orders attempts
+        }
+        it = this->dests.insert(make_pair(name, Dest())).first;
+    }
+    return family == AF_INET6 ? it->second.v6 : it->second.v4;
+}
+
+void EyeballStats::record(const string &name, int family, bool ok, ev_tstamp latency) {
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    Family &fam = this->family_of(name, family);
+    fam.attempts++;
+    if (ok) {
+        fam.successes++;
+        fam.latency += latency;
+    }
+}
+
+void EyeballStats::record_cancelled(const string &name, int family) {
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    this->family_of(name, family).cancelled++;
+}
+
+bool EyeballStats::get(const string &name, Dest &dest) {
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    map<string, Dest>::iterator it = this->dests.find(name);
+    if (it == this->dests.end()) {
+        return false;
+    }
+    dest = it->second;
+    return true;
+}
+
+int EyeballStats::preferred_family(const string &name) {
+    Dest dest;
+    if (this->get(name, dest) && dest.v6.attempts > 0 && dest.v4.attempts > 0
+        && dest.v6.success_rate() < dest.v4.success_rate())
+    {
+        return AF_INET;
+    }
+    return AF_INET6;
+}
+
+
+static void race_io_cb(EV_P_ ev_io *io, int revents) {
+    (void)revents;
+    ConnectRace::Attempt &attempt = *(ConnectRace::Attempt *)((char *)io - offsetof(ConnectRace::Attempt, io));
+    attempt.race->on_writable(attempt);
+}
+
+static void race_timer_cb(EV_P_ ev_timer *timer, int revents) {
+    (void)revents;
+    ConnectRace &race = *(ConnectRace *)((char *)timer - offsetof(ConnectRace, timer));
+    race.on_timer();
+}
+
+
+ConnectRace::ConnectRace(struct ev_loop *loop, ev_tstamp delay, EyeballStats *stats)
+    : delay(delay), stats(stats), payload(NULL), payload_size(0), sent(0)
+    , loop(loop), started(0), next(0), cb(NULL), userdata(NULL)
+{
+    ev_init(&this->timer, race_timer_cb);
+}
+
+ConnectRace::~ConnectRace() {
+    ev_timer_stop(this->loop, &this->timer);
+    for (size_t i = 0; i < this->attempts.size(); ++i) {
+        Attempt *attempt = this->attempts[i];
+        ev_io_stop(this->loop, &attempt->io);
+        close_fd(attempt->fd);
+        delete attempt;
+    }
+}
+
+void ConnectRace::start(const string &name, const vector<Addr> &addrs, uint16_t port, DoneCb cb, void *userdata) {
+    this->name = name;
+    this->started = ev_time();
+    this->cb = cb;
+    this->userdata = userdata;
+
+    // interleave families, starting with the preferred one
+    int first = this->stats ? this->stats->preferred_family(name) : AF_INET6;
+    vector<Addr> primary, secondary;
+    for (size_t i = 0; i < addrs.size(); ++i) {
+        (addrs[i].family() == first ? primary : secondary).push_back(addrs[i]);
+    }
+    for (size_t i = 0; i < std::max(primary.size(), secondary.size()); ++i) {
+        if (i < primary.size()) {
+            this->addrs.push_back(primary[i]);
+        }
+        if (i < secondary.size()) {
+            this->addrs.push_back(secondary[i]);
+        }
+    }
+    for (size_t i = 0; i < this->addrs.size(); ++i) {
+        this->addrs[i].port(port);
+    }
+
+    this->try_next();
+}
+
+void ConnectRace::try_next() {
+    ev_timer_stop(this->loop, &this->timer);
+
+    while (this->next < this->addrs.size()) {
+        const Addr &addr = this->addrs[this->next];
+        int fd = -1;
+        size_t sent = 0;
+        Error err;
+        if (this->payload_size > 0 && this->addrs.size() == 1) {
+            err = tcp_connect_fastopen(fd, addr, this->payload, this->payload_size, sent);
+        } else {
+            err = tcp_connect(fd, addr);
+        }
+        this->next++;
+        if (!err.ok()) {
+            CTXLOG_DBG("[remote:%s] %s", addr.str().c_str(), err.str().c_str());
+            if (this->stats) {
+                this->stats->record(this->name, addr.family(), false, 0);
+            }
+            this->last_err = err;
+            continue;
+        }
+
+        Attempt *attempt = new Attempt();
+        attempt->fd = fd;
+        attempt->addr = addr;
+        attempt->start = ev_time();
+        attempt->sent = sent;
+        attempt->race = this;
+        ev_io_init(&attempt->io, race_io_cb, fd, EV_WRITE);
+        ev_io_start(this->loop, &attempt->io);
+        this->attempts.push_back(attempt);
+        break;
+    }
+
+    if (this->attempts.empty()) {
+        assert(this->next == this->addrs.size());
+        return this->finish(-1, Addr());
+    }
+    if (this->next < this->addrs.size()) {
+        ev_timer_set(&this->timer, this->delay, 0);
+        ev_timer_start(this->loop, &this->timer);
+    }
+}
+
+void ConnectRace::on_writable(Attempt &attempt) {
+    int soerr = 0;
+    socklen_t len = sizeof(soerr);
+    if (::getsockopt(attempt.fd, SOL_SOCKET, SO_ERROR, &soerr, &len) != 0) {
+        soerr = errno;
+    }
+    if (this->stats) {
+        this->stats->record(this->name, attempt.addr.family(), soerr == 0, ev_time() - attempt.start);
+    }
+
+    if (soerr == 0) {
+        int fd = attempt.fd;
+        Addr addr = attempt.addr;
+        this->sent = attempt.sent;
+        attempt.fd = -1;
+        this->remove(attempt);
+        return this->finish(fd, addr);
+    }
+
+    CTXLOG_DBG("[remote:%s] connect() failed: %s", attempt.addr.str().c_str(), strerror(soerr));
+    this->last_err = Error(ERR_CONNECT, soerr, "connect() error");
+    this->remove(attempt);
+    if (this->next < this->addrs.size()) {
+        return this->try_next();    // do not wait for the delay
+    }
+    if (this->attempts.empty()) {
+        return this->finish(-1, Addr());
+    }
+}
+
+void ConnectRace::on_timer() {
+    this->try_next();
+}
+
+void ConnectRace::remove(Attempt &attempt) {
+    ev_io_stop(this->loop, &attempt.io);
+    if (attempt.fd >= 0) {
+        close_fd(attempt.fd);
+    }
+    this->attempts.erase(std::find(this->attempts.begin(), this->attempts.end(), &attempt));
+    delete &attempt;
+}
+
+void ConnectRace::finish(int fd, const Addr &addr) {
+    // close the losers, cut short rather than failed
+    ev_timer_stop(this->loop, &this->timer);
+    while (!this->attempts.empty()) {
+        Attempt &attempt = *this->attempts.back();
+        if (this->stats) {
+            this->stats->record_cancelled(this->name, attempt.addr.family());
+        }
+        this->remove(attempt);
+    }
+    this->next = this->addrs.size();
+
+    Error err;
+    if (fd < 0) {
+        err = this->last_err;
+    }
+    // may delete this
+    this->cb(this->userdata, fd, addr, err);
+}
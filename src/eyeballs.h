@@ -0,0 +1,123 @@
+#ifndef EVSOCKS_EYEBALLS_H
+#define EVSOCKS_EYEBALLS_H
+
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <ev.h>
+#include <boost/thread/mutex.hpp>
+
+#include "addr.h"
+#include "error.h"
+
+
+namespace evsocks {
+    using namespace std;
+
+
+    // connect results by destination name and address family, shared by all loops
+    struct EyeballStats {
+        struct Family {
+            uint64_t attempts;      // completed, succeeded or failed
+            uint64_t successes;
+            uint64_t cancelled;     // closed when another attempt won, not in attempts
+            ev_tstamp latency;      // sum over successes
+
+            Family() : attempts(0), successes(0), cancelled(0), latency(0) {}
+
+            double success_rate() const {
+                return this->attempts ? (double)this->successes / this->attempts : 0;
+            }
+            ev_tstamp avg_latency() const {
+                return this->successes ? this->latency / this->successes : 0;
+            }
+        };
+        struct Dest {
+            Family v4;
+            Family v6;
+        };
+
+        // public
+        size_t max_entries;
+
+        // private
+        boost::mutex mutex;
+        map<string, Dest> dests;
+
+        // with the mutex held
+        Family &family_of(const string &name, int family);
+
+        // public
+        EyeballStats() : max_entries(100000) {}
+
+        void record(const string &name, int family, bool ok, ev_tstamp latency);
+        void record_cancelled(const string &name, int family);
+        bool get(const string &name, Dest &dest);
+        // AF_INET6 unless IPv6 did worse than IPv4 for this destination
+        int preferred_family(const string &name);
+    };
+
+    // Happy Eyeballs (RFC 8305): connects to the addresses of a name one after another,
+    // delay apart or as soon as the previous attempt fails, alternating address families.
+    // The first attempt to complete wins, the others are closed.
+    struct ConnectRace {
+        // fd is -1 with the error of the last attempt if all attempts failed.
+        // The race is finished when cb is called and may be deleted from cb.
+        typedef void (*DoneCb)(void *userdata, int fd, const Addr &addr, Error err);
+
+        struct Attempt {
+            ev_io io;
+            int fd;
+            Addr addr;
+            ev_tstamp start;
+            size_t sent;
+            ConnectRace *race;
+        };
+
+        // param
+        ev_tstamp delay;        // connection attempt delay
+        EyeballStats *stats;    // optional
+        // sent with the SYN by TCP Fast Open if set, must stay valid until the race finishes.
+        // Not used with several addresses, the loser would have delivered it too.
+        const char *payload;
+        size_t payload_size;
+        // readonly, payload bytes already sent on the winning socket
+        size_t sent;
+        // private
+        struct ev_loop *loop;
+        ev_timer timer;
+        string name;
+        ev_tstamp started;
+        vector<Addr> addrs;     // in attempt order
+        size_t next;
+        vector<Attempt *> attempts;     // in progress
+        Error last_err;
+        DoneCb cb;
+        void *userdata;
+
+        // public
+        ConnectRace(struct ev_loop *loop, ev_tstamp delay, EyeballStats *stats);
+        // closes attempts in progress
+        ~ConnectRace();
+
+        void start(const string &name, const vector<Addr> &addrs, uint16_t port, DoneCb cb, void *userdata);
+
+        // private
+        void try_next();
+        void on_writable(Attempt &attempt);
+        void on_timer();
+        void remove(Attempt &attempt);
+        void finish(int fd, const Addr &addr);
+
+    private:
+        // noncopyable
+        ConnectRace(const ConnectRace &);
+        ConnectRace &operator=(const ConnectRace &);
+    };
+}
+
+
+#endif //EVSOCKS_EYEBALLS_H
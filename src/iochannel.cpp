@@ -1,8 +1,11 @@
 #include <cassert>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "iochannel.h"
+#include "uring.h"
 #include "net.h"
 #include "ctxlog/ctxlog_evsocks.hpp"
 
@@ -10,19 +13,66 @@
 using namespace evsocks;
 
 
+// 64 KiB backlog with 16 KiB chunks
+static const size_t k_max_iov = 16;
+
 static bool is_again(int32_t err) {
     return err == EAGAIN || err == EWOULDBLOCK || err == EINTR || err == ENOTCONN;
 }
 
 
+void MemBudget::add(size_t n) {
+    size_t cur = this->used.fetch_add(n, boost::memory_order_relaxed) + n;
+    size_t high = this->high.load(boost::memory_order_relaxed);
+    while (cur > high && !this->high.compare_exchange_weak(high, cur, boost::memory_order_relaxed)) {
+    }
+}
+
+size_t MemBudget::max_buf(size_t max_buf) const {
+    size_t used = this->used.load(boost::memory_order_relaxed);
+    if (this->hard > 0 && used >= this->hard) {
+        return 0;
+    }
+    if (this->soft > 0 && used > this->soft) {
+        if (this->hard == 0) {
+            return max_buf / 8;     // soft limit only
+        }
+        return (size_t)((double)max_buf * (this->hard - used) / (this->hard - this->soft));
+    }
+    return max_buf;
+}
+
+
+bool IOChannel::is_full() const {
+    if (this->is_splice()) {
+        return this->pipe_full || this->pipe_bytes >= this->pipe.cap;
+    }
+    // only channels holding data pause, so an empty channel never stalls
+    size_t limit = this->budget ? this->budget->max_buf(this->max_buf) : this->max_buf;
+    return !this->buf.empty() && this->buf.size() >= limit;
+}
+
+void IOChannel::charge() {
+    if (this->budget != NULL) {
+        size_t size = this->buf.size();
+        if (size > this->charged) {
+            this->budget->add(size - this->charged);
+        } else {
+            this->budget->sub(this->charged - size);
+        }
+        this->charged = size;
+    }
+}
+
 Error IOChannel::write(const char *data, size_t count) {
     assert(this->consumer != NULL);
     assert(!this->producer_eof);
 
     size_t written = 0;
-    if (this->buf.empty()) {
+    if (this->buf.empty() && !this->corked && this->uring == NULL) {
         // bypass write buffer
         ssize_t n = ::write(this->consumer->fd, data, count);
+        this->count(n);
         if (n < 0) {
             if (!is_again(errno)) {
                 return Error(ERR_WRITE, errno, "IOChannel::write() error");
@@ -38,14 +88,34 @@ Error IOChannel::write(const char *data, size_t count) {
 
     if (count - written > 0) {
         this->buf.push(data + written, count - written);
+        this->charge();
     }
 
-    if (!this->buf.empty()) {
-        ev_io_start(this->loop, this->consumer);
+    if (!this->buf.empty() && !this->corked) {
+        this->start_consumer();
     }
-    if (this->buf.size() >= this->max_buf && this->producer != NULL && !this->producer_eof) {
+    if (this->is_full() && this->producer != NULL && !this->producer_eof) {
         CTXLOG_DBG("buffer full, pause producer");
-        ev_io_stop(this->loop, this->producer);
+        this->pause_producer();
+    }
+    return Ok();
+}
+
+Error IOChannel::uncork() {
+    this->corked = false;
+    if (this->buf.empty()) {
+        return Ok();
+    }
+    if (this->uring != NULL) {
+        this->start_consumer();
+        return Ok();
+    }
+    Error err = this->flush();
+    if (!err.ok()) {
+        return err;
+    }
+    if (!this->buf.empty()) {
+        ev_io_start(this->loop, this->consumer);
     }
     return Ok();
 }
@@ -56,7 +126,7 @@ Error IOChannel::on_write() {
         return err;
     }
 
-    if (this->buf.empty()) {
+    if (this->empty()) {
         ev_io_stop(this->loop, this->consumer);
         if (this->producer_eof) {
             err = tcp_shutdown(this->consumer->fd, SHUT_WR);
@@ -67,20 +137,21 @@ Error IOChannel::on_write() {
     }
 
     // resume possibly paused producer if buffer is not full
-    if (this->producer != NULL && !this->producer_eof && this->buf.size() < this->max_buf) {
-        ev_io_start(this->loop, this->producer);
+    if (this->producer != NULL && !this->producer_eof && !this->is_full()) {
+        this->resume_producer();
     }
     return Ok();
 }
 
 Error IOChannel::flush() {
     assert(this->consumer != NULL);
+    assert(this->uring == NULL);
 
     while (!this->buf.empty()) {
-        const char *data;
-        size_t count;
-        this->buf.peek(data, count);
-        ssize_t n = ::write(this->consumer->fd, data, count);
+        struct iovec iov[k_max_iov];
+        size_t iovcnt = this->buf.peekv(iov, k_max_iov);
+        ssize_t n = ::writev(this->consumer->fd, iov, (int)iovcnt);
+        this->count(n);
         if (n < 0) {
             if (!is_again(errno)) {
                 return Error(ERR_WRITE, errno, "IOChannel::flush() error");
@@ -93,15 +164,173 @@ Error IOChannel::flush() {
             this->buf.pop((size_t)n);
         }
     }
-    this->buf.shrink();
+    this->charge();
+
+    if (this->buf.empty() && this->pipe_bytes > 0) {
+        return this->flush_pipe();
+    }
+    return Ok();
+}
+
+Error IOChannel::flush_pipe() {
+    while (this->pipe_bytes > 0) {
+        ssize_t n = ::splice(
+            this->pipe.rd, NULL, this->consumer->fd, NULL, this->pipe_bytes,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        this->count(n);
+        if (n < 0) {
+            if (!is_again(errno)) {
+                return Error(ERR_SPLICE, errno, "IOChannel::flush_pipe() error");
+            }
+            break;
+        } else if (n == 0 || (size_t)n > this->pipe_bytes) {
+            // not possible
+            return Error(ERR_SPLICE, errno, "IOChannel::flush_pipe() bad return value of splice()");
+        } else {
+            this->pipe_bytes -= (size_t)n;
+            this->pipe_full = false;
+        }
+    }
     return Ok();
 }
 
 Error IOChannel::producer_done() {
     assert(!this->producer_eof);
     this->producer_eof = true;
-    if (this->buf.empty()) {
+    if (this->empty()) {
         return tcp_shutdown(this->consumer->fd, SHUT_WR);
     }
     return Ok();
 }
+
+void IOChannel::set_pipe(const Pipe &pipe) {
+    assert(!this->is_splice());
+    this->pipe = pipe;
+    this->pipe_bytes = 0;
+    this->pipe_full = false;
+}
+
+Error IOChannel::splice_from(int fd, bool &eof) {
+    assert(this->consumer != NULL);
+    assert(this->is_splice());
+    assert(!this->producer_eof);
+
+    eof = false;
+    if (this->pipe_bytes < this->pipe.cap) {
+        ssize_t n = ::splice(
+            fd, NULL, this->pipe.wr, NULL, this->pipe.cap - this->pipe_bytes,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        this->count(0);     // not delivered yet
+        if (n < 0) {
+            if (!is_again(errno)) {
+                return Error(ERR_SPLICE, errno, "IOChannel::splice_from() error");
+            }
+            // fd is readable, so a non-empty pipe is out of buffers,
+            // otherwise the level-triggered producer would spin until the consumer drains it
+            this->pipe_full = this->pipe_bytes > 0;
+        } else if (n == 0) {
+            eof = true;
+            return Ok();
+        } else {
+            this->pipe_bytes += (size_t)n;
+        }
+    }
+
+    // bypass consumer watcher
+    if (this->buf.empty()) {
+        Error err = this->flush_pipe();
+        if (!err.ok()) {
+            return err;
+        }
+    }
+
+    if (!this->empty()) {
+        this->start_consumer();
+    }
+    if (this->is_full() && this->producer != NULL) {
+        CTXLOG_DBG("pipe full, pause producer");
+        this->pause_producer();
+    }
+    return Ok();
+}
+
+void IOChannel::set_uring(Uring *uring, UringFile *producer, UringFile *consumer) {
+    assert(!this->is_splice());
+    this->uring = uring;
+    this->producer_file = producer;
+    this->consumer_file = consumer;
+    this->sends = 0;
+    this->send_failed = false;
+    if (!this->buf.empty() && !this->corked) {
+        this->start_consumer();
+    }
+}
+
+Error IOChannel::on_sent(int res) {
+    assert(this->sends > 0);
+    this->sends--;
+    if (res < 0) {
+        // the first failure is reported, the rest of the chain follows with ECANCELED
+        bool cancelled = res == -ECANCELED && this->send_failed;
+        this->send_failed = this->sends > 0;
+        if (cancelled) {
+            return Ok();
+        }
+        return Error(ERR_WRITE, -res, "IOChannel::on_sent() error");
+    }
+    assert((size_t)res <= this->buf.size());
+    this->buf.pop((size_t)res);
+    this->charge();
+    if (this->stats != NULL) {
+        this->stats->relayed += (uint64_t)res;
+    }
+
+    if (this->sends == 0) {
+        // a short last send leaves its rest at the head of buf
+        if (!this->buf.empty()) {
+            this->start_consumer();
+        } else if (this->producer_eof) {
+            Error err = tcp_shutdown(this->consumer_file->fd, SHUT_WR);
+            if (!err.ok()) {
+                return err;
+            }
+        }
+    }
+
+    if (this->producer != NULL && !this->producer_eof && !this->is_full()) {
+        this->resume_producer();
+    }
+    return Ok();
+}
+
+// with the ring, one chain of sends at a time: a link only spans SQEs submitted together,
+// so a second chain could overtake the first
+void IOChannel::start_consumer() {
+    if (this->uring == NULL) {
+        ev_io_start(this->loop, this->consumer);
+        return;
+    }
+    if (this->sends > 0 || this->buf.empty()) {
+        return;
+    }
+    struct iovec iov[k_max_iov];
+    size_t iovcnt = this->buf.peekv(iov, k_max_iov);
+    this->sends = iovcnt;
+    this->uring->send(*this->consumer_file, iov, iovcnt);
+}
+
+void IOChannel::pause_producer() {
+    if (this->uring != NULL) {
+        this->uring->stop(*this->producer_file);
+    } else {
+        ev_io_stop(this->loop, this->producer);
+    }
+}
+
+void IOChannel::resume_producer() {
+    if (this->uring != NULL) {
+        this->uring->start_recv(*this->producer_file);
+    } else {
+        ev_io_start(this->loop, this->producer);
+    }
+}
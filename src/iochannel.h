@@ -1,38 +1,139 @@
 #ifndef EVSOCKS_IOCHANNEL_H
 #define EVSOCKS_IOCHANNEL_H
 
+#include <stdint.h>
+#include <sys/types.h>
 #include <ev.h>
+#include <boost/atomic.hpp>
 
-#include "bufqueue.h"
+#include "chunkqueue.h"
+#include "pipepool.h"
 #include "error.h"
 
 
 namespace evsocks {
 
+    struct Uring;
+    struct UringFile;
+
+    // relay path counters, shared by the channels of a loop
+    struct IOStats {
+        uint64_t syscalls;      // read/write/splice calls, io_uring_enter() in io_uring mode
+        uint64_t relayed;       // bytes delivered to consumers
+
+        IOStats() : syscalls(0), relayed(0) {}
+    };
+
+    // process-wide budget for bytes buffered in IOChannel::buf, shared by all loops.
+    // Above soft the effective max_buf of each channel shrinks linearly,
+    // at hard channels holding any data pause their producer. 0 means no limit.
+    struct MemBudget {
+        size_t soft;
+        size_t hard;
+        boost::atomic<size_t> used;
+        boost::atomic<size_t> high;     // high-water mark of used
+
+        MemBudget() : soft(0), hard(0), used(0), high(0) {}
+
+        void add(size_t n);
+        void sub(size_t n) {
+            this->used.fetch_sub(n, boost::memory_order_relaxed);
+        }
+        // effective per-channel limit under current usage
+        size_t max_buf(size_t max_buf) const;
+    };
+
     struct IOChannel {
         struct ev_loop *loop;
         ev_io *producer;    // reader
         ev_io *consumer;    // writer
 
         bool producer_eof;
+        // write() only buffers, see cork()
+        bool corked;
 
         size_t max_buf;
-        BufQueue buf;
+        ChunkQueue buf;
+
+        // splice mode: producer fd -> pipe -> consumer fd, the pipe replaces max_buf.
+        // buf may still hold data written before, it is flushed first.
+        Pipe pipe;
+        size_t pipe_bytes;
+        // splice() into the pipe would block below cap: each skb takes a pipe buffer,
+        // so small segments use up the buffers first. Cleared once the consumer drains some.
+        bool pipe_full;
+
+        // io_uring mode: the ring replaces the watchers, see set_uring()
+        Uring *uring;
+        UringFile *producer_file;
+        UringFile *consumer_file;
+        size_t sends;       // linked sends in flight, their data is the head of buf
+        bool send_failed;   // a send of the chain failed, the rest completes with ECANCELED
+
+        IOStats *stats;     // optional
+        MemBudget *budget;  // optional
+        size_t charged;     // bytes of buf accounted in budget
 
         IOChannel()
-            : loop(NULL), producer(NULL), consumer(NULL), producer_eof(false), max_buf(0)
+            : loop(NULL), producer(NULL), consumer(NULL), producer_eof(false), corked(false), max_buf(0)
+            , pipe_bytes(0), pipe_full(false), uring(NULL), producer_file(NULL), consumer_file(NULL)
+            , sends(0), send_failed(false)
+            , stats(NULL), budget(NULL), charged(0)
         {}
 
-        void init(EV_P_ size_t max_buf) {
+        ~IOChannel() {
+            if (this->budget != NULL) {
+                this->budget->sub(this->charged);
+            }
+        }
+
+        void init(EV_P_ size_t max_buf, IOStats *stats = NULL, MemBudget *budget = NULL) {
             this->loop = EV_A;
             this->max_buf = max_buf;
+            this->stats = stats;
+            this->budget = budget;
         }
 
         Error write(const char *data, size_t count);
+        // gather writes until uncork(), which sends them with a single writev()
+        void cork() { this->corked = true; }
+        Error uncork();
         Error on_write();
         Error flush();
         Error producer_done();
         bool is_producer_done() const { return this->producer_eof; }
+
+        // pending bytes
+        size_t size() const { return this->buf.size() + this->pipe_bytes; }
+        bool empty() const { return this->size() == 0; }
+        // whether the producer should be paused
+        bool is_full() const;
+        // account buf in budget, call after modifying buf directly
+        void charge();
+
+        void set_pipe(const Pipe &pipe);
+        bool is_splice() const { return this->pipe.rd >= 0; }
+        // move data from fd to consumer through the pipe. eof is set if fd has no more data.
+        Error splice_from(int fd, bool &eof);
+
+        // pause and resume the producer with a recv of the ring, send to the consumer with linked sends.
+        // Data already buffered goes out through the ring.
+        void set_uring(Uring *uring, UringFile *producer, UringFile *consumer);
+        bool is_uring() const { return this->uring != NULL; }
+        // completion of a send, replaces on_write() in io_uring mode
+        Error on_sent(int res);
+
+    private:
+        Error flush_pipe();
+        void start_consumer();
+        void pause_producer();
+        void resume_producer();
+        void count(ssize_t n) {
+            if (this->stats != NULL) {
+                this->stats->syscalls++;
+                this->stats->relayed += n > 0 ? (uint64_t)n : 0;
+            }
+        }
     };
 
 }
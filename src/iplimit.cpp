@@ -0,0 +1,201 @@
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <time.h>
+#include <unistd.h>
+
+#include <boost/thread/locks.hpp>
+
+#include "iplimit.h"
+
+
+using namespace evsocks;
+
+
+IpLimiter::IpLimiter()
+    : max_sessions(0), rate(0), burst(0), capacity(65536)
+    , shard_mask(0), mask(0), seed(0)
+{}
+
+void IpLimiter::init() {
+    // small tables are not worth splitting
+    size_t shards = 1;
+    while (shards < k_max_shards && this->capacity / (shards * 2) >= k_min_shard_capacity) {
+        shards <<= 1;
+    }
+    size_t capacity = (this->capacity + shards - 1) / shards;
+
+    // probes stay short below 3/4 full
+    size_t n = 16;
+    while (n / 4 * 3 < capacity) {
+        n <<= 1;
+    }
+    for (size_t i = 0; i < shards; ++i) {
+        Shard &shard = this->shards[i];
+        shard.slots.assign(n, Entry());     // zeroed
+        shard.size = 0;
+        shard.last_sweep = 0;
+    }
+    this->shard_mask = shards - 1;
+    this->mask = n - 1;
+    // keep remote hosts from picking colliding addresses
+    this->seed = (uint32_t)(ev_time() * 1e6) ^ ((uint32_t)::getpid() << 16);
+    if (this->burst < 1) {
+        this->burst = std::max(this->rate, 1.0);
+    }
+}
+
+ev_tstamp IpLimiter::clock() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// FNV-1a
+uint32_t IpLimiter::hash(const char *ip, size_t ip_size) const {
+    uint32_t h = 2166136261u ^ this->seed;
+    for (size_t i = 0; i < ip_size; ++i) {
+        h ^= (uint8_t)ip[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// linear probing, NULL if not found or no room to insert
+IpLimiter::Entry *IpLimiter::find(Shard &shard, uint32_t h, const Addr &addr, ev_tstamp now, bool insert) {
+    const char *ip = addr.ip_data();
+    size_t ip_size = addr.ip_size();
+
+    size_t i = this->slot_of(h);
+    for (;;) {
+        Entry &entry = shard.slots[i];
+        if (entry.ip_size == 0) {
+            break;
+        }
+        if (entry.ip_size == ip_size && ::memcmp(entry.ip, ip, ip_size) == 0) {
+            return &entry;
+        }
+        i = (i + 1) & this->mask;
+    }
+    if (!insert) {
+        return NULL;
+    }
+
+    // keep probes short, make room from idle hosts at most once per second
+    if (shard.size >= shard.slots.size() / 4 * 3) {
+        if (now - shard.last_sweep < 1) {
+            return NULL;
+        }
+        this->sweep(shard, now);
+        if (shard.size >= shard.slots.size() / 4 * 3) {
+            return NULL;
+        }
+        return this->find(shard, h, addr, now, true);     // slots moved
+    }
+
+    Entry &entry = shard.slots[i];
+    ::memcpy(entry.ip, ip, ip_size);
+    entry.ip_size = (uint8_t)ip_size;
+    entry.sessions = 0;
+    entry.tokens = this->burst;
+    entry.refilled = now;
+    shard.size++;
+    return &entry;
+}
+
+// nothing left to enforce
+bool IpLimiter::idle(const Entry &entry, ev_tstamp now) const {
+    return entry.sessions == 0
+        && (this->rate <= 0 || entry.tokens + (now - entry.refilled) * this->rate >= this->burst);
+}
+
+// backward shift deletion, no tombstones
+void IpLimiter::erase(Shard &shard, size_t i) {
+    size_t j = i;
+    for (;;) {
+        shard.slots[i].ip_size = 0;
+        for (;;) {
+            j = (j + 1) & this->mask;
+            const Entry &entry = shard.slots[j];
+            if (entry.ip_size == 0) {
+                shard.size--;
+                return;
+            }
+            size_t k = this->slot_of(this->hash(entry.ip, entry.ip_size));
+            // stays if its home slot is cyclically in (i, j]
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+                continue;
+            }
+            break;
+        }
+        shard.slots[i] = shard.slots[j];
+        i = j;
+    }
+}
+
+void IpLimiter::sweep(Shard &shard, ev_tstamp now) {
+    shard.last_sweep = now;
+    size_t i = 0;
+    while (i < shard.slots.size()) {
+        if (shard.slots[i].ip_size != 0 && this->idle(shard.slots[i], now)) {
+            // the shift may move a later entry, or one wrapped around from the
+            // start of the table, into slot i: check it again
+            this->erase(shard, i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+IpLimiter::Result IpLimiter::acquire(const Addr &addr, ev_tstamp now) {
+    size_t ip_size = addr.ip_size();
+    if (this->shards[0].slots.empty() || ip_size == 0 || ip_size > sizeof(((Entry *)0)->ip)) {
+        // not counted, could not be limited
+        return TABLE_FULL;
+    }
+    uint32_t h = this->hash(addr.ip_data(), ip_size);
+    Shard &shard = this->shard_of(h);
+    boost::lock_guard<boost::mutex> lock(shard.mutex);
+    Entry *entry = this->find(shard, h, addr, now, true);
+    if (entry == NULL) {
+        return TABLE_FULL;
+    }
+
+    if (this->max_sessions > 0 && entry->sessions >= this->max_sessions) {
+        return TOO_MANY_SESSIONS;
+    }
+    if (this->rate > 0) {
+        entry->tokens = std::min(this->burst, entry->tokens + (now - entry->refilled) * this->rate);
+        entry->refilled = now;
+        if (entry->tokens < 1) {
+            return TOO_FAST;
+        }
+        entry->tokens -= 1;
+    }
+    entry->sessions++;
+    return ADMIT;
+}
+
+void IpLimiter::release(const Addr &addr, ev_tstamp now) {
+    uint32_t h = this->hash(addr.ip_data(), addr.ip_size());
+    Shard &shard = this->shard_of(h);
+    boost::lock_guard<boost::mutex> lock(shard.mutex);
+    Entry *entry = this->find(shard, h, addr, now, false);
+    assert(entry != NULL && entry->sessions > 0);
+    if (entry == NULL || entry->sessions == 0) {
+        return;
+    }
+    entry->sessions--;
+    if (this->idle(*entry, now)) {
+        this->erase(shard, entry - &shard.slots[0]);
+    }
+}
+
+size_t IpLimiter::tracked() {
+    size_t size = 0;
+    for (size_t i = 0; i <= this->shard_mask; ++i) {
+        boost::lock_guard<boost::mutex> lock(this->shards[i].mutex);
+        size += this->shards[i].size;
+    }
+    return size;
+}
@@ -0,0 +1,102 @@
+#ifndef EVSOCKS_IPLIMIT_H
+#define EVSOCKS_IPLIMIT_H
+
+
+#include <stdint.h>
+#include <vector>
+
+#include <ev.h>
+#include <boost/thread/mutex.hpp>
+
+#include "addr.h"
+
+
+namespace evsocks {
+    using namespace std;
+
+
+    // Per source IP concurrent sessions and a token bucket of new sessions,
+    // in open addressing tables of fixed capacity. Shared by all loops of the process,
+    // split by hash into shards with their own lock.
+    // New IPs are rejected while their shard is full of hosts still limited.
+    struct IpLimiter {
+        enum Result {
+            ADMIT = 0,
+            TOO_MANY_SESSIONS,
+            TOO_FAST,
+            TABLE_FULL,
+        };
+
+        struct Entry {
+            char ip[16];
+            uint8_t ip_size;    // 0 for empty slots
+            uint32_t sessions;
+            double tokens;
+            ev_tstamp refilled;
+        };
+
+        struct Shard {
+            boost::mutex mutex;
+            size_t size;            // guarded by mutex
+            vector<Entry> slots;    // guarded by mutex
+            ev_tstamp last_sweep;   // guarded by mutex
+
+            Shard() : size(0), last_sweep(0) {}
+        };
+
+        static const size_t k_max_shards = 16;
+        static const size_t k_shard_bits = 4;           // hash bits that pick the shard
+        static const size_t k_min_shard_capacity = 1024;
+
+        // param
+        uint32_t max_sessions;  // 0 for unlimited
+        double rate;            // new sessions per second, 0 for unlimited
+        double burst;           // bucket size
+        size_t capacity;        // IPs tracked at once
+        // private
+        Shard shards[k_max_shards];
+        size_t shard_mask;      // shards in use - 1
+        size_t mask;            // slots per shard - 1
+        uint32_t seed;
+
+        // public
+        IpLimiter();
+
+        bool enabled() const {
+            return this->max_sessions > 0 || this->rate > 0;
+        }
+        // allocates the tables
+        void init();
+        // counts a session on ADMIT, which must be released later, by any thread
+        Result acquire(const Addr &addr) {
+            return this->acquire(addr, clock());
+        }
+        void release(const Addr &addr) {
+            this->release(addr, clock());
+        }
+        // IPs in the tables
+        size_t tracked();
+
+        // the same monotonic clock for every loop, unlike ev_now()
+        static ev_tstamp clock();
+        // with now on clock()
+        Result acquire(const Addr &addr, ev_tstamp now);
+        void release(const Addr &addr, ev_tstamp now);
+
+        // private
+        uint32_t hash(const char *ip, size_t ip_size) const;
+        Shard &shard_of(uint32_t h) {
+            return this->shards[h & this->shard_mask];
+        }
+        size_t slot_of(uint32_t h) const {
+            return (h >> k_shard_bits) & this->mask;
+        }
+        Entry *find(Shard &shard, uint32_t h, const Addr &addr, ev_tstamp now, bool insert);
+        bool idle(const Entry &entry, ev_tstamp now) const;
+        void erase(Shard &shard, size_t i);
+        void sweep(Shard &shard, ev_tstamp now);
+    };
+}
+
+
+#endif //EVSOCKS_IPLIMIT_H
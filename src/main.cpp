@@ -2,10 +2,17 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <string>
+#include <vector>
+
+#include <boost/bind/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "ctxlog/ctxlog_evsocks.hpp"
 #include "conv_util.hpp"
 #include "server.h"
+#include "authdaemon.h"
+#include "worker.h"
 
 
 using namespace evsocks;
@@ -29,9 +36,10 @@ static void setup() {
 struct SigCatcher {
     ev_signal watcher;
     Server *server;
+    WorkerGroup *group;     // used instead of server in multi-worker mode
     uint32_t int_count;
 
-    SigCatcher() : server(NULL), int_count(0) {}
+    SigCatcher() : server(NULL), group(NULL), int_count(0) {}
 };
 
 
@@ -48,13 +56,15 @@ static void sigint_cb(struct ev_loop *loop, ev_signal *w, int revents) {
     SigCatcher *catcher = (SigCatcher *)(void *)w;
     catcher->int_count++;
     Server *server = catcher->server;
-    CTXLOG_INFO("interuption #%u. stop listening. current clients: %zu", catcher->int_count, server->clients());
+    WorkerGroup *group = catcher->group;
+    CTXLOG_INFO("interuption #%u. stop listening. current clients: %zu",
+        catcher->int_count, group ? group->clients() : server->clients());
 
     Error err;
     if (catcher->int_count == 1) {
-        err = server->term(term_cb, loop);
+        err = group ? group->term(term_cb, loop) : server->term(term_cb, loop);
     } else {
-        err = server->force_term();
+        err = group ? group->force_term() : server->force_term();
     }
 
     if (!err.ok()) {
@@ -76,20 +86,254 @@ struct Argument {
     std::string listen;
     std::string username;
     std::string password;
+    std::string users_file;
+    const char *hash_password;  // NULL unless --hash-password
+    uint32_t hash_iterations;
+    std::string auth_daemon;
+    double auth_timeout;
+    size_t auth_max_pending;
+    size_t auth_cache;
+    double auth_cache_ttl;
+    double auth_cache_negative_ttl;
+    size_t workers;
+    size_t relay_workers;
+    bool acceptor;
+    std::vector<int> cpus;
+    bool reuseport_cpu;
+    double stats_interval;
+    bool splice;
+    bool io_uring;
+    unsigned int loop_flags;
+    size_t mem_soft_limit;  // bytes
+    size_t mem_hard_limit;
+    size_t prealloc;
+    size_t resolver_threads;
+    double dns_ttl;
+    double dns_negative_ttl;
+    double dns_prefetch;
+    string dns_cache;
+    double connect_timeout;
+    double connect_attempt_delay;
+    bool connect_fastopen;
+    int defer_accept;
+    int listen_fastopen;
+    size_t accept_budget;
+    size_t max_sessions;
+    double overload_lag;
+    uint32_t ip_max_sessions;
+    double ip_rate;
+    double ip_burst;
+    size_t ip_table;
+
+    Argument()
+        : hash_password(NULL), hash_iterations(CredentialStore::k_default_iterations)
+        , auth_timeout(5), auth_max_pending(256), auth_cache(0), auth_cache_ttl(60), auth_cache_negative_ttl(5)
+        , workers(1), relay_workers(0), acceptor(false), reuseport_cpu(false), stats_interval(0)
+        , splice(false), io_uring(false), loop_flags(EVFLAG_AUTO), mem_soft_limit(0), mem_hard_limit(0), prealloc(0)
+        , resolver_threads(4), dns_ttl(60), dns_negative_ttl(5), dns_prefetch(5)
+        , connect_timeout(10), connect_attempt_delay(0.25), connect_fastopen(false)
+        , defer_accept(0), listen_fastopen(0), accept_budget(64), max_sessions(0), overload_lag(0)
+        , ip_max_sessions(0), ip_rate(0), ip_burst(0), ip_table(65536)
+    {}
 };
 
 static void usage(const char *prog) {
     const char *text =
-        "Usage: %s [-l IP:PORT] [-u USER -p PASS]\n"
+        "Usage: %s [-l IP:PORT] [-u USER -p PASS] [--users FILE] [--hash-password PASS]\n"
+        "       [--hash-iterations N]\n"
+        "       [--auth-daemon PATH [--auth-timeout SEC] [--auth-max-pending N]]\n"
+        "       [--auth-cache N [--auth-cache-ttl SEC] [--auth-cache-negative-ttl SEC]]\n"
+        "       [-w N [--acceptor] [--cpu-affinity CPUS] [--reuseport-cpu]]\n"
+        "       [--relay-workers N] [--stats-interval SEC] [--splice] [--io-uring]\n"
+        "       [--backend NAME] [--mem-soft-limit MB] [--mem-hard-limit MB]\n"
+        "       [--prealloc N] [--resolver-threads N] [--dns-ttl SEC] [--dns-negative-ttl SEC]\n"
+        "       [--dns-prefetch SEC] [--dns-cache FILE] \n"
+        "       [--connect-timeout SEC] [--connect-attempt-delay MS] [--connect-fastopen]\n"
+        "       [--defer-accept SEC] [--listen-fastopen QLEN] [--accept-budget N]\n"
+        "       [--max-sessions N] [--overload-lag MS]\n"
+        "       [--ip-max-sessions N] [--ip-rate N] [--ip-burst N] [--ip-table N]\n"
         "Arguments:\n"
         "   -l, --listen IP:PORT\n"
         "       Server address.\n"
         "   -u, --username\n"
         "   -p, --password\n"
-        "       Authentication.\n";
+        "       Authentication.\n"
+        "   --users FILE\n"
+        "       Users allowed to authenticate, in addition to -u/-p. Reloaded on SIGHUP.\n"
+        "       One \"user:password\" or \"user:HASH\" per line, HASH from --hash-password.\n"
+        "   --hash-password PASS\n"
+        "       Print the PBKDF2-HMAC-SHA256 hash of PASS with a random salt for --users and exit.\n"
+        "   --hash-iterations N\n"
+        "       PBKDF2 iterations of --hash-password, and of -u/-p and plain passwords of --users.\n"
+        "       Each auth runs them on the worker thread, see --auth-cache. Default: 1000.\n"
+        "   --auth-daemon PATH\n"
+        "       Ask the daemon on the unix socket PATH to check usernames and passwords,\n"
+        "       instead of -u/-p and --users. Requests are lines of \"ID USER PASS\" in hex,\n"
+        "       answered by \"ID OK\" or \"ID FAIL\" in any order.\n"
+        "   --auth-timeout SEC\n"
+        "       Close sessions whose auth is not answered in SEC seconds. Default: 5.\n"
+        "   --auth-max-pending N\n"
+        "       Fail auths right away with N already pending per worker. Default: 256.\n"
+        "   --auth-cache N\n"
+        "       Remember up to about N username/password auth decisions, for all workers.\n"
+        "       Passwords are not kept, only keyed hashes. Default: 0 for off.\n"
+        "   --auth-cache-ttl SEC\n"
+        "       Keep successful auths for SEC seconds. Default: 60.\n"
+        "   --auth-cache-negative-ttl SEC\n"
+        "       Keep failed auths for SEC seconds, 0 to not keep them. Default: 5.\n"
+        "   -w, --workers N\n"
+        "       Number of worker threads, each runs its own loop and listener (SO_REUSEPORT).\n"
+        "   --acceptor\n"
+        "       Accept on a single thread and hand connections off to the least-loaded worker.\n"
+        "   --relay-workers N\n"
+        "       Move sessions to N dedicated relay threads once CONNECT succeeds,\n"
+        "       -w workers then only run handshakes.\n"
+        "   --cpu-affinity CPUS\n"
+        "       Pin worker i to the i-th CPU of the list, e.g. 0-3,8,10.\n"
+        "   --reuseport-cpu\n"
+        "       Steer each connection to the worker pinned on the CPU that received it.\n"
+        "       Pins worker i to CPU i if --cpu-affinity is not given. Not with --acceptor.\n"
+        "   --stats-interval SEC\n"
+        "       Log per-server stats every SEC seconds.\n"
+        "   --splice\n"
+        "       Relay established sessions with splice() through pipes, without copying to user space.\n"
+        "   --io-uring\n"
+        "       Accept and relay established sessions through io_uring: multishot accept,\n"
+        "       multishot recv into provided buffers and linked sends. Needs Linux 6.0,\n"
+        "       falls back to the event loop otherwise. Not with --splice.\n"
+        "   --backend NAME\n"
+        "       Event loop backend: auto, select, poll, epoll, linuxaio or iouring.\n"
+        "       Compare backends and --io-uring with the syscalls_per_mb of --stats-interval.\n"
+        "   --mem-soft-limit MB\n"
+        "       Shrink per-session relay buffers when all sessions buffer more than MB in total.\n"
+        "   --mem-hard-limit MB\n"
+        "       Stop reading into sessions with buffered data above MB in total.\n"
+        "   --prealloc N\n"
+        "       Preallocate session objects for N sessions per server, CONNECT or UDP ASSOCIATE.\n"
+        "   --resolver-threads N\n"
+        "       Number of threads resolving domain names of connect cmds. Default: 4.\n"
+        "   --dns-ttl SEC\n"
+        "   --dns-negative-ttl SEC\n"
+        "       Cache resolved names for SEC seconds, failures for --dns-negative-ttl. Default: 60 and 5.\n"
+        "   --dns-prefetch SEC\n"
+        "       Refresh a cached name used within SEC seconds of its expiry. Default: 5.\n"
+        "   --dns-cache FILE\n"
+        "       Load the DNS cache from FILE at startup and save it on exit.\n"
+        "   --connect-timeout SEC\n"
+        "       Reply TTL expired to connect cmds not connected within SEC seconds. Default: 10.\n"
+        "   --connect-attempt-delay MS\n"
+        "       Happy Eyeballs: connect to the next address of a domain after MS milliseconds\n"
+        "       if the previous attempts are still pending. Default: 250.\n"
+        "   --connect-fastopen\n"
+        "       Send data pipelined after the connect cmd with the SYN (TCP Fast Open).\n"
+        "       Needs bit 1 of net.ipv4.tcp_fastopen.\n"
+        "   --defer-accept SEC\n"
+        "       TCP_DEFER_ACCEPT on the listener, connections are accepted once the greeting arrived.\n"
+        "   --listen-fastopen QLEN\n"
+        "       TCP Fast Open on the listener with up to QLEN pending requests.\n"
+        "       Needs bit 2 of net.ipv4.tcp_fastopen.\n"
+        "       Both read the greeting right after accept instead of waiting for the next poll.\n"
+        "   --accept-budget N\n"
+        "       Accept at most N connections per wakeup of the listener, per loop iteration\n"
+        "       with --io-uring. Default: 64.\n"
+        "   --max-sessions N\n"
+        "       Stop accepting at N sessions per worker, resume below 90% of N.\n"
+        "   --overload-lag MS\n"
+        "       Stop accepting and reject new greetings while a worker spends more than MS\n"
+        "       milliseconds per loop iteration on average, until it falls below MS / 2.\n"
+        "   --ip-max-sessions N\n"
+        "       Close new connections from a source IP with N sessions, counted across workers.\n"
+        "   --ip-rate N\n"
+        "       Close new connections from a source IP over N per second, across workers.\n"
+        "   --ip-burst N\n"
+        "       Connections from a source IP allowed at once by --ip-rate. Default: max(N, 1).\n"
+        "   --ip-table N\n"
+        "       Source IPs tracked by the limits above, connections from new ones are closed\n"
+        "       while N are still limited, or their share of N for large tables split by hash.\n"
+        "       Default: 65536.\n";
     fprintf(stdout, text, prog);
 }
 
+// long options without short form
+enum {
+    OPT_ACCEPTOR = 0x100,
+    OPT_RELAY_WORKERS,
+    OPT_CPU_AFFINITY,
+    OPT_REUSEPORT_CPU,
+    OPT_STATS_INTERVAL,
+    OPT_SPLICE,
+    OPT_IO_URING,
+    OPT_BACKEND,
+    OPT_MEM_SOFT_LIMIT,
+    OPT_MEM_HARD_LIMIT,
+    OPT_PREALLOC,
+    OPT_RESOLVER_THREADS,
+    OPT_DNS_TTL,
+    OPT_DNS_NEGATIVE_TTL,
+    OPT_DNS_PREFETCH,
+    OPT_DNS_CACHE,
+    OPT_CONNECT_TIMEOUT,
+    OPT_CONNECT_ATTEMPT_DELAY,
+    OPT_CONNECT_FASTOPEN,
+    OPT_DEFER_ACCEPT,
+    OPT_LISTEN_FASTOPEN,
+    OPT_ACCEPT_BUDGET,
+    OPT_MAX_SESSIONS,
+    OPT_OVERLOAD_LAG,
+    OPT_IP_MAX_SESSIONS,
+    OPT_IP_RATE,
+    OPT_IP_BURST,
+    OPT_IP_TABLE,
+    OPT_USERS,
+    OPT_HASH_PASSWORD,
+    OPT_HASH_ITERATIONS,
+    OPT_AUTH_DAEMON,
+    OPT_AUTH_TIMEOUT,
+    OPT_AUTH_MAX_PENDING,
+    OPT_AUTH_CACHE,
+    OPT_AUTH_CACHE_TTL,
+    OPT_AUTH_CACHE_NEGATIVE_TTL,
+};
+
+// parse cpu list like "0-3,8,10"
+static bool parse_cpu_list(const std::string &text, std::vector<int> &cpus) {
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t end = text.find(',', pos);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string item = text.substr(pos, end - pos);
+        size_t dash = item.find('-');
+        int first = -1;
+        int last = -1;
+        if (dash == std::string::npos) {
+            first = last = tz::cast<std::string, int>(item, -1);
+        } else {
+            first = tz::cast<std::string, int>(item.substr(0, dash), -1);
+            last = tz::cast<std::string, int>(item.substr(dash + 1), -1);
+        }
+        if (first < 0 || last < first) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+        pos = end + 1;
+    }
+    return !cpus.empty();
+}
+
+// megabytes to bytes, false if negative or the bytes overflow size_t
+static bool parse_mb(const std::string &text, size_t &bytes) {
+    long mb = tz::cast<std::string, long>(text, -1);
+    if (mb < 0 || (unsigned long)mb > (size_t)-1 / (1024 * 1024)) {
+        return false;
+    }
+    bytes = (size_t)mb * 1024 * 1024;
+    return true;
+}
+
 static Argument get_args(int argc, char *argv[]) {
     Argument args;
     args.listen = ":1080";
@@ -103,12 +347,50 @@ static Argument get_args(int argc, char *argv[]) {
             {"listen",  required_argument, 0, 'l'},
             {"username", required_argument, 0, 'u'},
             {"password", required_argument, 0, 'p'},
+            {"users", required_argument, 0, OPT_USERS},
+            {"hash-password", required_argument, 0, OPT_HASH_PASSWORD},
+            {"hash-iterations", required_argument, 0, OPT_HASH_ITERATIONS},
+            {"auth-daemon", required_argument, 0, OPT_AUTH_DAEMON},
+            {"auth-timeout", required_argument, 0, OPT_AUTH_TIMEOUT},
+            {"auth-max-pending", required_argument, 0, OPT_AUTH_MAX_PENDING},
+            {"auth-cache", required_argument, 0, OPT_AUTH_CACHE},
+            {"auth-cache-ttl", required_argument, 0, OPT_AUTH_CACHE_TTL},
+            {"auth-cache-negative-ttl", required_argument, 0, OPT_AUTH_CACHE_NEGATIVE_TTL},
+            {"workers", required_argument, 0, 'w'},
+            {"acceptor", no_argument, 0, OPT_ACCEPTOR},
+            {"relay-workers", required_argument, 0, OPT_RELAY_WORKERS},
+            {"cpu-affinity", required_argument, 0, OPT_CPU_AFFINITY},
+            {"reuseport-cpu", no_argument, 0, OPT_REUSEPORT_CPU},
+            {"stats-interval", required_argument, 0, OPT_STATS_INTERVAL},
+            {"splice", no_argument, 0, OPT_SPLICE},
+            {"io-uring", no_argument, 0, OPT_IO_URING},
+            {"backend", required_argument, 0, OPT_BACKEND},
+            {"mem-soft-limit", required_argument, 0, OPT_MEM_SOFT_LIMIT},
+            {"mem-hard-limit", required_argument, 0, OPT_MEM_HARD_LIMIT},
+            {"prealloc", required_argument, 0, OPT_PREALLOC},
+            {"resolver-threads", required_argument, 0, OPT_RESOLVER_THREADS},
+            {"dns-ttl", required_argument, 0, OPT_DNS_TTL},
+            {"dns-negative-ttl", required_argument, 0, OPT_DNS_NEGATIVE_TTL},
+            {"dns-prefetch", required_argument, 0, OPT_DNS_PREFETCH},
+            {"dns-cache", required_argument, 0, OPT_DNS_CACHE},
+            {"connect-timeout", required_argument, 0, OPT_CONNECT_TIMEOUT},
+            {"connect-attempt-delay", required_argument, 0, OPT_CONNECT_ATTEMPT_DELAY},
+            {"connect-fastopen", no_argument, 0, OPT_CONNECT_FASTOPEN},
+            {"defer-accept", required_argument, 0, OPT_DEFER_ACCEPT},
+            {"listen-fastopen", required_argument, 0, OPT_LISTEN_FASTOPEN},
+            {"accept-budget", required_argument, 0, OPT_ACCEPT_BUDGET},
+            {"max-sessions", required_argument, 0, OPT_MAX_SESSIONS},
+            {"overload-lag", required_argument, 0, OPT_OVERLOAD_LAG},
+            {"ip-max-sessions", required_argument, 0, OPT_IP_MAX_SESSIONS},
+            {"ip-rate", required_argument, 0, OPT_IP_RATE},
+            {"ip-burst", required_argument, 0, OPT_IP_BURST},
+            {"ip-table", required_argument, 0, OPT_IP_TABLE},
             {0, 0, 0, 0}
         };
 
         /* getopt_long stores the option index here. */
         int option_index = 0;
-        int c = getopt_long(argc, argv, "hl:u:p:", long_options, &option_index);
+        int c = getopt_long(argc, argv, "hl:u:p:w:", long_options, &option_index);
         /* Detect the end of the options. */
         if (c == -1)
             break;
@@ -123,6 +405,223 @@ static Argument get_args(int argc, char *argv[]) {
         case 'p':
             args.password = optarg;
             break;
+        case OPT_USERS:
+            args.users_file = optarg;
+            break;
+        case OPT_AUTH_DAEMON:
+            args.auth_daemon = optarg;
+            break;
+        case OPT_AUTH_TIMEOUT:
+            args.auth_timeout = tz::cast<std::string, double>(optarg, 0.0);
+            if (!(args.auth_timeout > 0)) {
+                fprintf(stderr, "illegal args: --auth-timeout SEC\n");
+                exit(1);
+            }
+            break;
+        case OPT_AUTH_MAX_PENDING: {
+            // "-1" would wrap as size_t
+            long n = tz::cast<std::string, long>(optarg, 0);
+            if (n <= 0) {
+                fprintf(stderr, "illegal args: --auth-max-pending N\n");
+                exit(1);
+            }
+            args.auth_max_pending = (size_t)n;
+        } break;
+        case OPT_AUTH_CACHE: {
+            long n = tz::cast<std::string, long>(optarg, -1);
+            if (n < 0) {
+                fprintf(stderr, "illegal args: --auth-cache N\n");
+                exit(1);
+            }
+            args.auth_cache = (size_t)n;
+        } break;
+        case OPT_AUTH_CACHE_TTL:
+            args.auth_cache_ttl = tz::cast<std::string, double>(optarg, -1.0);
+            if (!(args.auth_cache_ttl >= 0)) {
+                fprintf(stderr, "illegal args: --auth-cache-ttl SEC\n");
+                exit(1);
+            }
+            break;
+        case OPT_AUTH_CACHE_NEGATIVE_TTL:
+            args.auth_cache_negative_ttl = tz::cast<std::string, double>(optarg, -1.0);
+            if (!(args.auth_cache_negative_ttl >= 0)) {
+                fprintf(stderr, "illegal args: --auth-cache-negative-ttl SEC\n");
+                exit(1);
+            }
+            break;
+        case OPT_HASH_PASSWORD:
+            args.hash_password = optarg;
+            break;
+        case OPT_HASH_ITERATIONS:
+            args.hash_iterations = tz::cast<std::string, uint32_t>(optarg, 0u);
+            if (optarg[0] == '-' || args.hash_iterations == 0
+                || args.hash_iterations > CredentialStore::k_max_iterations)
+            {
+                fprintf(stderr, "illegal args: --hash-iterations N\n");
+                exit(1);
+            }
+            break;
+        case 'w':
+            args.workers = tz::cast<std::string, size_t>(optarg, 0u);
+            if (args.workers == 0) {
+                fprintf(stderr, "illegal args: --workers N\n");
+                exit(1);
+            }
+            break;
+        case OPT_ACCEPTOR:
+            args.acceptor = true;
+            break;
+        case OPT_RELAY_WORKERS:
+            args.relay_workers = tz::cast<std::string, size_t>(optarg, 0u);
+            break;
+        case OPT_CPU_AFFINITY:
+            if (!parse_cpu_list(optarg, args.cpus)) {
+                fprintf(stderr, "illegal args: --cpu-affinity CPUS\n");
+                exit(1);
+            }
+            break;
+        case OPT_REUSEPORT_CPU:
+            args.reuseport_cpu = true;
+            break;
+        case OPT_STATS_INTERVAL:
+            args.stats_interval = tz::cast<std::string, double>(optarg, -1.0);
+            if (!(args.stats_interval >= 0)) {
+                fprintf(stderr, "illegal args: --stats-interval SEC\n");
+                exit(1);
+            }
+            break;
+        case OPT_SPLICE:
+            args.splice = true;
+            break;
+        case OPT_IO_URING:
+            args.io_uring = true;
+            break;
+        case OPT_BACKEND:
+            if (!ev_backend_parse(optarg, args.loop_flags)) {
+                fprintf(stderr, "illegal args: --backend NAME\n");
+                exit(1);
+            }
+            break;
+        case OPT_MEM_SOFT_LIMIT:
+            if (!parse_mb(optarg, args.mem_soft_limit)) {
+                fprintf(stderr, "illegal args: --mem-soft-limit MB\n");
+                exit(1);
+            }
+            break;
+        case OPT_MEM_HARD_LIMIT:
+            if (!parse_mb(optarg, args.mem_hard_limit)) {
+                fprintf(stderr, "illegal args: --mem-hard-limit MB\n");
+                exit(1);
+            }
+            break;
+        case OPT_PREALLOC:
+            args.prealloc = tz::cast<std::string, size_t>(optarg, 0u);
+            break;
+        case OPT_RESOLVER_THREADS:
+            args.resolver_threads = tz::cast<std::string, size_t>(optarg, 0u);
+            if (args.resolver_threads == 0) {
+                fprintf(stderr, "illegal args: --resolver-threads N\n");
+                exit(1);
+            }
+            break;
+        case OPT_DNS_TTL:
+            args.dns_ttl = tz::cast<std::string, double>(optarg, -1.0);
+            if (!(args.dns_ttl >= 0)) {
+                fprintf(stderr, "illegal args: --dns-ttl SEC\n");
+                exit(1);
+            }
+            break;
+        case OPT_DNS_NEGATIVE_TTL:
+            args.dns_negative_ttl = tz::cast<std::string, double>(optarg, -1.0);
+            if (!(args.dns_negative_ttl >= 0)) {
+                fprintf(stderr, "illegal args: --dns-negative-ttl SEC\n");
+                exit(1);
+            }
+            break;
+        case OPT_DNS_PREFETCH:
+            args.dns_prefetch = tz::cast<std::string, double>(optarg, -1.0);
+            if (!(args.dns_prefetch >= 0)) {
+                fprintf(stderr, "illegal args: --dns-prefetch SEC\n");
+                exit(1);
+            }
+            break;
+        case OPT_DNS_CACHE:
+            args.dns_cache = optarg;
+            break;
+        case OPT_CONNECT_TIMEOUT:
+            args.connect_timeout = tz::cast<std::string, double>(optarg, 0.0);
+            if (args.connect_timeout <= 0) {
+                fprintf(stderr, "illegal args: --connect-timeout SEC\n");
+                exit(1);
+            }
+            break;
+        case OPT_CONNECT_ATTEMPT_DELAY:
+            args.connect_attempt_delay = tz::cast<std::string, double>(optarg, 0.0) / 1000;
+            break;
+        case OPT_CONNECT_FASTOPEN:
+            args.connect_fastopen = true;
+            break;
+        case OPT_DEFER_ACCEPT:
+            args.defer_accept = tz::cast<std::string, int>(optarg, -1);
+            if (args.defer_accept < 0) {
+                fprintf(stderr, "illegal args: --defer-accept SEC\n");
+                exit(1);
+            }
+            break;
+        case OPT_LISTEN_FASTOPEN:
+            args.listen_fastopen = tz::cast<std::string, int>(optarg, -1);
+            if (args.listen_fastopen < 0) {
+                fprintf(stderr, "illegal args: --listen-fastopen QLEN\n");
+                exit(1);
+            }
+            break;
+        case OPT_MAX_SESSIONS:
+            args.max_sessions = tz::cast<std::string, size_t>(optarg, 0u);
+            break;
+        case OPT_OVERLOAD_LAG:
+            args.overload_lag = tz::cast<std::string, double>(optarg, -1.0) / 1000;
+            if (!(args.overload_lag >= 0)) {
+                fprintf(stderr, "illegal args: --overload-lag MS\n");
+                exit(1);
+            }
+            break;
+        case OPT_IP_MAX_SESSIONS: {
+            // "-1" would wrap as uint32_t
+            long n = tz::cast<std::string, long>(optarg, -1);
+            if (n < 0 || (long)(uint32_t)n != n) {
+                fprintf(stderr, "illegal args: --ip-max-sessions N\n");
+                exit(1);
+            }
+            args.ip_max_sessions = (uint32_t)n;
+        } break;
+        case OPT_IP_RATE:
+            args.ip_rate = tz::cast<std::string, double>(optarg, -1.0);
+            if (!(args.ip_rate >= 0)) {
+                fprintf(stderr, "illegal args: --ip-rate N\n");
+                exit(1);
+            }
+            break;
+        case OPT_IP_BURST:
+            args.ip_burst = tz::cast<std::string, double>(optarg, -1.0);
+            if (!(args.ip_burst >= 0)) {
+                fprintf(stderr, "illegal args: --ip-burst N\n");
+                exit(1);
+            }
+            break;
+        case OPT_IP_TABLE:
+            args.ip_table = tz::cast<std::string, size_t>(optarg, 0u);
+            if (optarg[0] == '-' || args.ip_table == 0) {
+                fprintf(stderr, "illegal args: --ip-table N\n");
+                exit(1);
+            }
+            break;
+        case OPT_ACCEPT_BUDGET:
+            args.accept_budget = tz::cast<std::string, size_t>(optarg, 0u);
+            if (args.accept_budget == 0) {
+                fprintf(stderr, "illegal args: --accept-budget N\n");
+                exit(1);
+            }
+            break;
         case '?':
             /* getopt_long already printed an error message. */
             // fallthrough
@@ -134,9 +633,136 @@ static Argument get_args(int argc, char *argv[]) {
         }
     }
 
+    if (args.hash_password != NULL) {
+        std::string hash;
+        Error err = CredentialStore::hash_password(args.hash_password, args.hash_iterations, hash);
+        if (!err.ok()) {
+            fprintf(stderr, "%s\n", err.str().c_str());
+            exit(1);
+        }
+        printf("%s\n", hash.c_str());
+        exit(0);
+    }
+    if (args.acceptor && args.reuseport_cpu) {
+        // the acceptor picks workers by load, there is no reuseport group to steer
+        fprintf(stderr, "illegal args: --reuseport-cpu with --acceptor\n");
+        exit(1);
+    }
+    if (args.io_uring && args.splice) {
+        fprintf(stderr, "illegal args: --io-uring with --splice\n");
+        exit(1);
+    }
+    if (!args.auth_daemon.empty() && (!args.username.empty() || !args.users_file.empty())) {
+        fprintf(stderr, "illegal args: --auth-daemon with -u or --users\n");
+        exit(1);
+    }
+    if (args.mem_soft_limit > 0 && args.mem_hard_limit > 0 && args.mem_soft_limit > args.mem_hard_limit) {
+        fprintf(stderr, "illegal args: --mem-soft-limit greater than --mem-hard-limit\n");
+        exit(1);
+    }
+
     return args;
 }
 
+// buffered bytes of all servers
+static MemBudget g_mem_budget;
+// domain names of all servers
+static Resolver g_resolver;
+static EyeballStats g_eyeballs;
+// in front of the auth handler of all servers
+static CachingServerHandler g_auth_cache;
+// source IPs of all servers
+static IpLimiter g_ip_limits;
+
+// users of PasswordServerHandler, reloaded on SIGHUP
+struct CredentialLoader {
+    ev_signal watcher;
+    const Argument *args;
+    PasswordServerHandler *handler;
+    boost::thread *thread;
+    boost::atomic<bool> loading;
+
+    CredentialLoader() : args(NULL), handler(NULL), thread(NULL), loading(false) {}
+};
+
+static Error load_credentials(const Argument &args, PasswordServerHandler &handler) {
+    boost::shared_ptr<CredentialStore> creds(new CredentialStore());
+    creds->iterations = args.hash_iterations;
+    if (!args.users_file.empty()) {
+        Error err = creds->load(args.users_file);
+        if (!err.ok()) {
+            return err;
+        }
+    }
+    if (!args.username.empty() || !args.password.empty()) {
+        Error err = creds->add(args.username, args.password);
+        if (!err.ok()) {
+            return err;
+        }
+    }
+    creds->build();
+    // handshakes in progress finish with the store they got
+    handler.set_credentials(creds);
+    g_auth_cache.clear();
+    CTXLOG_INFO("users loaded. [users:%zu]", creds->size());
+    return Ok();
+}
+
+static void reload_main(CredentialLoader *loader) {
+    Error err = load_credentials(*loader->args, *loader->handler);
+    if (!err.ok()) {
+        CTXLOG_ERR("reload users failed, old users kept: %s", err.str().c_str());
+    }
+    loader->loading.store(false);
+}
+
+// hashing a large file takes a while, the loop keeps serving
+static void sighup_cb(struct ev_loop *loop, ev_signal *w, int revents) {
+    (void)loop;
+    (void)revents;
+
+    CredentialLoader *loader = (CredentialLoader *)(void *)w;
+    if (loader->loading.exchange(true)) {
+        CTXLOG_WARN("users still reloading, SIGHUP ignored");
+        return;
+    }
+    CTXLOG_INFO("reloading users...");
+    if (loader->thread != NULL) {
+        loader->thread->join();
+        delete loader->thread;
+        loader->thread = NULL;
+    }
+    try {
+        loader->thread = new boost::thread(boost::bind(reload_main, loader));
+    } catch (boost::thread_resource_error &ex) {
+        CTXLOG_ERR("failed to create thread for reloading users: %s", ex.what());
+        loader->loading.store(false);
+    }
+}
+
+// apply args to each Server, called in the thread owning the server
+static void setup_server(void *userdata, Server &server) {
+    const Argument &args = *(const Argument *)userdata;
+    server.stats_interval = args.stats_interval;
+    server.splice = args.splice;
+    server.io_uring = args.io_uring;
+    server.budget = &g_mem_budget;
+    server.prealloc(args.prealloc);
+    server.resolver = &g_resolver;
+    server.connect_timeout = args.connect_timeout;
+    server.connect_attempt_delay = args.connect_attempt_delay;
+    server.fastopen = args.connect_fastopen;
+    server.eyeballs = &g_eyeballs;
+    server.accept_budget = args.accept_budget;
+    server.max_sessions = args.max_sessions;
+    server.overload_lag = args.overload_lag;
+    server.auth_timeout = args.auth_timeout;
+    server.auth_cache = args.auth_cache > 0 ? &g_auth_cache : NULL;
+    server.ip_limits = g_ip_limits.enabled() ? &g_ip_limits : NULL;
+    server.listen_opt.defer_accept = args.defer_accept;
+    server.listen_opt.fastopen_qlen = args.listen_fastopen;
+}
+
 int main(int argc, char **argv) {
     // parse args
     Argument args = get_args(argc, argv);
@@ -155,38 +781,122 @@ int main(int argc, char **argv) {
 
     // global env setup
     setup();
+    g_mem_budget.soft = args.mem_soft_limit;
+    g_mem_budget.hard = args.mem_hard_limit;
+    g_resolver.ttl = args.dns_ttl;
+    g_resolver.negative_ttl = args.dns_negative_ttl;
+    g_resolver.prefetch = args.dns_prefetch;
+    if (!args.dns_cache.empty()) {
+        Error err = g_resolver.load(args.dns_cache);
+        if (!err.ok() && err.code() != ENOENT) {
+            CTXLOG_WARN("load dns cache: %s", err.str().c_str());
+        }
+    }
+    TRY(g_resolver.start(args.resolver_threads));
+    g_ip_limits.max_sessions = args.ip_max_sessions;
+    g_ip_limits.rate = args.ip_rate;
+    g_ip_limits.burst = args.ip_burst;
+    g_ip_limits.capacity = args.ip_table;
+    if (g_ip_limits.enabled()) {
+        g_ip_limits.init();
+    }
 
     // use the default event loop unless you have special needs
-    struct ev_loop *loop = EV_DEFAULT;
+    struct ev_loop *loop = ev_default_loop(args.loop_flags);
+    if (loop == NULL) {
+        CTXLOG_ERR("backend not available. [supported:0x%x]", ev_supported_backends());
+        return 1;
+    }
 
     // auth
     DefaultServerHandler default_handler;
     PasswordServerHandler pass_handler;
+    AuthDaemonHandler daemon_handler;
     IServerHandler *handler;
-    if (args.username.empty() && args.password.empty()) {
+    CredentialLoader loader;
+    if (!args.auth_daemon.empty()) {
+        daemon_handler.path = args.auth_daemon;
+        daemon_handler.max_pending = args.auth_max_pending;
+        handler = &daemon_handler;
+    } else if (args.username.empty() && args.password.empty() && args.users_file.empty()) {
         handler = &default_handler;
     } else {
-        pass_handler.user2pass[args.username] = args.password;
+        TRY(load_credentials(args, pass_handler));
         handler = &pass_handler;
+        if (!args.users_file.empty()) {
+            loader.args = &args;
+            loader.handler = &pass_handler;
+            ev_signal_init(&loader.watcher, sighup_cb, SIGHUP);
+            ev_signal_start(loop, &loader.watcher);
+        }
     }
 
-    Server server(loop, handler);
+    if (args.auth_cache > 0) {
+        g_auth_cache.inner = handler;
+        g_auth_cache.capacity = args.auth_cache;
+        g_auth_cache.positive_ttl = args.auth_cache_ttl;
+        g_auth_cache.negative_ttl = args.auth_cache_negative_ttl;
+        TRY(g_auth_cache.init());
+        handler = &g_auth_cache;
+    }
 
     SigCatcher sigcatcher;
-    sigcatcher.server = &server;
     ev_signal_init(&sigcatcher.watcher, sigint_cb, SIGINT);
     ev_signal_start(loop, &sigcatcher.watcher);
 
-    TRY(server.init());
-    TRY(server.start_listen(listen_ip, listen_port));
+    if (args.workers > 1 || args.relay_workers > 0) {
+        // the default loop only handles signals, each worker has its own loop
+        WorkerGroup group(loop, handler);
+        group.mode = args.acceptor ? WorkerGroup::MODE_ACCEPTOR : WorkerGroup::MODE_REUSEPORT;
+        group.relay_workers = args.relay_workers;
+        group.cpus = args.cpus;
+        group.reuseport_cpu = args.reuseport_cpu;
+        group.loop_flags = args.loop_flags;
+        group.listen_opt.defer_accept = args.defer_accept;
+        group.listen_opt.fastopen_qlen = args.listen_fastopen;
+        group.accept_budget = args.accept_budget;
+        group.setup_cb = setup_server;
+        group.setup_userdata = &args;
+        sigcatcher.group = &group;
+
+        TRY(group.start(args.workers, listen_ip, listen_port));
+
+        CTXLOG_INFO("starting server with %zu workers and %zu relay workers...", args.workers, args.relay_workers);
+        ev_run(loop, 0);
+
+        // clean up
+        group.join();
+    } else {
+        Server server(loop, handler);
+        setup_server(&args, server);
+        sigcatcher.server = &server;
+
+        TRY(server.init());
+        TRY(server.start_listen(listen_ip, listen_port));
 
-    CTXLOG_INFO("starting server...");
-    ev_run(loop, 0);
+        CTXLOG_INFO("starting server. [backend:%s]", ev_backend_name(ev_backend(loop)));
+        ev_run(loop, 0);
+
+        // clean up
+        assert(server.clients() == 0);
+    }
 
-    // clean up
-    assert(server.clients() == 0);
     ev_signal_stop(loop, &sigcatcher.watcher);
+    if (loader.args != NULL) {
+        ev_signal_stop(loop, &loader.watcher);
+    }
+    if (loader.thread != NULL) {
+        loader.thread->join();
+        delete loader.thread;
+    }
     ev_loop_destroy(loop);
+    if (!args.dns_cache.empty()) {
+        Error err = g_resolver.save(args.dns_cache);
+        if (!err.ok()) {
+            CTXLOG_WARN("save dns cache: %s", err.str().c_str());
+        }
+    }
+    g_resolver.stop();
 
     return 0;
 }
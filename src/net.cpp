@@ -1,10 +1,14 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <cstdio>
+#include <cstring>
+#include <linux/filter.h>
 
 #include "ctxlog/ctxlog_evsocks.hpp"
 #include "net.h"
@@ -24,7 +28,11 @@ namespace evsocks {
         return Ok();
     }
 
-    static Error close_fd(int fd) {
+    bool net_is_again(int32_t err) {
+        return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+    }
+
+    Error close_fd(int fd) {
         CTXLOG_PUSH_FUNC();
         Error err;
         if (::close(fd) != 0) {
@@ -34,9 +42,40 @@ namespace evsocks {
         return err;
     }
 
+    static Error attach_reuseport_cpu_bpf(int fd, const std::vector<int> &cpus) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+        // A = cpu; if (A == cpus[i]) return i; ...; return A % cpus.size()
+        std::vector<struct sock_filter> code;
+        struct sock_filter ld_cpu = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU));
+        code.push_back(ld_cpu);
+        for (size_t i = 0; i < cpus.size(); ++i) {
+            struct sock_filter jeq = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)cpus[i], 0, 1);
+            struct sock_filter ret = BPF_STMT(BPF_RET | BPF_K, (uint32_t)i);
+            code.push_back(jeq);
+            code.push_back(ret);
+        }
+        struct sock_filter mod = BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)cpus.size());
+        struct sock_filter ret_a = BPF_STMT(BPF_RET | BPF_A, 0);
+        code.push_back(mod);
+        code.push_back(ret_a);
+
+        struct sock_fprog prog;
+        prog.len = (unsigned short)code.size();
+        prog.filter = code.data();
+        if (0 != setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))) {
+            return Error(ERR_SETSOCKOPT, errno, "setsockopt(SO_ATTACH_REUSEPORT_CBPF) error");
+        }
+        return Ok();
+#else
+        (void)fd;
+        (void)cpus;
+        return Error(ERR_SETSOCKOPT, ENOPROTOOPT, "SO_ATTACH_REUSEPORT_CBPF unsupported");
+#endif
+    }
+
     static Error _net_listen(
         int &outfd, const string &host, uint16_t port,
-        int backlog, int socktype, bool reuseport)
+        int backlog, int socktype, bool reuseport, const TcpListenOpt *opt)
     {
         Error err;
         int fd = -1;
@@ -96,6 +135,21 @@ namespace evsocks {
             goto L_RETURN;
         }
 
+        if (socktype == SOCK_STREAM && opt != NULL && opt->defer_accept > 0) {
+            rv = setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt->defer_accept, sizeof(opt->defer_accept));
+            if (rv == -1) {
+                err = Error(ERR_SETSOCKOPT, errno, "setsockopt(TCP_DEFER_ACCEPT) error");
+                goto L_RETURN;
+            }
+        }
+        if (socktype == SOCK_STREAM && opt != NULL && opt->fastopen_qlen > 0) {
+            rv = setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &opt->fastopen_qlen, sizeof(opt->fastopen_qlen));
+            if (rv == -1) {
+                err = Error(ERR_SETSOCKOPT, errno, "setsockopt(TCP_FASTOPEN) error");
+                goto L_RETURN;
+            }
+        }
+
         // listen
         if (socktype == SOCK_STREAM || socktype == SOCK_SEQPACKET) {
             rv = ::listen(fd, backlog);
@@ -105,6 +159,15 @@ namespace evsocks {
             }
         }
 
+        // steer connections by receiving cpu. The program is shared by the reuseport group,
+        // which a tcp socket only joins on listen()
+        if (reuseport && opt != NULL && !opt->reuseport_cpus.empty()) {
+            err = attach_reuseport_cpu_bpf(fd, opt->reuseport_cpus);
+            if (!err.ok()) {
+                goto L_RETURN;
+            }
+        }
+
         // success
         outfd = fd;
 
@@ -117,11 +180,15 @@ namespace evsocks {
     }
 
     Error tcp_listen(int &outfd, const string &host, uint16_t port, int backlog) {
-        return _net_listen(outfd, host, port, backlog, SOCK_STREAM, true);
+        return _net_listen(outfd, host, port, backlog, SOCK_STREAM, true, NULL);
+    }
+
+    Error tcp_listen(int &outfd, const string &host, uint16_t port, int backlog, const TcpListenOpt &opt) {
+        return _net_listen(outfd, host, port, backlog, SOCK_STREAM, true, &opt);
     }
 
     Error udp_listen(int &outfd, const string &host, uint16_t port, int backlog) {
-        return _net_listen(outfd, host, port, backlog, SOCK_DGRAM, false);
+        return _net_listen(outfd, host, port, backlog, SOCK_DGRAM, false, NULL);
     }
 
     Error net_accept(int &outfd, int fd, Addr &addr) {
@@ -153,6 +220,87 @@ namespace evsocks {
         return Ok();
     }
 
+    Error tcp_connect_fastopen(int &outfd, const Addr &addr, const char *data, size_t size, size_t &sent) {
+        int fd = ::socket(addr.family(), SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd == -1) {
+            return Error(ERR_SOCKET, errno, "socket() error");
+        }
+
+        sent = 0;
+        ssize_t n = ::sendto(fd, data, size, MSG_FASTOPEN | MSG_NOSIGNAL, addr.sockaddr(), addr.socklen());
+        if (n >= 0) {
+            sent = (size_t)n;
+        } else if (errno == EOPNOTSUPP) {
+            // disabled by net.ipv4.tcp_fastopen
+            if (-1 == ::connect(fd, addr.sockaddr(), addr.socklen()) && errno != EINPROGRESS) {
+                Error err(ERR_CONNECT, errno, "connect() error");
+                close_fd(fd);
+                return err;
+            }
+        } else if (errno != EINPROGRESS) {
+            Error err(ERR_CONNECT, errno, "sendto(MSG_FASTOPEN) error");
+            close_fd(fd);
+            return err;
+        }
+
+        outfd = fd;
+        return Ok();
+    }
+
+    bool tcp_syn_data_acked(int fd) {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        if (::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+            return false;
+        }
+        return (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+    }
+
+    Error tcp_accept_queue(int fd, uint32_t &len, uint32_t &max) {
+        struct tcp_info info;
+        socklen_t size = sizeof(info);
+        if (::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &size) != 0) {
+            return Error(ERR_GETSOCKOPT, errno, "getsockopt(TCP_INFO) error");
+        }
+        // for listeners
+        len = info.tcpi_unacked;
+        max = info.tcpi_sacked;
+        return Ok();
+    }
+
+    Error net_listen_overflows(uint64_t &count) {
+        FILE *fp = ::fopen("/proc/net/netstat", "r");
+        if (fp == NULL) {
+            return Error(ERR_OPEN, errno, "fopen(/proc/net/netstat) error");
+        }
+
+        // pairs of lines: "TcpExt: names..." and "TcpExt: values..."
+        Error err(ERR_BAD_FILE, 0, "no ListenOverflows in /proc/net/netstat");
+        char names[4096];
+        char values[4096];
+        while (::fgets(names, sizeof(names), fp) && ::fgets(values, sizeof(values), fp)) {
+            if (::strncmp(names, "TcpExt:", 7) != 0) {
+                continue;
+            }
+            char *name_save = NULL;
+            char *value_save = NULL;
+            char *name = ::strtok_r(names, " \n", &name_save);
+            char *value = ::strtok_r(values, " \n", &value_save);
+            while (name != NULL && value != NULL) {
+                if (::strcmp(name, "ListenOverflows") == 0) {
+                    count = ::strtoull(value, NULL, 10);
+                    err = Ok();
+                    break;
+                }
+                name = ::strtok_r(NULL, " \n", &name_save);
+                value = ::strtok_r(NULL, " \n", &value_save);
+            }
+            break;
+        }
+        ::fclose(fp);
+        return err;
+    }
+
     Error net_local_addr(int fd, Addr &addr) {
         socklen_t socklen = Addr::max_size();
         int rv = ::getsockname(fd, addr.sockaddr(), &socklen);
@@ -162,6 +310,15 @@ namespace evsocks {
         return Ok();
     }
 
+    Error net_peer_addr(int fd, Addr &addr) {
+        socklen_t socklen = Addr::max_size();
+        int rv = ::getpeername(fd, addr.sockaddr(), &socklen);
+        if (rv != 0) {
+            return Error(ERR_GET_SOCK_NAME, errno, "getpeername() error");
+        }
+        return Ok();
+    }
+
     Error tcp_shutdown(int fd, int how) {
         int rv = ::shutdown(fd, how);
         if (rv != 0) {
@@ -1,17 +1,49 @@
 #pragma once
 
+#include <vector>
+
 #include "addr.h"
 #include "error.h"
 
 
 namespace evsocks {
+    // options for tcp_listen()
+    struct TcpListenOpt {
+        // if not empty, attach a reuseport CBPF program picking the socket by the receiving CPU:
+        // connections received on reuseport_cpus[i] go to the i-th socket of the reuseport group,
+        // other CPUs are mapped by modulo.
+        std::vector<int> reuseport_cpus;
+        // TCP_DEFER_ACCEPT in seconds: accept() only returns connections that have sent data.
+        // 0 for off.
+        int defer_accept;
+        // TCP_FASTOPEN queue length, 0 for off. Needs bit 2 of net.ipv4.tcp_fastopen.
+        int fastopen_qlen;
+
+        TcpListenOpt() : defer_accept(0), fastopen_qlen(0) {}
+    };
+
     Error net_set_nonblock(int fd);
+    // the call would block or was interrupted, retry on the next event
+    bool net_is_again(int32_t err);
+    // logs a failed close()
+    Error close_fd(int fd);
     Error tcp_listen(int &outfd, const string &host, uint16_t port, int backlog);
+    Error tcp_listen(int &outfd, const string &host, uint16_t port, int backlog, const TcpListenOpt &opt);
     Error udp_listen(int &outfd, const string &host, uint16_t port, int backlog);
     Error net_accept(int &outfd, int fd, Addr &addr);
     Error tcp_connect(int &outfd, const Addr &addr);
+    // TCP Fast Open: data goes out with the SYN if a cookie for addr is cached,
+    // sent is 0 otherwise and the connect proceeds as usual.
+    Error tcp_connect_fastopen(int &outfd, const Addr &addr, const char *data, size_t size, size_t &sent);
+    // whether the peer acked the data sent with the SYN, for connected sockets
+    bool tcp_syn_data_acked(int fd);
     Error tcp_shutdown(int fd, int how);
     Error net_recvfrom(int fd, char *buf, size_t len, size_t &datalen, int flags, Addr &addr);
     Error net_sendto(int fd, const char *buf, size_t len, size_t &sent, int flags, const Addr &addr);
     Error net_local_addr(int fd, Addr &local_addr);
+    Error net_peer_addr(int fd, Addr &peer_addr);
+    // accept queue of a listening socket from TCP_INFO
+    Error tcp_accept_queue(int fd, uint32_t &len, uint32_t &max);
+    // TcpExt ListenOverflows of /proc/net/netstat, host wide
+    Error net_listen_overflows(uint64_t &count);
 }
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <cassert>
+#include <new>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+
+namespace tz {
+
+    // slab allocator for objects of a single thread
+    template <class T>
+    class ObjectPool : private boost::noncopyable {
+    public:
+        explicit ObjectPool(size_t slab_objects = 256)
+            : slab_objects(slab_objects), free_list(NULL), free_count(0), used(0)
+        {}
+
+        ~ObjectPool() {
+            // objects must be released before the pool
+            assert(this->used == 0);
+            for (size_t i = 0; i < this->slabs.size(); ++i) {
+                ::free(this->slabs[i]);
+            }
+        }
+
+        T *alloc() {
+            if (this->free_list == NULL) {
+                this->grow(this->slab_objects);
+            }
+            Slot *slot = this->free_list;
+            this->free_list = slot->next;
+            this->free_count--;
+            this->used++;
+            return new (slot->data) T();
+        }
+
+        void release(T *obj) {
+            obj->~T();
+            Slot *slot = reinterpret_cast<Slot *>(obj);
+            slot->next = this->free_list;
+            this->free_list = slot;
+            this->free_count++;
+            assert(this->used > 0);
+            this->used--;
+        }
+
+        // make sure at least n objects can be allocated without touching malloc
+        void prealloc(size_t n) {
+            if (n > this->free_count) {
+                this->grow(n - this->free_count);
+            }
+        }
+
+        size_t size() const { return this->used; }
+        size_t capacity() const { return this->used + this->free_count; }
+
+    private:
+        union Slot {
+            Slot *next;
+            char data[sizeof(T)];
+            // alignment
+            long double ld_;
+            void *p_;
+            long long ll_;
+        };
+
+        void grow(size_t n) {
+            Slot *slab = static_cast<Slot *>(::malloc(sizeof(Slot) * n));
+            if (slab == NULL) {
+                throw std::bad_alloc();
+            }
+            this->slabs.push_back(slab);
+            for (size_t i = n; i > 0; --i) {
+                slab[i - 1].next = this->free_list;
+                this->free_list = &slab[i - 1];
+            }
+            this->free_count += n;
+        }
+
+        size_t slab_objects;
+        std::vector<Slot *> slabs;
+        Slot *free_list;
+        size_t free_count;
+        size_t used;
+    };
+
+}
@@ -0,0 +1,58 @@
+#include <cassert>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pipepool.h"
+
+
+using namespace evsocks;
+
+
+static void close_pipe(const Pipe &pipe) {
+    ::close(pipe.rd);
+    ::close(pipe.wr);
+}
+
+
+PipePool::~PipePool() {
+    for (size_t i = 0; i < this->idle.size(); ++i) {
+        close_pipe(this->idle[i]);
+    }
+}
+
+Error PipePool::acquire(Pipe &pipe) {
+    if (!this->idle.empty()) {
+        pipe = this->idle.back();
+        this->idle.pop_back();
+        this->used++;
+        return Ok();
+    }
+
+    int fds[2];
+    if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        return Error(ERR_SPLICE, errno, "pipe2() failed");
+    }
+    int cap = ::fcntl(fds[0], F_GETPIPE_SZ);
+    if (cap <= 0) {
+        int saved = errno;
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return Error(ERR_SPLICE, saved, "fcntl(F_GETPIPE_SZ) failed");
+    }
+
+    pipe.rd = fds[0];
+    pipe.wr = fds[1];
+    pipe.cap = (size_t)cap;
+    this->used++;
+    return Ok();
+}
+
+void PipePool::release(const Pipe &pipe, bool drained) {
+    assert(this->used > 0);
+    this->used--;
+    if (drained && this->idle.size() < this->max_idle) {
+        this->idle.push_back(pipe);
+    } else {
+        close_pipe(pipe);
+    }
+}
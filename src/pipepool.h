@@ -0,0 +1,39 @@
+#ifndef EVSOCKS_PIPEPOOL_H
+#define EVSOCKS_PIPEPOOL_H
+
+#include <cstddef>
+#include <vector>
+
+#include "error.h"
+
+
+namespace evsocks {
+
+    using std::vector;
+
+
+    struct Pipe {
+        int rd;
+        int wr;
+        size_t cap;     // F_GETPIPE_SZ
+
+        Pipe() : rd(-1), wr(-1), cap(0) {}
+    };
+
+    // reusable pipe pairs for splice(), owned by a single loop
+    struct PipePool {
+        size_t max_idle;
+        size_t used;
+        vector<Pipe> idle;
+
+        explicit PipePool(size_t max_idle = 256) : max_idle(max_idle), used(0) {}
+        ~PipePool();
+
+        Error acquire(Pipe &pipe);
+        // a pipe still holding data can not be reused
+        void release(const Pipe &pipe, bool drained);
+    };
+
+}
+
+#endif //EVSOCKS_PIPEPOOL_H
@@ -0,0 +1,443 @@
+#include <cstring>
+#include <cstdio>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <boost/bind/bind.hpp>
+
+#include "resolver.h"
+#include "ctxlog/ctxlog_evsocks.hpp"
+
+
+using namespace evsocks;
+
+
+static void port_async_cb(EV_P_ ev_async *w, int revents) {
+    (void)revents;
+    ResolverPort &port = *(ResolverPort *)((char *)w - offsetof(ResolverPort, async));
+    port.on_async();
+}
+
+void ResolverPort::init(struct ev_loop *loop, DoneCb cb, void *userdata) {
+    this->loop = loop;
+    this->cb = cb;
+    this->userdata = userdata;
+    ev_async_init(&this->async, port_async_cb);
+    ev_async_start(this->loop, &this->async);
+}
+
+void ResolverPort::stop() {
+    if (this->loop != NULL) {
+        ev_async_stop(this->loop, &this->async);
+    }
+}
+
+void ResolverPort::post(uint64_t token, const ResolveResult &res) {
+    {
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        this->done.push_back(Done());
+        this->done.back().token = token;
+        this->done.back().res = res;
+    }
+    ev_async_send(this->loop, &this->async);
+}
+
+void ResolverPort::on_async() {
+    // one at a time, callbacks may cancel queued tokens
+    while (true) {
+        Done done;
+        {
+            boost::lock_guard<boost::mutex> lock(this->mutex);
+            if (this->done.empty()) {
+                break;
+            }
+            done = this->done.front();
+            this->done.pop_front();
+        }
+        this->cb(this->userdata, done.token, done.res);
+    }
+}
+
+
+Resolver::Resolver()
+    : ttl(60), negative_ttl(5), max_entries(100000), prefetch(5), stopping(false)
+{}
+
+Resolver::~Resolver() {
+    this->stop();
+}
+
+Error Resolver::start(size_t threads) {
+    for (size_t i = 0; i < threads; ++i) {
+        try {
+            this->threads.push_back(new boost::thread(boost::bind(&Resolver::run, this)));
+        } catch (boost::thread_resource_error &ex) {
+            return Error(ERR_THREAD, 0, strfmt("failed to start resolver thread: %s", ex.what()));
+        }
+    }
+    return Ok();
+}
+
+void Resolver::stop() {
+    {
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->cond.notify_all();
+    for (size_t i = 0; i < this->threads.size(); ++i) {
+        this->threads[i]->join();
+        delete this->threads[i];
+    }
+    this->threads.clear();
+}
+
+bool Resolver::find_cache(const string &name, ResolveResult &res) {
+    map<string, Entry>::iterator it = this->cache.find(name);
+    if (it == this->cache.end()) {
+        return false;
+    }
+
+    ev_tstamp now = ev_time();
+    const Entry &entry = it->second;
+    if (entry.expire <= now) {
+        this->erase_cache(it);
+        return false;
+    }
+    res = entry.res;
+    // keep hot names warm
+    if (entry.res.err == 0 && entry.expire - now < this->prefetch) {
+        this->query(name);
+    }
+    return true;
+}
+
+void Resolver::query(const string &name) {
+    if (this->inflight.find(name) == this->inflight.end()) {
+        this->inflight[name];
+        this->jobs.push_back(name);
+        this->cond.notify_one();
+    }
+}
+
+bool Resolver::resolve(ResolverPort &port, const string &name, uint64_t token, ResolveResult &res) {
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    if (this->find_cache(name, res)) {
+        return true;
+    }
+
+    this->query(name);
+    Waiter waiter(&port, token);
+    this->unwait(waiter);   // one query per token
+    this->inflight[name].insert(waiter);
+    this->waiting[waiter] = name;
+    return false;
+}
+
+bool Resolver::lookup(const string &name, ResolveResult &res) {
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    if (this->find_cache(name, res)) {
+        return true;
+    }
+    this->query(name);
+    return false;
+}
+
+void Resolver::unwait(const Waiter &waiter) {
+    map<Waiter, string>::iterator it = this->waiting.find(waiter);
+    if (it != this->waiting.end()) {
+        // the query itself goes on, it fills the cache
+        map<string, set<Waiter> >::iterator query = this->inflight.find(it->second);
+        assert(query != this->inflight.end());
+        query->second.erase(waiter);
+        this->waiting.erase(it);
+    }
+}
+
+void Resolver::detach(ResolverPort &port) {
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    // waiters of port are adjacent
+    map<Waiter, string>::iterator it = this->waiting.lower_bound(Waiter(&port, 0));
+    while (it != this->waiting.end() && it->first.first == &port) {
+        map<string, set<Waiter> >::iterator query = this->inflight.find(it->second);
+        assert(query != this->inflight.end());
+        query->second.erase(it->first);
+        this->waiting.erase(it++);
+    }
+}
+
+void Resolver::cancel(ResolverPort &port, uint64_t token) {
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    this->unwait(Waiter(&port, token));
+
+    // may be posted already, the queue holds results of the current loop iteration only
+    boost::lock_guard<boost::mutex> port_lock(port.mutex);
+    deque<ResolverPort::Done> &done = port.done;
+    for (size_t i = 0; i < done.size();) {
+        if (done[i].token == token) {
+            done.erase(done.begin() + i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+void Resolver::put_cache(const string &name, const ResolveResult &res, ev_tstamp expire) {
+    map<string, Entry>::iterator it = this->cache.find(name);
+    if (it != this->cache.end()) {
+        this->expires.erase(it->second.by_expire);
+    } else {
+        if (this->max_entries == 0) {
+            return;
+        }
+        // the entry expiring first goes, expired ones included
+        while (this->cache.size() >= this->max_entries) {
+            this->erase_cache(this->cache.find(*this->expires.begin()->second));
+        }
+        it = this->cache.insert(make_pair(name, Entry())).first;
+    }
+
+    Entry &entry = it->second;
+    entry.res = res;
+    entry.expire = expire;
+    entry.by_expire = this->expires.insert(make_pair(expire, &it->first));
+}
+
+void Resolver::erase_cache(map<string, Entry>::iterator it) {
+    this->expires.erase(it->second.by_expire);
+    this->cache.erase(it);
+}
+
+static ResolveResult do_resolve(const string &name) {
+    ResolveResult res;
+
+    struct addrinfo hints;
+    ::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    struct addrinfo *result = NULL;
+    res.err = ::getaddrinfo(name.c_str(), NULL, &hints, &result);
+    if (res.err != 0) {
+        return res;
+    }
+    for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+        if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+            || ai->ai_addrlen > Addr::max_size())
+        {
+            continue;
+        }
+        Addr addr;
+        ::memcpy(addr.sockaddr(), ai->ai_addr, ai->ai_addrlen);
+        res.addrs.push_back(addr.port(0));
+    }
+    ::freeaddrinfo(result);
+
+    if (res.addrs.empty()) {
+        res.err = EAI_NONAME;
+    }
+    return res;
+}
+
+void Resolver::run() {
+    CTXLOG_PUSH_FUNC();
+
+    while (true) {
+        string name;
+        {
+            boost::unique_lock<boost::mutex> lock(this->mutex);
+            while (this->jobs.empty() && !this->stopping) {
+                this->cond.wait(lock);
+            }
+            if (this->stopping) {
+                return;
+            }
+            name = this->jobs.front();
+            this->jobs.pop_front();
+        }
+
+        ResolveResult res = do_resolve(name);
+        if (res.err != 0) {
+            CTXLOG_INFO("failed to resolve [name:%s]: %s", name.c_str(), gai_strerror(res.err));
+        }
+
+        // deliver under the lock so detach() can not race with post()
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        ev_tstamp now = ev_time();
+        map<string, Entry>::iterator cached = this->cache.find(name);
+        if (res.err != 0 && cached != this->cache.end() && cached->second.res.err == 0 && cached->second.expire > now) {
+            // a failed prefetch keeps the addresses it was refreshing until they expire
+            res = cached->second.res;
+        } else {
+            this->put_cache(name, res, now + (res.err == 0 ? this->ttl : this->negative_ttl));
+        }
+        map<string, set<Waiter> >::iterator it = this->inflight.find(name);
+        assert(it != this->inflight.end());
+        for (set<Waiter>::iterator w = it->second.begin(); w != it->second.end(); ++w) {
+            w->first->post(w->second, res);
+            this->waiting.erase(*w);
+        }
+        this->inflight.erase(it);
+    }
+}
+
+
+// snapshot file, native byte order:
+//  header: magic[8], count u32
+//  entry:  expire f64, err i32, name_len u16, addr_num u16, name, addr_num * (family u8, ip[16])
+static const char k_snapshot_magic[8] = {'E', 'V', 'S', 'D', 'N', 'S', '1', '\n'};
+static const size_t k_header_size = 8 + 4;
+static const size_t k_entry_size = 8 + 4 + 2 + 2;
+static const size_t k_addr_size = 1 + 16;
+
+template <class T>
+static char *put(char *p, const T &value) {
+    ::memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
+
+template <class T>
+static const char *get(const char *p, T &value) {
+    ::memcpy(&value, p, sizeof(value));
+    return p + sizeof(value);
+}
+
+Error Resolver::save(const string &path) {
+    // copy under the lock, write without it
+    map<string, Entry> entries;
+    {
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        entries = this->cache;
+    }
+
+    ev_tstamp now = ev_time();
+    size_t size = k_header_size;
+    uint32_t count = 0;
+    for (map<string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (it->second.expire > now && it->first.size() <= 0xffff && it->second.res.addrs.size() <= 0xffff) {
+            size += k_entry_size + it->first.size() + it->second.res.addrs.size() * k_addr_size;
+            count++;
+        }
+    }
+
+    string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return Error(ERR_OPEN, errno, strfmt("open() failed for [path:%s]", tmp.c_str()));
+    }
+    if (::ftruncate(fd, (off_t)size) != 0) {
+        int saved = errno;
+        ::close(fd);
+        return Error(ERR_WRITE, saved, "ftruncate() failed");
+    }
+    char *base = (char *)::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        return Error(ERR_MMAP, errno, "mmap() failed");
+    }
+
+    char *p = base;
+    ::memcpy(p, k_snapshot_magic, sizeof(k_snapshot_magic));
+    p = put(p + sizeof(k_snapshot_magic), count);
+    for (map<string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        const string &name = it->first;
+        const Entry &entry = it->second;
+        if (!(entry.expire > now && name.size() <= 0xffff && entry.res.addrs.size() <= 0xffff)) {
+            continue;
+        }
+        p = put(p, (double)entry.expire);
+        p = put(p, (int32_t)entry.res.err);
+        p = put(p, (uint16_t)name.size());
+        p = put(p, (uint16_t)entry.res.addrs.size());
+        ::memcpy(p, name.data(), name.size());
+        p += name.size();
+        for (size_t i = 0; i < entry.res.addrs.size(); ++i) {
+            const Addr &addr = entry.res.addrs[i];
+            *p++ = (char)(addr.family() == AF_INET6 ? 6 : 4);
+            ::memset(p, 0, 16);
+            ::memcpy(p, addr.ip_data(), addr.ip_size());
+            p += 16;
+        }
+    }
+    assert(p == base + size);
+    ::munmap(base, size);
+
+    if (::rename(tmp.c_str(), path.c_str()) != 0) {
+        return Error(ERR_WRITE, errno, strfmt("rename() failed for [path:%s]", path.c_str()));
+    }
+    return Ok();
+}
+
+Error Resolver::load(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return Error(ERR_OPEN, errno, strfmt("open() failed for [path:%s]", path.c_str()));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        int saved = errno;
+        ::close(fd);
+        return Error(ERR_READ, saved, "fstat() failed");
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < k_header_size) {
+        ::close(fd);
+        return Error(ERR_BAD_FILE, 0, "dns snapshot too short");
+    }
+    const char *base = (const char *)::mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        return Error(ERR_MMAP, errno, "mmap() failed");
+    }
+
+    Error err;
+    const char *p = base;
+    const char *end = base + size;
+    uint32_t count = 0;
+    if (::memcmp(p, k_snapshot_magic, sizeof(k_snapshot_magic)) != 0) {
+        err = Error(ERR_BAD_FILE, 0, "bad dns snapshot magic");
+        count = 0;
+    } else {
+        p = get(p + sizeof(k_snapshot_magic), count);
+    }
+
+    ev_tstamp now = ev_time();
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    for (uint32_t n = 0; n < count; ++n) {
+        double expire = 0;
+        int32_t gai_err = 0;
+        uint16_t name_len = 0;
+        uint16_t addr_num = 0;
+        if ((size_t)(end - p) < k_entry_size) {
+            err = Error(ERR_BAD_FILE, 0, "dns snapshot truncated");
+            break;
+        }
+        p = get(p, expire);
+        p = get(p, gai_err);
+        p = get(p, name_len);
+        p = get(p, addr_num);
+        if ((size_t)(end - p) < name_len + (size_t)addr_num * k_addr_size) {
+            err = Error(ERR_BAD_FILE, 0, "dns snapshot truncated");
+            break;
+        }
+        string name(p, name_len);
+        p += name_len;
+
+        ResolveResult res;
+        res.err = gai_err;
+        for (uint16_t i = 0; i < addr_num; ++i, p += k_addr_size) {
+            res.addrs.push_back(p[0] == 6 ? Addr::from_ipv6(p + 1, 0) : Addr::from_ipv4(p + 1, 0));
+        }
+        // remaining TTL only
+        if (expire > now && this->cache.size() < this->max_entries) {
+            this->put_cache(name, res, expire);
+        }
+    }
+
+    ::munmap((void *)base, size);
+    return err;
+}
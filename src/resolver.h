@@ -0,0 +1,122 @@
+#ifndef EVSOCKS_RESOLVER_H
+#define EVSOCKS_RESOLVER_H
+
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+
+#include <ev.h>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "addr.h"
+#include "error.h"
+
+
+namespace evsocks {
+    using namespace std;
+
+
+    struct ResolveResult {
+        int err;                // getaddrinfo() error, 0 on success
+        vector<Addr> addrs;     // port 0
+
+        ResolveResult() : err(0) {}
+    };
+
+    // completions of a single loop, results are delivered to cb on that loop
+    struct ResolverPort {
+        typedef void (*DoneCb)(void *userdata, uint64_t token, const ResolveResult &res);
+
+        struct ev_loop *loop;
+        ev_async async;
+        DoneCb cb;
+        void *userdata;
+
+        struct Done {
+            uint64_t token;
+            ResolveResult res;
+        };
+        boost::mutex mutex;
+        deque<Done> done;   // guarded by mutex
+
+        ResolverPort() : loop(NULL), cb(NULL), userdata(NULL) {}
+
+        void init(struct ev_loop *loop, DoneCb cb, void *userdata);
+        void stop();
+        void post(uint64_t token, const ResolveResult &res);
+        void on_async();
+    };
+
+    // getaddrinfo() on a thread pool with a cache shared by all loops.
+    // Concurrent lookups of the same name share one query.
+    // getaddrinfo() does not expose record TTLs, so entries live for fixed TTLs.
+    // The cache can be saved to a file and loaded on the next start.
+    struct Resolver {
+        // public
+        ev_tstamp ttl;              // positive entries
+        ev_tstamp negative_ttl;     // failed lookups
+        size_t max_entries;
+        // refresh a positive entry in background if it is hit within prefetch seconds of expiry,
+        // a failed refresh keeps the entry until it expires
+        ev_tstamp prefetch;
+
+        // private
+        // names of the cache by expire time, pointing to the keys of cache
+        typedef multimap<ev_tstamp, const string *> ExpireIndex;
+        struct Entry {
+            ResolveResult res;
+            ev_tstamp expire;
+            ExpireIndex::iterator by_expire;
+        };
+        typedef pair<ResolverPort *, uint64_t> Waiter;
+
+        boost::mutex mutex;
+        boost::condition_variable cond;
+        map<string, Entry> cache;
+        ExpireIndex expires;
+        map<string, set<Waiter> > inflight;
+        map<Waiter, string> waiting;    // name each waiter of inflight waits for
+        deque<string> jobs;
+        bool stopping;
+        vector<boost::thread *> threads;
+
+        // public
+        Resolver();
+        ~Resolver();
+
+        Error start(size_t threads);
+        void stop();
+
+        // returns true and fills res on cache hit,
+        // otherwise res is delivered to port later with token
+        bool resolve(ResolverPort &port, const string &name, uint64_t token, ResolveResult &res);
+        // cache only, a miss starts a query in background (UDP datagrams are not held back)
+        bool lookup(const string &name, ResolveResult &res);
+        // drop pending deliveries to port, must be called before the port goes away
+        void detach(ResolverPort &port);
+        // drop the pending delivery of token, from the loop of port
+        void cancel(ResolverPort &port, uint64_t token);
+
+        // unexpired entries with their absolute expire time
+        Error save(const string &path);
+        Error load(const string &path);
+
+        // private
+        void run();
+        // with mutex held
+        void put_cache(const string &name, const ResolveResult &res, ev_tstamp expire);
+        void erase_cache(map<string, Entry>::iterator it);
+        bool find_cache(const string &name, ResolveResult &res);
+        void query(const string &name);
+        void unwait(const Waiter &waiter);
+    };
+}
+
+
+#endif //EVSOCKS_RESOLVER_H
@@ -1,5 +1,7 @@
 #include <math.h>
 #include <unistd.h>
+#include <netdb.h>
+#include <fcntl.h>
 
 #include "server.h"
 #include "net.h"
@@ -11,30 +13,29 @@
 using namespace evsocks;
 
 
-static Error close_fd(int fd) {
-    CTXLOG_PUSH_FUNC();
-    Error err;
-    if (::close(fd) != 0) {
-        err = Error(ERR_CLOSE, errno, strfmt("close() failed for [fd:%d]", fd));
-        CTXLOG_ERR("%s", err.str().c_str());
-    }
-    return err;
-}
-
-static bool is_again(int32_t err) {
-    return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
-}
-
 
 // libev callbacks
 static void server_accept_cb(EV_P_ ev_io *w, int revents);
 static void server_timer_cb(EV_P_ ev_timer *w, int revents);
+static void server_stats_cb(EV_P_ ev_timer *w, int revents);
+static void server_lag_prepare_cb(EV_P_ ev_prepare *w, int revents);
+static void server_lag_check_cb(EV_P_ ev_check *w, int revents);
 static void client_send_cb(EV_P_ ev_io *io, int revents);
 static void client_recv_cb(EV_P_ ev_io *io, int revents);
+static void on_client_readable(ClientConn &client, bool speculative);
+static void on_client_input(ClientConn &client, const char *buf, size_t size);
 static void remote_send_cb(EV_P_ ev_io *io, int revents);
 static void remote_recv_cb(EV_P_ ev_io *io, int revents);
 static void udp_client_recv_cb(EV_P_ ev_io *io, int revents);
 static void udp_remote_recv_cb(EV_P_ ev_io *io, int revents);
+// io_uring completions
+static void server_accept_uring_cb(void *userdata, int op, int res, const char *data);
+static void server_accept_prepare_cb(EV_P_ ev_prepare *w, int revents);
+static void client_uring_cb(void *userdata, int op, int res, const char *data);
+static void remote_uring_cb(void *userdata, int op, int res, const char *data);
+
+static void server_resolved_cb(void *userdata, uint64_t token, const ResolveResult &res);
+static void client_connected_cb(void *userdata, int fd, const Addr &addr, Error err);
 
 static void check_term_cb(Server *s);
 
@@ -45,13 +46,75 @@ static const size_t k_write_buf_max_size = 1024 * 64;
 static DefaultServerHandler g_default_handler;
 
 
+static const struct {
+    const char *name;
+    unsigned int backend;
+} k_ev_backends[] = {
+    {"select", EVBACKEND_SELECT},
+    {"poll", EVBACKEND_POLL},
+    {"epoll", EVBACKEND_EPOLL},
+#if EV_VERSION_MAJOR > 4 || (EV_VERSION_MAJOR == 4 && EV_VERSION_MINOR >= 25)
+    {"linuxaio", EVBACKEND_LINUXAIO},
+#endif
+#if EV_VERSION_MAJOR > 4 || (EV_VERSION_MAJOR == 4 && EV_VERSION_MINOR >= 31)
+    {"iouring", EVBACKEND_IOURING},
+#endif
+};
+
+const char *evsocks::ev_backend_name(unsigned int backend) {
+    for (size_t i = 0; i < sizeof(k_ev_backends) / sizeof(k_ev_backends[0]); ++i) {
+        if (k_ev_backends[i].backend == backend) {
+            return k_ev_backends[i].name;
+        }
+    }
+    return "unknown";
+}
+
+bool evsocks::ev_backend_parse(const string &name, unsigned int &flags) {
+    if (name == "auto") {
+        flags = EVFLAG_AUTO;
+        return true;
+    }
+    for (size_t i = 0; i < sizeof(k_ev_backends) / sizeof(k_ev_backends[0]); ++i) {
+        if (name == k_ev_backends[i].name) {
+            flags = k_ev_backends[i].backend;
+            return true;
+        }
+    }
+    return false;
+}
+
+
 Server::Server(struct ev_loop *loop, IServerHandler *handler)
     : handler(handler ? handler : static_cast<IServerHandler *>(&g_default_handler))
     , term_req(false), term_cb(NULL), term_userdata(NULL)
-    , loop(loop), listen_fd(-1)
-    , client_timeouts(5.0), remote_timeouts(5.0), idle_timeouts(60 * 10)
+    , accept_cb(NULL), accept_userdata(NULL), stream_cb(NULL), stream_userdata(NULL)
+    , stats_interval(0), splice(false), io_uring(false), budget(NULL), resolver(NULL)
+    , accept_budget(64), max_sessions(0), overload_lag(0), ip_limits(NULL), auth_timeout(5), auth_cache(NULL)
+    , connect_timeout(10.0), connect_attempt_delay(0.25), eyeballs(NULL), fastopen(false)
+    , loop(loop), listen_file(NULL), listen_fd(-1), spare_fd(-1), accept_paused(false), shed_log_ts(0)
+    , accept_iteration(0), accept_count(0)
+    , lag_prepare_ts(0), lag_check_ts(0), loop_lag(0), overloaded(false)
+    , client_timeouts(5.0, 0.1), remote_timeouts(5.0, 0.1), idle_timeouts(60 * 10, 1.0)
+    , n_clients(0)
 {
     ev_init(&this->listen_io, server_accept_cb);
+    // after the sessions of the same iteration
+    ev_set_priority(&this->listen_io, EV_MINPRI);
+    ev_prepare_init(&this->lag_prepare, server_lag_prepare_cb);
+    ev_check_init(&this->lag_check, server_lag_check_cb);
+    ev_prepare_init(&this->accept_prepare, server_accept_prepare_cb);
+    // before the ring submits the SQEs of this iteration
+    ev_set_priority(&this->accept_prepare, EV_MAXPRI);
+}
+
+Server::~Server() {
+    if (this->resolver != NULL) {
+        this->resolver->detach(this->resolver_port);
+    }
+    if (this->spare_fd >= 0) {
+        close_fd(this->spare_fd);
+    }
 }
 
 Error Server::init() {
@@ -62,18 +125,57 @@ Error Server::init() {
     ev_timer_init(&this->timer, server_timer_cb, min_timeout, 0);
     ev_timer_start(this->loop, &this->timer);
 
+    ev_timer_init(&this->stats_timer, server_stats_cb, this->stats_interval, this->stats_interval);
+    if (this->stats_interval > 0) {
+        ev_timer_start(this->loop, &this->stats_timer);
+    }
+
+    if (this->resolver != NULL) {
+        this->resolver_port.init(this->loop, server_resolved_cb, this);
+    }
+
+    if (this->overload_lag > 0) {
+        // measure only, do not keep the loop alive
+        ev_prepare_start(this->loop, &this->lag_prepare);
+        ev_unref(this->loop);
+        ev_check_start(this->loop, &this->lag_check);
+        ev_unref(this->loop);
+    }
+
+    // given up under EMFILE to accept and close pending connections
+    this->spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (this->spare_fd < 0) {
+        return Error(ERR_OPEN, errno, "open(/dev/null) failed for the spare fd");
+    }
+
+    if (this->io_uring) {
+        this->uring.stats = &this->stats.io;
+        Error err = this->uring.init(this->loop);
+        if (!err.ok()) {
+            CTXLOG_WARN("io_uring not available, relaying with watchers. %s", err.str().c_str());
+        }
+    }
+
     return Ok();
 }
 
 Error Server::start_listen(const string &host, uint16_t port) {
     assert(this->listen_fd == -1);
-    Error err = tcp_listen(this->listen_fd, host, port, SOMAXCONN);
+    Error err = tcp_listen(this->listen_fd, host, port, SOMAXCONN, this->listen_opt);
     if (!err.ok()) {
         return err;
     }
 
-    ev_io_set(&this->listen_io, this->listen_fd, EV_READ);
-    ev_io_start(this->loop, &this->listen_io);
+    if (this->uring.active()) {
+        this->listen_file = this->uring.open(this->listen_fd, server_accept_uring_cb, this);
+        this->uring.start_accept(*this->listen_file);
+    } else {
+        ev_io_set(&this->listen_io, this->listen_fd, EV_READ);
+        ev_io_start(this->loop, &this->listen_io);
+    }
+
+    // log_stats() reports overflows since now
+    net_listen_overflows(this->stats.listen_overflows_base);
 
     return Ok();
 }
@@ -86,9 +188,16 @@ Error Server::stop_listen() {
         return Ok();
     }
 
-    ev_io_stop(this->loop, &this->listen_io);
     int fd = this->listen_fd;
     this->listen_fd = -1;
+    if (this->listen_file != NULL) {
+        // closed along with the multishot accept
+        UringFile *file = this->listen_file;
+        this->listen_file = NULL;
+        ev_prepare_stop(this->loop, &this->accept_prepare);
+        return this->uring.close(file, NULL);
+    }
+    ev_io_stop(this->loop, &this->listen_io);
     return close_fd(fd);
 }
 
@@ -106,8 +215,9 @@ static void on_client_force_term(ClientConn &client) {
 
 Error Server::force_term() {
     CTXLOG_PUSH_FUNC();
-    // kick all clients
+    // kick all clients, sessions in STREAM or UDP state may only be in the idle list
     this->client_timeouts.each_timeouts(INFINITY, on_client_force_term);
+    this->idle_timeouts.each_timeouts(INFINITY, on_client_force_term);
     return this->stop_listen();
 }
 
@@ -120,15 +230,228 @@ static void server_accept_cb(EV_P_ ev_io *w, int revents) {
 
     Server &server = *(Server *)((char *)w - offsetof(Server, listen_io));
 
-    int connfd = -1;
-    Addr addr;
-    Error err = net_accept(connfd, server.listen_fd, addr);
-    if (!err.ok()) {
-        CTXLOG_ERR("[listenfd:%d] %s", server.listen_fd, err.str().c_str());
+    // drain the accept queue, up to the budget so established sessions are not starved
+    size_t n = 0;
+    // stopped at max_sessions or by stop_listen()
+    while (n < server.accept_budget && ev_is_active(&server.listen_io)) {
+        int connfd = -1;
+        Addr addr;
+        Error err = net_accept(connfd, server.listen_fd, addr);
+        n++;
+        if (!err.ok()) {
+            if (!server.on_accept_error(err)) {
+                return;
+            }
+            continue;
+        }
+        server.on_accepted(connfd, addr);
+    }
+    // stopped at the budget rather than by pause_accept() or stop_listen().
+    // Level triggered, called again on the next iteration.
+    if (n >= server.accept_budget && ev_is_active(&server.listen_io)) {
+        server.stats.accept_budget_hits++;
+    }
+}
+
+// a connection of the multishot accept, or the error that ended it.
+// Up to accept_budget per loop iteration as with server_accept_cb().
+static void server_accept_uring_cb(void *userdata, int op, int res, const char *data) {
+    (void)op;
+    (void)data;
+    CTXLOG_PUSH_FUNC();
+    Server &server = *(Server *)userdata;
+
+    bool more = true;
+    if (res < 0) {
+        if (server.accept_paused) {
+            return;     // re-armed by check_resume_accept()
+        }
+        more = server.on_accept_error(Error(ERR_ACCEPT, -res, "accept error"));
+        if (more && server.listen_file != NULL) {
+            // the error ended the multishot accept
+            server.uring.start_accept(*server.listen_file);
+        }
+    } else {
+        int connfd = res;
+        Addr addr;
+        Error err = net_peer_addr(connfd, addr);
+        if (err.ok()) {
+            server.on_accepted(connfd, addr);
+        } else {
+            close_fd(connfd);
+            more = server.on_accept_error(err);
+        }
+    }
+
+    // stopped at max_sessions or by stop_listen()
+    if (server.listen_file == NULL || server.accept_paused) {
+        return;
+    }
+    unsigned int iteration = ev_iteration(server.loop);
+    if (server.accept_iteration != iteration) {
+        server.accept_iteration = iteration;
+        server.accept_count = 0;
+    }
+    // completions already posted still arrive past the budget
+    if (++server.accept_count == server.accept_budget) {
+        server.stats.accept_budget_hits++;
+        more = false;
+    }
+    if (!more) {
+        server.uring.stop(*server.listen_file);
+        ev_prepare_start(server.loop, &server.accept_prepare);
+    }
+}
+
+// before polling: accept again after the iteration that stopped at the budget
+static void server_accept_prepare_cb(EV_P_ ev_prepare *w, int revents) {
+    (void)revents;
+    Server &server = *(Server *)((char *)w - offsetof(Server, accept_prepare));
+    ev_prepare_stop(EV_A_ w);
+    if (server.listen_file != NULL && !server.accept_paused) {
+        server.uring.start_accept(*server.listen_file);
+    }
+}
+
+// an accepted connection, of either accept path
+void Server::on_accepted(int fd, const Addr &addr) {
+    if (this->accept_cb != NULL) {
+        this->accept_cb(this->accept_userdata, fd, addr);
+    } else {
+        this->on_connection(fd, addr);
+    }
+}
+
+// an error of either accept path, returns false to stop accepting until the next iteration
+bool Server::on_accept_error(const Error &err) {
+    int code = err.code();
+    if (code == EAGAIN || code == EWOULDBLOCK) {
+        return false;
+    }
+    if (code == ECONNABORTED || code == EINTR || (err.type() == ERR_GET_SOCK_NAME && code == ENOTCONN)) {
+        // reset before accepted, not worth an error log each
+        this->stats.accept_aborted++;
+        return true;
+    }
+    if (code == EMFILE || code == ENFILE) {
+        // the connection stays in the queue, the next accept fails the same way
+        if (ev_now(this->loop) - this->shed_log_ts >= 1.0) {
+            CTXLOG_WARN("[listenfd:%d] out of fds, shedding connections. %s",
+                this->listen_fd, err.str().c_str());
+            this->shed_log_ts = ev_now(this->loop);
+        }
+        return this->shed_connection();
+    }
+    CTXLOG_ERR("[listenfd:%d] %s", this->listen_fd, err.str().c_str());
+    return false;
+}
+
+// time constant of the loop lag average
+static const ev_tstamp k_lag_tau = 0.1;
+
+// after polling, callbacks of this iteration follow
+static void server_lag_check_cb(EV_P_ ev_check *w, int revents) {
+    (void)revents;
+    Server &server = *(Server *)((char *)w - offsetof(Server, lag_check));
+    server.lag_check_ts = ev_time();
+}
+
+// before polling, all callbacks of this iteration are done
+static void server_lag_prepare_cb(EV_P_ ev_prepare *w, int revents) {
+    (void)revents;
+    Server &server = *(Server *)((char *)w - offsetof(Server, lag_prepare));
+    ev_tstamp now = ev_time();
+    if (server.lag_check_ts > 0) {
+        server.on_iteration(server.lag_check_ts - server.lag_prepare_ts, now - server.lag_check_ts);
+    }
+    server.lag_prepare_ts = now;
+}
+
+// idle: time spent polling before the last iteration
+// lag: time spent in callbacks by the last iteration, events arriving meanwhile wait that long
+// Averaged over time with idle time as no lag, so the average settles on time
+// however rarely the loop iterates.
+void Server::on_iteration(ev_tstamp idle, ev_tstamp lag) {
+    this->loop_lag *= exp(-idle / k_lag_tau);
+    double keep = exp(-lag / k_lag_tau);
+    this->loop_lag = this->loop_lag * keep + lag * (1 - keep);
+    if (!this->overloaded && this->loop_lag > this->overload_lag) {
+        CTXLOG_WARN("overloaded, rejecting new sessions. [loop_lag_ms:%.2f]", this->loop_lag * 1000);
+        this->overloaded = true;
+        this->stats.overloads++;
+        this->pause_accept();
+    } else if (this->overloaded && this->loop_lag < this->overload_lag / 2) {
+        CTXLOG_INFO("overload cleared. [loop_lag_ms:%.2f]", this->loop_lag * 1000);
+        this->overloaded = false;
+        this->check_resume_accept();
+    }
+    if (this->overloaded) {
+        // accept is paused, wake up to let the average settle even without other events
+        this->check_timer_before(k_lag_tau);
+    }
+}
+
+// accept and close a pending connection with the spare fd,
+// pause accepting if the spare fd is gone too
+bool Server::shed_connection() {
+    if (this->spare_fd >= 0) {
+        ::close(this->spare_fd);
+        this->spare_fd = -1;
+        int fd = ::accept(this->listen_fd, NULL, NULL);
+        if (fd >= 0) {
+            ::close(fd);
+            this->stats.accept_shed++;
+        }
+        this->spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && this->spare_fd >= 0) {
+            return true;
+        }
+    }
+    // retried when a session closes or on the next timer
+    this->pause_accept();
+    return false;
+}
+
+void Server::pause_accept() {
+    bool accepting = this->listen_file != NULL
+        ? this->uring.is_started(*this->listen_file) || ev_is_active(&this->accept_prepare)
+        : ev_is_active(&this->listen_io);
+    if (accepting) {
+        CTXLOG_INFO("pause accepting. [clients:%zu]", this->n_clients.load(boost::memory_order_relaxed));
+        if (this->listen_file != NULL) {
+            this->uring.stop(*this->listen_file);
+            ev_prepare_stop(this->loop, &this->accept_prepare);
+        } else {
+            ev_io_stop(this->loop, &this->listen_io);
+        }
+        this->accept_paused = true;
+        this->stats.accept_pauses++;
+    }
+}
+
+// resume below the low-water mark of max_sessions, with the spare fd back
+void Server::check_resume_accept() {
+    if (!this->accept_paused || this->listen_fd < 0 || this->overloaded) {
+        return;
+    }
+    size_t clients = this->n_clients.load(boost::memory_order_relaxed);
+    if (this->max_sessions > 0 && clients >= this->max_sessions - this->max_sessions / 10) {
         return;
     }
+    if (this->spare_fd < 0) {
+        this->spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (this->spare_fd < 0) {
+            return;
+        }
+    }
 
-    server.on_connection(connfd, addr);
+    CTXLOG_INFO("resume accepting. [clients:%zu]", clients);
+    this->accept_paused = false;
+    if (this->listen_file != NULL) {
+        this->uring.start_accept(*this->listen_file);
+    } else {
+        ev_io_start(this->loop, &this->listen_io);
+    }
 }
 
 static void server_timer_cb(EV_P_ ev_timer *w, int revents) {
@@ -142,20 +465,88 @@ static void server_timer_cb(EV_P_ ev_timer *w, int revents) {
     server.on_timer();
 }
 
+static void server_stats_cb(EV_P_ ev_timer *w, int revents) {
+    if (!(revents & EV_TIMER)) {
+        return;
+    }
+
+    Server &server = *(Server *)((char *)w - offsetof(Server, stats_timer));
+    server.log_stats();
+}
+
 static void client_recv_cb(EV_P_ ev_io *io, int revents) {
     if (!(revents & EV_READ)) {
         return;
     }
     ClientConn &client = *(ClientConn *)((char *)io - offsetof(ClientConn, reader_io));
+    CTXLOG_PUSH_FUNC().set("client", client.addr_str);
+    on_client_readable(client, false);
+}
+
+// unparsed client data during the handshake: the read buffer itself,
+// or client.input if part of a message was received before
+struct InputView {
+    ClientConn &client;
+    const char *data;
+    size_t size;
+    bool buffered;      // data is client.input
+
+    InputView(ClientConn &client, const char *buf, size_t size)
+        : client(client), data(buf), size(size), buffered(false)
+    {
+        if (!client.input.empty()) {
+            client.input.push(buf, size);
+            this->data = client.input.data();
+            this->size = client.input.size();
+            this->buffered = true;
+        }
+    }
+
+    void consume(size_t count) {
+        assert(count <= this->size);
+        this->data += count;
+        this->size -= count;
+        if (this->buffered) {
+            this->client.input.pop(count);
+        }
+    }
+
+    // keep the rest in client.input, the read buffer goes away
+    void save() {
+        if (!this->buffered && this->size > 0) {
+            this->client.input.push(this->data, this->size);
+            this->data = this->client.input.data();
+            this->buffered = true;
+        }
+    }
+};
+
+// speculative: called right after accept without waiting for EV_READ
+static void on_client_readable(ClientConn &client, bool speculative) {
     Server &server = *client.server;
 
-    CTXLOG_PUSH_FUNC().set("client", client.addr_str);
+    if (client.state == ClientConn::STREAM && client.remote->iochan.is_splice()) {
+        bool eof = false;
+        Error err = client.remote->iochan.splice_from(client.fd, eof);
+        if (!err.ok()) {
+            return server.on_client_error(client, err);
+        }
+        if (eof) {
+            return server.on_client_eof(client);
+        }
+        server.update_remote_timeout(*client.remote);
+        server.update_idle_timeout(client);
+        return;
+    }
 
     char buf[k_read_buf_size];
     ssize_t data_size = ::read(client.fd, buf, sizeof(buf));
+    server.stats.io.syscalls++;
     if (data_size < 0) {
-        if (is_again(errno)) {
-            CTXLOG_WARN("unexpected EAGAIN!");
+        if (net_is_again(errno)) {
+            if (!speculative) {
+                CTXLOG_WARN("unexpected EAGAIN!");
+            }
             return;
         }
         return server.on_client_error(client,
@@ -170,6 +561,9 @@ static void client_recv_cb(EV_P_ ev_io *io, int revents) {
         }
         return;
     }
+    if (speculative) {
+        server.stats.early_reads++;
+    }
 
     // stream data, skip state machine
     if (client.state == ClientConn::STREAM) {
@@ -182,32 +576,54 @@ static void client_recv_cb(EV_P_ ev_io *io, int revents) {
         return;
     }
 
-    client.input.push(buf, (size_t)data_size);
+    on_client_input(client, buf, (size_t)data_size);
+}
+
+// run the handshake state machine
+static void on_client_input(ClientConn &client, const char *buf, size_t size) {
+    Server &server = *client.server;
 
-    while (!client.input.empty()) {
+    // parse in the read buffer, client.input only keeps fragments and data pipelined after the cmd
+    InputView in(client, buf, size);
+    // replies to pipelined messages go out together
+    client.iochan.cork();
+    bool more = true;
+    while (more && in.size > 0) {
         switch (client.state) {
         case ClientConn::INIT: {    // receive methods
-            if (client.input.size() < 3) {
-                return;
+            if (in.size < 3) {
+                more = false;
+                break;
             }
-            if (client.input[0] != 5) {
+            if (in.data[0] != 5) {
                 return server.on_client_error(client,
                     Error(ERR_BAD_VERSION, 0, "client_recv_cb() error on receiving methods"));
             }
 
-            uint8_t method_num = (uint8_t)client.input[1];
+            uint8_t method_num = (uint8_t)in.data[1];
             if (method_num == 0 || method_num > 10) {
                 return server.on_client_error(client,
                     Error(ERR_BAD_METHOD_NUM, 0, "client_recv_cb() error"));
             }
-            if (client.input.size() < 2 + (size_t)client.input[1]) {
-                return;
+            if (in.size < 2 + (size_t)method_num) {
+                more = false;
+                break;
             }
 
             // choose method
-            set<uint8_t> methods(client.input.data() + 2, client.input.data() + 2 + method_num);
-            client.input.pop(2 + method_num);
-            uint8_t chosen_method = server.handler->auth_begin(methods);
+            MethodSet methods;
+            for (size_t i = 0; i < method_num; ++i) {
+                methods.add((uint8_t)in.data[2 + i]);
+            }
+            in.consume(2 + method_num);
+            uint8_t chosen_method = METHOD_REJECT;
+            if (server.overloaded) {
+                // fail fast, established sessions first
+                server.stats.overload_rejects++;
+            } else {
+                chosen_method = server.handler->auth_begin(methods);
+            }
+            client.auth_method = chosen_method;
             char response[] = {5, (char)chosen_method};
 
             Error err = client.iochan.write(response, 2);
@@ -216,6 +632,7 @@ static void client_recv_cb(EV_P_ ev_io *io, int revents) {
             }
 
             if (chosen_method == METHOD_REJECT) {
+                client.iochan.uncork();     // best effort
                 return server.on_client_error(client, Error(ERR_AUTH, 0, "auth methods rejected"));
 //            } else if (chosen_method == METHOD_NONE) {
 //                client.state = ClientConn::CMD;
@@ -224,11 +641,17 @@ static void client_recv_cb(EV_P_ ev_io *io, int revents) {
             }
         } break;
         case ClientConn::AUTH: {
+            if (client.auth_pending) {
+                more = false;   // kept until on_auth_result()
+                break;
+            }
             uint32_t auth_state = IServerHandler::AUTH_STATE_NONE;
-            Error err = server.handler->auth_perform(client, auth_state);
+            size_t used = 0;
+            Error err = server.handler->auth_perform(client, in.data, in.size, used, auth_state);
             if (!err.ok()) {
                 return server.on_client_error(client, err);
             }
+            in.consume(used);
 
             switch (auth_state) {
             case IServerHandler::AUTH_STATE_DONE:
@@ -236,8 +659,20 @@ static void client_recv_cb(EV_P_ ev_io *io, int revents) {
                 client.state = ClientConn::CMD;
                 break;
             case IServerHandler::AUTH_STATE_CONT:
-                return;
+                more = false;
+                break;
+            case IServerHandler::AUTH_STATE_PENDING:
+                // resumed by on_auth_result(), with its own timeout
+                client.auth_pending = true;
+                server.stats.auth_pending++;
+                ev_io_stop(server.loop, &client.reader_io);
+                server.client_timeouts.touch(ev_now(server.loop), client, server.auth_timeout);
+                server.check_timer_before(server.auth_timeout);
+                more = false;
+                break;
             case IServerHandler::AUTH_STATE_FAIL:
+            case IServerHandler::AUTH_STATE_ERROR:
+                client.iochan.uncork();     // best effort
                 // auth_end() will be called
                 return server.on_client_error(client, Error(ERR_AUTH, 0, "auth failure"));
             default:
@@ -246,73 +681,97 @@ static void client_recv_cb(EV_P_ ev_io *io, int revents) {
             }
         } break;
         case ClientConn::CMD: { // receive cmds
-            if (client.input.size() < 4) {
-                return;
+            if (in.size < 4) {
+                more = false;
+                break;
             }
 
-            if (client.input[0] != 5) {
+            if (in.data[0] != 5) {
                 return server.on_client_error(client,
                     Error(ERR_BAD_VERSION, 0, "client_recv_cb() error on receiving cmd"));
             }
 
-            uint8_t cmd = (uint8_t)client.input[1];
-            uint8_t atype = (uint8_t)client.input[3];
+            uint8_t cmd = (uint8_t)in.data[1];
+            uint8_t atype = (uint8_t)in.data[3];
             Addr remote_addr;
+            const char *domain = NULL;
+            uint8_t domain_len = 0;
 
             size_t idx = 4;
             switch (atype) {
             case ATYPE_IPV4: {
-                if (client.input.size() < idx + 4 + 2) {
-                    return;
+                if (in.size < idx + 4 + 2) {
+                    more = false;
+                    break;
                 }
-                remote_addr = Addr::from_ipv4(&client.input[idx], 0);
+                remote_addr = Addr::from_ipv4(&in.data[idx], 0);
                 idx += 4;
             } break;
             case ATYPE_IPV6: {
-                if (client.input.size() < idx + 16 + 2) {
-                    return;
+                if (in.size < idx + 16 + 2) {
+                    more = false;
+                    break;
                 }
-                remote_addr = Addr::from_ipv6(&client.input[idx], 0);
+                remote_addr = Addr::from_ipv6(&in.data[idx], 0);
                 idx += 16;
             } break;
             case ATYPE_DOMAIN: {
-                if (client.input.size() < idx + 1 + 1 + 2) {
-                    return;
+                if (in.size < idx + 1 + 1 + 2) {
+                    more = false;
+                    break;
                 }
-                uint8_t domain_len = (uint8_t)client.input[idx];
-                if (client.input.size() < idx + 1 + domain_len + 2) {
-                    return;
+                domain_len = (uint8_t)in.data[idx];
+                if (in.size < idx + 1 + domain_len + 2) {
+                    more = false;
+                    break;
                 }
-                ; // TODO: resolve domain name
+                domain = &in.data[idx + 1];
                 idx += 1 + domain_len;
             } break;
             default:
                 return server.on_client_error(client,
                     Error(ERR_BAD_ATYPE, 0, "client_recv_cb() error on receiving cmd"));
             }
-            remote_addr.port((uint16_t(client.input[idx]) << 8) | uint16_t(client.input[idx + 1]));
+            if (!more) {
+                break;
+            }
+            remote_addr.port((uint16_t)((uint8_t)in.data[idx] << 8 | (uint8_t)in.data[idx + 1]));
             idx += 2;
-            client.input.pop(idx);
 
             // handle cmd
             switch (cmd) {
             case CMD_CONNECT:
-                client.cmd_connect(remote_addr);
-                assert(client.input.empty());
-                break;
+                if (atype == ATYPE_DOMAIN) {
+                    string name(domain, domain_len);    // before the view moves
+                    in.consume(idx);
+                    in.save();
+                    return client.cmd_connect_domain(name, remote_addr.port());
+                }
+                in.consume(idx);
+                // continues asynchronously with pipelined data in client.input, client may be gone after this.
+                // Still corked, replies so far go out with the cmd reply.
+                in.save();
+                return client.cmd_connect(remote_addr);
             case CMD_UDP:
-                if (!client.input.empty()) {
+                in.consume(idx);
+                if (in.size > 0) {
                     return server.on_client_error(client,
                         Error(ERR_UNEXPECTED_DATA, 0, "unexpected data after udp association cmd"));
                 }
                 client.cmd_udp(remote_addr);
                 break;
             default:
+                in.consume(idx);
+                in.save();
                 CTXLOG_ERR("%s", Error(ERR_CMD_UNSUPPORTED, 0, "client_recv_cb() error").str().c_str());
                 client.reply(REPLY_ERR, Addr());
                 return;
             }
         } break;
+        case ClientConn::RESOLVING:
+        case ClientConn::CONNECTING:
+            more = false;   // reading is paused
+            break;
         case ClientConn::UDP:
             return server.on_client_error(client,
                 Error(ERR_UNEXPECTED_DATA, 0, "unexpected data after udp association cmd"));
@@ -322,28 +781,76 @@ static void client_recv_cb(EV_P_ ev_io *io, int revents) {
         default:
             CTXLOG_ERR("unknown client state: %d", client.state);
             assert(!"unknown client state");
+            more = false;
         } // switch state
     } // while input not empty
 
+    in.save();
     client.input.shrink();
+
+    Error err = client.iochan.uncork();
+    if (!err.ok()) {
+        return server.on_client_error(client, err);
+    }
+}
+
+// create the RemoteConn of a STREAM session and start reading from it
+static RemoteConn &attach_remote(ClientConn &client, int fd, const Addr &addr) {
+    Server &server = *client.server;
+
+    RemoteConn &remote = *server.remote_pool.alloc();
+    remote.fd = fd;
+    remote.addr = addr;
+    remote.addr.str(remote.addr_str, sizeof(remote.addr_str));
+    remote.client = &client;
+
+    client.remote = &remote;
+    client.iochan.producer = &remote.reader_io;
+
+    remote.iochan.init(server.loop, k_write_buf_max_size, &server.stats.io, server.budget);
+    remote.iochan.producer = &client.reader_io;
+    remote.iochan.consumer = &remote.writer_io;
+
+    ev_io_init(&remote.reader_io, remote_recv_cb, remote.fd, EV_READ);
+    ev_io_init(&remote.writer_io, remote_send_cb, remote.fd, EV_WRITE);
+    ev_io_start(server.loop, &remote.reader_io);
+    return remote;
 }
 
 void ClientConn::cmd_connect(const Addr &remote_addr) {
     CTXLOG_PUSH_FUNC();
     CTXLOG_INFO("connecting to [remote:%s]", remote_addr.str().c_str());
 
+    this->connect_to(string(), vector<Addr>(1, remote_addr), remote_addr.port());
+}
+
+void ClientConn::connect_to(const string &domain, const vector<Addr> &addrs, uint16_t port) {
     Server &server = *this->server;
 
-    int connfd = -1;
-    Error err = tcp_connect(connfd, remote_addr);
-    if (!err.ok()) {
-        CTXLOG_ERR("%s", err.str().c_str());
-        this->reply(REPLY_ERR, Addr());
-        return;
+    if (addrs.size() > 1) {
+        CTXLOG_INFO("racing connects to [addrs:%zu]", addrs.size());
+    }
+    this->state = ClientConn::CONNECTING;
+    ev_io_stop(server.loop, &this->reader_io);
+    // the connect timeout replaces the handshake timeout
+    server.client_timeouts.touch(ev_now(server.loop), *this, server.connect_timeout);
+    server.check_timer_before(server.connect_timeout);
+    // literal addresses are not tracked by eyeballs
+    this->race = new ConnectRace(server.loop, server.connect_attempt_delay, domain.empty() ? NULL : server.eyeballs);
+    if (server.fastopen && !this->input.empty()) {
+        // data pipelined after the cmd, input is not touched until the race finishes
+        this->race->payload = this->input.data();
+        this->race->payload_size = this->input.size();
     }
+    // may finish synchronously
+    this->race->start(domain, addrs, port, client_connected_cb, this);
+}
+
+bool ClientConn::on_connected(int connfd, const Addr &remote_addr) {
+    Server &server = *this->server;
 
     Addr local_addr;
-    err = net_local_addr(connfd, local_addr);
+    Error err = net_local_addr(connfd, local_addr);
     if (!err.ok()) {
         CTXLOG_ERR("%s", err.str().c_str());
     }
@@ -351,43 +858,144 @@ void ClientConn::cmd_connect(const Addr &remote_addr) {
     // reply
     err = this->reply(REPLY_OK, local_addr);
     if (!err.ok()) {
+        close_fd(connfd);
         server.on_client_error(*this, err);
-        return;
+        return false;
     }
 
     CTXLOG_INFO("cmd_connect: success");
     this->state = ClientConn::STREAM;
+    // handshakes run at a lower priority
+    ev_io_stop(server.loop, &this->reader_io);
+    ev_set_priority(&this->reader_io, 0);
+    ev_io_start(server.loop, &this->reader_io);
 
     // clear handshake timeout
     server.update_client_timeout(*this);
     // idle list
     server.update_idle_timeout(*this);
 
-    RemoteConn &remote = *(new RemoteConn());
-    remote.fd = connfd;
-    remote.addr = remote_addr;
-    remote.addr_str = remote.addr.str();
-    remote.client = this;
+    RemoteConn &remote = attach_remote(*this, connfd, remote_addr);
+    // transfer data after cmd
+    remote.iochan.buf.push(this->input.data(), this->input.size());
+    remote.iochan.charge();
+    this->input.pop(this->input.size());
+    this->input.shrink();
+    assert(this->input.empty());
+    if (!remote.iochan.buf.empty()) {
+        ev_io_start(server.loop, &remote.writer_io);
+    }
+    if (server.uring.active() && server.stream_cb == NULL) {
+        server.setup_uring(*this);
+    } else if (server.splice && server.stream_cb == NULL) {
+        server.setup_splice(*this);
+    }
+    return true;
+}
+
+void ClientConn::cmd_connect_domain(const string &domain, uint16_t port) {
+    CTXLOG_PUSH_FUNC();
+    Server &server = *this->server;
+
+    if (server.resolver == NULL) {
+        CTXLOG_ERR("no resolver for [domain:%s]", domain.c_str());
+        this->reply(REPLY_HOST_UNREACHABLE, Addr());
+        return;
+    }
 
-    this->remote = &remote;
-    this->iochan.producer = &remote.reader_io;
+    this->resolve_domain = domain;
+    this->resolve_port = port;
+    ResolveResult res;
+    if (server.resolver->resolve(server.resolver_port, domain, (uintptr_t)this, res)) {
+        return this->on_resolved(res);
+    }
 
-    remote.iochan.init(server.loop, k_write_buf_max_size);
-    remote.iochan.producer = &this->reader_io;
-    remote.iochan.consumer = &remote.writer_io;
-    remote.iochan.buf.swap(this->input);    // transfer data after cmd
-    assert(this->input.empty());
+    CTXLOG_INFO("resolving [domain:%s]", domain.c_str());
+    this->state = ClientConn::RESOLVING;
+    // buffer at most what was read along with the cmd
+    ev_io_stop(server.loop, &this->reader_io);
+}
 
-    ev_io_init(&remote.reader_io, remote_recv_cb, remote.fd, EV_READ);
-    ev_io_init(&remote.writer_io, remote_send_cb, remote.fd, EV_WRITE);
+void ClientConn::on_resolved(const ResolveResult &res) {
+    Server &server = *this->server;
 
-    ev_io_start(server.loop, &remote.reader_io);
-    if (!remote.iochan.buf.empty()) {
-        ev_io_start(server.loop, &remote.writer_io);
+    if (this->state == ClientConn::RESOLVING) {
+        this->state = ClientConn::CMD;
+        ev_io_start(server.loop, &this->reader_io);
+    }
+    if (res.err != 0) {
+        CTXLOG_ERR("resolve error: %s", gai_strerror(res.err));
+        this->reply(REPLY_HOST_UNREACHABLE, Addr());
+        return;
+    }
+
+    this->connect_to(this->resolve_domain, res.addrs, this->resolve_port);
+}
+
+static uint8_t connect_reply_code(int err) {
+    switch (err) {
+    case ECONNREFUSED:
+        return REPLY_CONN_REFUSED;
+    case ENETUNREACH:
+        return REPLY_NET_UNREACHABLE;
+    case EHOSTUNREACH:
+        return REPLY_HOST_UNREACHABLE;
+    case ETIMEDOUT:
+        return REPLY_TTL_EXPIRED;
+    default:
+        return REPLY_ERR;
+    }
+}
+
+static void client_connected_cb(void *userdata, int fd, const Addr &addr, Error err) {
+    ClientConn &client = *(ClientConn *)userdata;
+    Server &server = *client.server;
+    CTXLOG_PUSH_FUNC().set("client", client.addr_str);
+    assert(client.state == ClientConn::CONNECTING);
+
+    server.stats.connects++;
+    server.stats.connect_latency += ev_time() - client.race->started;
+    size_t sent = client.race->sent;
+    delete client.race;
+    client.race = NULL;
+    client.state = ClientConn::CMD;
+    ev_io_start(server.loop, &client.reader_io);
+
+    if (!err.ok()) {
+        CTXLOG_ERR("%s", err.str().c_str());
+        server.stats.connect_errors++;
+        client.reply(connect_reply_code(err.code()), Addr());
+        return;
     }
+
+    CTXLOG_INFO("connected to [remote:%s]", addr.str().c_str());
+    if (sent > 0) {
+        server.stats.fastopen_sent++;
+        if (tcp_syn_data_acked(fd)) {
+            server.stats.fastopen++;
+        }
+        client.input.pop(sent);
+    }
+    if (!client.on_connected(fd, addr)) {
+        return;     // client is released
+    }
+    if (server.stream_cb != NULL) {
+        // the session continues on another loop
+        server.handoff_stream(client);
+    }
+}
+
+static void server_resolved_cb(void *userdata, uint64_t token, const ResolveResult &res) {
+    (void)userdata;
+    // closed sessions cancel their lookups, see on_client_done()
+    ClientConn &client = *(ClientConn *)(uintptr_t)token;
+    assert(client.state == ClientConn::RESOLVING);
+
+    CTXLOG_PUSH_FUNC().set("client", client.addr_str);
+    client.on_resolved(res);
 }
 
-static Error create_udp_peer(UDPPeer *&peer) {
+Error Server::create_udp_peer(UDPPeer *&peer) {
     int listenfd = -1;
     Error err = udp_listen(listenfd, "", 0, SOMAXCONN);
     if (!err.ok()) {
@@ -400,7 +1008,7 @@ static Error create_udp_peer(UDPPeer *&peer) {
         return err;
     }
 
-    UDPPeer &p = *new UDPPeer();
+    UDPPeer &p = *this->udp_pool.alloc();
     p.fd = listenfd;
     p.addr = local_addr;
     peer = &p;
@@ -413,14 +1021,14 @@ void ClientConn::cmd_udp(const Addr &client_from) {
 
     Server &server = *this->server;
 
-    Error err = create_udp_peer(this->udp_client);
+    Error err = server.create_udp_peer(this->udp_client);
     if (!err.ok()) {
         CTXLOG_ERR("%s", err.str().c_str());
         this->reply(REPLY_ERR, Addr());
         return;
     }
 
-    err = create_udp_peer(this->udp_remote);
+    err = server.create_udp_peer(this->udp_remote);
     if (!err.ok()) {
         CTXLOG_ERR("%s", err.str().c_str());
         this->reply(REPLY_ERR, Addr());
@@ -461,12 +1069,17 @@ Error ClientConn::reply(uint8_t code, const Addr &addr) {
     buf[4 + ip_size + 0] = (char)(addr.port() >> 8);
     buf[4 + ip_size + 1] = (char)(addr.port() & 0xff);
     size_t reply_len = 4 + ip_size + 2;
-    return this->iochan.write(buf, reply_len);
+    Error err = this->iochan.write(buf, reply_len);
+    if (!err.ok()) {
+        return err;
+    }
+    // ends the handshake, along with the replies gathered before
+    return this->iochan.uncork();
 }
 
 void Server::update_client_timeout(ClientConn &client) {
     assert(client.state == ClientConn::STREAM);
-    if (!client.iochan.buf.empty()) {
+    if (!client.iochan.empty()) {
         this->client_timeouts.touch(ev_now(this->loop), client);
     } else {
         this->client_timeouts.remove(client);
@@ -475,7 +1088,7 @@ void Server::update_client_timeout(ClientConn &client) {
 
 // XXX: identical to update_client_timeout
 void Server::update_remote_timeout(RemoteConn &remote) {
-    if (!remote.iochan.buf.empty()) {
+    if (!remote.iochan.empty()) {
         this->remote_timeouts.touch(ev_now(this->loop), remote);
     } else {
         this->remote_timeouts.remove(remote);
@@ -489,6 +1102,15 @@ void Server::update_idle_timeout(ClientConn &client) {
 static void on_client_timeout_cb(ClientConn &client) {
     CTXLOG_SET("client", client.addr_str).set("remote", client.remote ? client.remote->addr_str : "nil");
     CTXLOG_DBG("client timeout. [ts:%f][now:%f]", client.timeout_tracer.last_activity, ev_now(client.server->loop));
+    if (client.state == ClientConn::AUTH && client.auth_pending) {
+        client.server->stats.auth_timeouts++;
+        return client.server->on_client_error(client, Error(ERR_TIMEOUT, 0, "auth timeout"));
+    }
+    if (client.state == ClientConn::CONNECTING) {
+        client.server->stats.connect_timeouts++;
+        client.reply(REPLY_TTL_EXPIRED, Addr());
+        return client.server->on_client_error(client, Error(ERR_TIMEOUT, 0, "connect timeout"));
+    }
     client.server->on_client_error(client, Error(ERR_TIMEOUT, 0, "client io timeout"));
 }
 
@@ -505,6 +1127,9 @@ static void on_idle_timeout_cb(ClientConn &client) {
 }
 
 void Server::on_timer() {
+    // paused without a spare fd and no session of ours closed since
+    this->check_resume_accept();
+
     ev_tstamp now = ev_now(this->loop);
     ev_tstamp next_check = std::min(std::min(
         this->client_timeouts.each_timeouts(now, on_client_timeout_cb),
@@ -515,6 +1140,14 @@ void Server::on_timer() {
     ev_timer_start(this->loop, &this->timer);
 }
 
+void Server::check_timer_before(ev_tstamp after) {
+    if (ev_timer_remaining(this->loop, &this->timer) > after) {
+        ev_timer_stop(this->loop, &this->timer);
+        ev_timer_set(&this->timer, after, 0);
+        ev_timer_start(this->loop, &this->timer);
+    }
+}
+
 static void client_send_cb(EV_P_ ev_io *io, int revents) {
     if (!(revents & EV_WRITE)) {
         return;
@@ -543,10 +1176,25 @@ static void remote_recv_cb(EV_P_ ev_io *io, int revents) {
         .set("client", client.addr_str)
         .set("remote", remote.addr_str);
 
+    if (client.iochan.is_splice()) {
+        bool eof = false;
+        Error err = client.iochan.splice_from(remote.fd, eof);
+        if (!err.ok()) {
+            return server.on_client_error(client, err);
+        }
+        if (eof) {
+            return server.on_remote_eof(client);
+        }
+        server.update_client_timeout(client);
+        server.update_idle_timeout(client);
+        return;
+    }
+
     char buf[k_read_buf_size];
     ssize_t n = ::read(remote.fd, buf, sizeof(buf));
+    server.stats.io.syscalls++;
     if (n < 0) {
-        if (is_again(errno)) {
+        if (net_is_again(errno)) {
             CTXLOG_WARN("unexpected EAGAIN!");
             return;
         }
@@ -584,9 +1232,64 @@ static void remote_send_cb(EV_P_ ev_io *io, int revents) {
     remote.client->server->update_remote_timeout(remote);
 }
 
+// io_uring mode: completions of one socket of the session, iochan sends to it and
+// its recvs feed peer. The client socket has client.iochan, the remote one remote.iochan.
+static void on_uring_completion(ClientConn &client, IOChannel &iochan, IOChannel &peer,
+                                int op, int res, const char *data) {
+    Server &server = *client.server;
+    bool is_client = &iochan == &client.iochan;
+
+    if (op == Uring::OP_SEND) {
+        Error err = iochan.on_sent(res);
+        if (!err.ok()) {
+            return server.on_client_error(client, err);
+        }
+        if (is_client) {
+            server.update_client_timeout(client);
+        } else {
+            server.update_remote_timeout(*client.remote);
+        }
+        return;
+    }
+
+    if (res < 0) {
+        return server.on_client_error(client, Error(ERR_READ, -res, "on_uring_completion() recv error"));
+    } else if (res == 0) {
+        if (is_client) {
+            return server.on_client_eof(client);
+        }
+        return server.on_remote_eof(client);
+    }
+    Error err = peer.write(data, (size_t)res);
+    if (!err.ok()) {
+        return server.on_client_error(client, err);
+    }
+    if (is_client) {
+        server.update_remote_timeout(*client.remote);
+    } else {
+        server.update_client_timeout(client);
+    }
+    server.update_idle_timeout(client);
+}
+
+static void client_uring_cb(void *userdata, int op, int res, const char *data) {
+    ClientConn &client = *(ClientConn *)userdata;
+    CTXLOG_PUSH_FUNC().set("client", client.addr_str);
+    on_uring_completion(client, client.iochan, client.remote->iochan, op, res, data);
+}
+
+static void remote_uring_cb(void *userdata, int op, int res, const char *data) {
+    RemoteConn &remote = *(RemoteConn *)userdata;
+    CTXLOG_PUSH_FUNC()
+        .set("client", remote.client->addr_str)
+        .set("remote", remote.addr_str);
+    on_uring_completion(*remote.client, remote.iochan, remote.client->iochan, op, res, data);
+}
+
 static Error parse_udp_packet(
     const char *buf, size_t size,
-    uint8_t &atype, string &socksaddr, uint16_t &port, const char *&data, size_t &datalen)
+    uint8_t &atype, const char *&socksaddr, size_t &socksaddr_len, uint16_t &port,
+    const char *&data, size_t &datalen)
 {
     if (size < 4 + 2 + 2) {
         return Error(ERR_BAD_PACKET, 0, "udp packet too short");
@@ -602,27 +1305,30 @@ static Error parse_udp_packet(
         if (buf + 4 + 2 > end) {
             return Error(ERR_BAD_PACKET, 0, "DST.ADDR or DST.PORT too short");
         }
-        socksaddr.append(buf, 4);
+        socksaddr = buf;
+        socksaddr_len = 4;
         buf += 4;
     } else if (atype == ATYPE_IPV6) {
         if (buf + 16 + 2 > end) {
             return Error(ERR_BAD_PACKET, 0, "DST.ADDR or DST.PORT too short");
         }
-        socksaddr.append(buf, 16);
+        socksaddr = buf;
+        socksaddr_len = 16;
         buf += 16;
     } else if (atype == ATYPE_DOMAIN) {
         uint8_t domain_len = (uint8_t)buf[0];
         if (buf + 1 + domain_len + 2 > end) {
             return Error(ERR_BAD_PACKET, 0, "DST.ADDR or DST.PORT too short");
         }
-        socksaddr.append(buf + 1, domain_len);
+        socksaddr = buf + 1;
+        socksaddr_len = domain_len;
         buf += 1 + domain_len;
     } else {
         return Error(ERR_BAD_ATYPE, 0, "bad atype");
     }
 
     assert(buf + 2 <= end);
-    port = (uint16_t)buf[0] << 8 | (uint16_t)(buf[1]);
+    port = (uint16_t)((uint8_t)buf[0] << 8 | (uint8_t)buf[1]);
     buf += 2;
     data = buf;
     datalen = end - buf;
@@ -649,7 +1355,7 @@ static void udp_client_recv_cb(EV_P_ ev_io *io, int revents) {
     Addr addr;
     Error err = net_recvfrom(udp_client.fd, buf, sizeof(buf), datalen, MSG_DONTWAIT, addr);
     if (!err.ok()) {
-        if (!is_again(err.code())) {
+        if (!net_is_again(err.code())) {
             CTXLOG_ERR("%s", err.str().c_str());
         }
         return;
@@ -674,11 +1380,12 @@ static void udp_client_recv_cb(EV_P_ ev_io *io, int revents) {
 
     // parse packet
     uint8_t atype = 0;
-    string socksaddr;
+    const char *socksaddr = NULL;   // in buf
+    size_t socksaddr_len = 0;
     uint16_t port = 0;
     const char *payload = NULL;
     size_t payload_len = 0;
-    err = parse_udp_packet(buf, datalen, atype, socksaddr, port, payload, payload_len);
+    err = parse_udp_packet(buf, datalen, atype, socksaddr, socksaddr_len, port, payload, payload_len);
     if (!err.ok()) {
         CTXLOG_WARN("%s", err.str().c_str());
         return;
@@ -686,11 +1393,26 @@ static void udp_client_recv_cb(EV_P_ ev_io *io, int revents) {
 
     Addr to_addr;
     if (atype == ATYPE_IPV4) {
-        to_addr = Addr::from_ipv4(socksaddr.data(), port);
+        to_addr = Addr::from_ipv4(socksaddr, port);
     } else if (atype == ATYPE_IPV6) {
-        to_addr = Addr::from_ipv6(socksaddr.data(), port);
+        to_addr = Addr::from_ipv6(socksaddr, port);
+    } else if (client.server->resolver != NULL) {
+        // datagrams are not queued, a miss drops this one and warms the cache
+        string domain(socksaddr, socksaddr_len);
+        ResolveResult res;
+        if (!client.server->resolver->lookup(domain, res) || res.err != 0 || res.addrs.empty()) {
+            CTXLOG_DBG("[domain:%s] not resolved yet, drop packet", domain.c_str());
+            return;
+        }
+        to_addr = res.addrs[0];
+        for (size_t i = 0; i < res.addrs.size(); ++i) {
+            if (res.addrs[i].family() == udp_remote.addr.family()) {
+                to_addr = res.addrs[i];
+                break;
+            }
+        }
+        to_addr.port(port);
     } else {
-        // TODO: domain
         return;
     }
 
@@ -698,7 +1420,7 @@ static void udp_client_recv_cb(EV_P_ ev_io *io, int revents) {
     size_t sent = 0;
     err = net_sendto(udp_remote.fd, payload, payload_len, sent, MSG_DONTWAIT, to_addr);
     if (!err.ok()) {
-        if (is_again(err.code())) {
+        if (net_is_again(err.code())) {
             CTXLOG_WARN("send to remote got EAGAIN, drop packet");
         } else {
             CTXLOG_ERR("send to remote error: %s", err.str().c_str());
@@ -746,7 +1468,7 @@ static void udp_remote_recv_cb(EV_P_ ev_io *io, int revents) {
     Addr addr;
     Error err = net_recvfrom(udp_remote.fd, buf, sizeof(buf), datalen, MSG_DONTWAIT, addr);
     if (!err.ok()) {
-        if (!is_again(err.code())) {
+        if (!net_is_again(err.code())) {
             CTXLOG_ERR("%s", err.str().c_str());
         }
         return;
@@ -766,7 +1488,7 @@ static void udp_remote_recv_cb(EV_P_ ev_io *io, int revents) {
     size_t sent = 0;
     err = net_sendto(udp_remote.fd, packet.data(), packet.size(), sent, MSG_DONTWAIT, client.udp_client_from);
     if (!err.ok()) {
-        if (is_again(err.code())) {
+        if (net_is_again(err.code())) {
             CTXLOG_WARN("send to client got EAGAIN, drop packet");
         } else {
             CTXLOG_ERR("send to client error: %s", err.str().c_str());
@@ -785,22 +1507,152 @@ void Server::on_connection(int fd, const Addr &addr) {
     CTXLOG_PUSH_FUNC().set("client", addr.str());
     CTXLOG_INFO("got client [fd:%d]", fd);
 
-    ClientConn &client = *new ClientConn();
+    if (this->max_sessions > 0 && this->n_clients.load(boost::memory_order_relaxed) >= this->max_sessions) {
+        // handed off by an acceptor, which does not know our limit
+        CTXLOG_WARN("too many sessions, closing. [max_sessions:%zu]", this->max_sessions);
+        close_fd(fd);
+        this->stats.accept_shed++;
+        return;
+    }
+
+    bool ip_limited = false;
+    if (this->ip_limits != NULL) {
+        IpLimiter::Result res = this->ip_limits->acquire(addr);
+        if (res == IpLimiter::TOO_MANY_SESSIONS) {
+            CTXLOG_INFO("too many sessions from this ip, closing. [max_sessions:%u]", this->ip_limits->max_sessions);
+            close_fd(fd);
+            this->stats.ip_session_rejects++;
+            return;
+        }
+        if (res == IpLimiter::TOO_FAST) {
+            CTXLOG_INFO("too many new sessions from this ip, closing. [rate:%g]", this->ip_limits->rate);
+            close_fd(fd);
+            this->stats.ip_rate_rejects++;
+            return;
+        }
+        if (res == IpLimiter::TABLE_FULL) {
+            CTXLOG_WARN("too many source ips tracked, closing. [capacity:%zu]", this->ip_limits->capacity);
+            close_fd(fd);
+            this->stats.ip_table_rejects++;
+            return;
+        }
+        ip_limited = true;
+    }
+
+    ClientConn &client = *this->client_pool.alloc();
     this->client_timeouts.touch(ev_now(this->loop), client);
+    this->stats.accepted++;
+    this->n_clients.store(this->n_clients.load(boost::memory_order_relaxed) + 1, boost::memory_order_relaxed);
 
     client.fd = fd;
     client.addr = addr;
-    client.addr_str = client.addr.str();
+    client.addr.str(client.addr_str, sizeof(client.addr_str));
     client.server = this;
     client.state = ClientConn::INIT;
+    client.ip_limited = ip_limited;
 
-    client.iochan.init(this->loop, k_write_buf_max_size);
+    client.iochan.init(this->loop, k_write_buf_max_size, &this->stats.io, this->budget);
     client.iochan.consumer = &client.writer_io;
     client.iochan.producer = &client.reader_io;
 
     ev_io_init(&client.reader_io, client_recv_cb, fd, EV_READ);
     ev_io_init(&client.writer_io, client_send_cb, fd, EV_WRITE);
+    ev_set_priority(&client.reader_io, -1);
+    ev_io_start(this->loop, &client.reader_io);
+
+    if (this->max_sessions > 0 && this->n_clients.load(boost::memory_order_relaxed) >= this->max_sessions) {
+        this->pause_accept();
+    }
+
+    // the greeting is likely there already, skip a loop iteration
+    if (this->listen_opt.defer_accept > 0 || this->listen_opt.fastopen_qlen > 0) {
+        on_client_readable(client, true);
+    }
+}
+
+void Server::handoff_stream(ClientConn &client) {
+    assert(client.state == ClientConn::STREAM);
+    assert(client.remote != NULL);
+    assert(!client.iochan.is_splice() && !client.remote->iochan.is_splice());
+    CTXLOG_INFO("handing off stream");
+
+    RemoteConn &remote = *client.remote;
+    StreamHandoff *handoff = new StreamHandoff();
+    handoff->client_fd = client.fd;
+    handoff->client_addr = client.addr;
+    handoff->remote_fd = remote.fd;
+    handoff->remote_addr = remote.addr;
+    handoff->to_client.swap(client.iochan.buf);
+    handoff->to_remote.swap(remote.iochan.buf);
+    if (client.ip_limited) {
+        handoff->ip_limits = this->ip_limits;   // still counted
+    }
+
+    // release without closing fds
+    ev_io_stop(this->loop, &client.reader_io);
+    ev_io_stop(this->loop, &client.writer_io);
+    ev_io_stop(this->loop, &remote.reader_io);
+    ev_io_stop(this->loop, &remote.writer_io);
+    this->remote_timeouts.remove(remote);
+    this->client_timeouts.remove(client);
+    this->idle_timeouts.remove(client);
+    this->remote_pool.release(&remote);
+    this->client_pool.release(&client);
+    this->n_clients.store(this->n_clients.load(boost::memory_order_relaxed) - 1, boost::memory_order_relaxed);
+    this->check_resume_accept();
+
+    this->stream_cb(this->stream_userdata, handoff);
+
+    // invoke termination callback
+    check_term_cb(this);
+}
+
+void Server::adopt_stream(StreamHandoff &handoff) {
+    CTXLOG_PUSH_FUNC().set("client", handoff.client_addr.str()).set("remote", handoff.remote_addr.str());
+    CTXLOG_INFO("adopting stream [client_fd:%d][remote_fd:%d]", handoff.client_fd, handoff.remote_fd);
+
+    ClientConn &client = *this->client_pool.alloc();
+    this->n_clients.store(this->n_clients.load(boost::memory_order_relaxed) + 1, boost::memory_order_relaxed);
+
+    client.fd = handoff.client_fd;
+    client.addr = handoff.client_addr;
+    client.addr.str(client.addr_str, sizeof(client.addr_str));
+    client.server = this;
+    client.state = ClientConn::STREAM;
+    // all servers share the limiter
+    assert(handoff.ip_limits == NULL || handoff.ip_limits == this->ip_limits);
+    client.ip_limited = handoff.ip_limits != NULL;
+
+    client.iochan.init(this->loop, k_write_buf_max_size, &this->stats.io, this->budget);
+    client.iochan.consumer = &client.writer_io;
+    client.iochan.buf.swap(handoff.to_client);
+    client.iochan.charge();
+
+    ev_io_init(&client.reader_io, client_recv_cb, client.fd, EV_READ);
+    ev_io_init(&client.writer_io, client_send_cb, client.fd, EV_WRITE);
     ev_io_start(this->loop, &client.reader_io);
+
+    RemoteConn &remote = attach_remote(client, handoff.remote_fd, handoff.remote_addr);
+    remote.iochan.buf.swap(handoff.to_remote);
+    remote.iochan.charge();
+    handoff.client_fd = handoff.remote_fd = -1;     // transferred
+    handoff.ip_limits = NULL;
+
+    if (!client.iochan.buf.empty()) {
+        ev_io_start(this->loop, &client.writer_io);
+    }
+    if (!remote.iochan.buf.empty()) {
+        ev_io_start(this->loop, &remote.writer_io);
+    }
+    if (this->uring.active()) {
+        this->setup_uring(client);
+    } else if (this->splice) {
+        this->setup_splice(client);
+    }
+
+    this->update_client_timeout(client);
+    this->update_remote_timeout(remote);
+    this->update_idle_timeout(client);
 }
 
 void Server::on_client_eof(ClientConn &client) {
@@ -840,7 +1692,7 @@ void Server::on_remote_eof(ClientConn &client) {
 void Server::on_udp_peer_done(UDPPeer &peer) {
     ev_io_stop(this->loop, &peer.reader_io);
     close_fd(peer.fd);
-    delete &peer;
+    this->udp_pool.release(&peer);
 }
 
 static void check_term_cb(Server *s) {
@@ -854,6 +1706,14 @@ static void check_term_cb(Server *s) {
 
         // stop timer
         ev_timer_stop(s->loop, &s->timer);
+        ev_timer_stop(s->loop, &s->stats_timer);
+        if (ev_is_active(&s->lag_prepare)) {
+            ev_ref(s->loop);
+            ev_prepare_stop(s->loop, &s->lag_prepare);
+            ev_ref(s->loop);
+            ev_check_stop(s->loop, &s->lag_check);
+        }
+        s->resolver_port.stop();
     }
 }
 
@@ -862,11 +1722,25 @@ void Server::on_client_done(ClientConn &client) {
 
     ev_io_stop(this->loop, &client.reader_io);
     ev_io_stop(this->loop, &client.writer_io);
-    close_fd(client.fd);
+    if (client.file != NULL) {
+        // sends in flight keep their data
+        this->uring.close(client.file, &client.iochan.buf);
+        client.file = NULL;
+    } else {
+        close_fd(client.fd);
+    }
+    this->release_pipe(client.iochan);
 
     if (client.state == ClientConn::AUTH) {
         client.server->handler->auth_end(client);
     }
+    if (client.state == ClientConn::RESOLVING) {
+        this->resolver->cancel(this->resolver_port, (uintptr_t)&client);
+    }
+    if (client.state == ClientConn::CONNECTING) {
+        delete client.race;     // closes attempts
+        client.race = NULL;
+    }
 
     // connect cmd
     if (client.remote != NULL) {
@@ -882,7 +1756,12 @@ void Server::on_client_done(ClientConn &client) {
 
     this->client_timeouts.remove(client);
     this->idle_timeouts.remove(client);
-    delete &client;
+    if (client.ip_limited) {
+        this->ip_limits->release(client.addr);
+    }
+    this->client_pool.release(&client);
+    this->n_clients.store(this->n_clients.load(boost::memory_order_relaxed) - 1, boost::memory_order_relaxed);
+    this->check_resume_accept();
 
     // invoke termination callback
     check_term_cb(this);
@@ -891,9 +1770,93 @@ void Server::on_client_done(ClientConn &client) {
 void Server::on_remote_done(RemoteConn &remote) {
     ev_io_stop(this->loop, &remote.reader_io);
     ev_io_stop(this->loop, &remote.writer_io);
-    close_fd(remote.fd);
+    if (remote.file != NULL) {
+        this->uring.close(remote.file, &remote.iochan.buf);
+        remote.file = NULL;
+    } else {
+        close_fd(remote.fd);
+    }
+    this->release_pipe(remote.iochan);
     this->remote_timeouts.remove(remote);
-    delete &remote;
+    this->remote_pool.release(&remote);
+}
+
+void Server::setup_splice(ClientConn &client) {
+    assert(client.state == ClientConn::STREAM);
+    assert(client.remote != NULL);
+
+    Pipe to_client, to_remote;
+    Error err = this->pipes.acquire(to_client);
+    if (err.ok()) {
+        err = this->pipes.acquire(to_remote);
+        if (!err.ok()) {
+            this->pipes.release(to_client, true);
+        }
+    }
+    if (!err.ok()) {
+        CTXLOG_WARN("fallback to copying. %s", err.str().c_str());
+        return;
+    }
+
+    client.iochan.set_pipe(to_client);
+    client.remote->iochan.set_pipe(to_remote);
+}
+
+// hand both sockets of a STREAM session from the watchers to the ring
+void Server::setup_uring(ClientConn &client) {
+    assert(client.state == ClientConn::STREAM);
+    assert(client.remote != NULL);
+
+    RemoteConn &remote = *client.remote;
+    ev_io_stop(this->loop, &client.reader_io);
+    ev_io_stop(this->loop, &client.writer_io);
+    ev_io_stop(this->loop, &remote.reader_io);
+    ev_io_stop(this->loop, &remote.writer_io);
+
+    client.file = this->uring.open(client.fd, client_uring_cb, &client);
+    remote.file = this->uring.open(remote.fd, remote_uring_cb, &remote);
+    client.iochan.set_uring(&this->uring, remote.file, client.file);
+    remote.iochan.set_uring(&this->uring, client.file, remote.file);
+    if (!remote.iochan.is_full()) {
+        this->uring.start_recv(*client.file);
+    }
+    if (!client.iochan.is_full()) {
+        this->uring.start_recv(*remote.file);
+    }
+}
+
+void Server::release_pipe(IOChannel &iochan) {
+    if (iochan.is_splice()) {
+        this->pipes.release(iochan.pipe, iochan.pipe_bytes == 0);
+        iochan.pipe = Pipe();
+        iochan.pipe_bytes = 0;
+        iochan.pipe_full = false;
+    }
+}
+
+void Server::on_auth_result(ClientConn &client, uint32_t state) {
+    assert(client.state == ClientConn::AUTH && client.auth_pending);
+    client.auth_pending = false;
+    this->handler->auth_result(client, state);
+    // back to the handshake timeout
+    this->client_timeouts.touch(ev_now(this->loop), client);
+
+    switch (state) {
+    case IServerHandler::AUTH_STATE_DONE:
+        this->handler->auth_end(client);
+        client.state = ClientConn::CMD;
+        break;
+    case IServerHandler::AUTH_STATE_FAIL:
+    case IServerHandler::AUTH_STATE_ERROR:
+        // auth_end() will be called
+        return this->on_client_error(client, Error(ERR_AUTH, 0, "auth failure"));
+    default:
+        break;  // more data
+    }
+
+    // with data pipelined after the auth request
+    ev_io_start(this->loop, &client.reader_io);
+    on_client_input(client, NULL, 0);
 }
 
 void Server::on_client_error(ClientConn &client, Error err) {
@@ -902,7 +1865,66 @@ void Server::on_client_error(ClientConn &client, Error err) {
 }
 
 size_t Server::clients() const {
-    assert(this->client_timeouts.size >= this->remote_timeouts.size);
-    assert(this->client_timeouts.size >= this->idle_timeouts.size);
-    return this->client_timeouts.size;
+    size_t n = this->n_clients.load(boost::memory_order_relaxed);
+    assert(n >= this->client_timeouts.size);
+    assert(n >= this->idle_timeouts.size);
+    return n;
+}
+
+void Server::prealloc(size_t sessions) {
+    this->client_pool.prealloc(sessions);
+    this->remote_pool.prealloc(sessions);
+    // client and remote side of udp associate
+    this->udp_pool.prealloc(sessions * 2);
+}
+
+void Server::log_stats() const {
+    const IOStats &io = this->stats.io;
+    uint32_t queue_len = 0;
+    uint32_t queue_max = 0;
+    if (this->listen_fd >= 0) {
+        tcp_accept_queue(this->listen_fd, queue_len, queue_max);
+    }
+    uint64_t overflows = 0;
+    if (net_listen_overflows(overflows).ok()) {
+        overflows -= std::min(overflows, this->stats.listen_overflows_base);
+    }
+    double mb = io.relayed / (1024.0 * 1024.0);
+    CTXLOG_INFO("stats: [clients:%zu][accepted:%llu][pipes_used:%zu][pipes_idle:%zu]"
+        "[chunks_idle:%zu][backend:%s%s][polls:%u][syscalls:%llu][relayed:%llu][syscalls_per_mb:%.1f]"
+        "[mem:%zu][mem_high:%zu][pool_client:%zu/%zu][pool_remote:%zu/%zu][pool_udp:%zu/%zu]"
+        "[connects:%llu][connect_errors:%llu][connect_timeouts:%llu][connect_ms:%.1f]"
+        "[fastopen:%llu/%llu][early_reads:%llu]"
+        "[accept_queue:%u/%u][accept_aborted:%llu][accept_budget_hits:%llu][listen_overflows:%llu]"
+        "[accept_paused:%d][accept_pauses:%llu][accept_shed:%llu]"
+        "[loop_lag_ms:%.2f][overloaded:%d][overloads:%llu][overload_rejects:%llu]"
+        "[ip_entries:%zu][ip_table_rejects:%llu][ip_session_rejects:%llu][ip_rate_rejects:%llu]"
+        "[auth_pending:%llu][auth_timeouts:%llu][auth_cache_hits:%llu][auth_cache_misses:%llu]",
+        this->clients(), (unsigned long long)this->stats.accepted,
+        this->pipes.used, this->pipes.idle.size(),
+        ChunkPool::idle(),
+        ev_backend_name(ev_backend(this->loop)), this->uring.active() ? "+io_uring" : "", ev_iteration(this->loop),
+        (unsigned long long)io.syscalls, (unsigned long long)io.relayed,
+        mb > 0 ? io.syscalls / mb : 0.0,
+        this->budget ? this->budget->used.load(boost::memory_order_relaxed) : (size_t)0,
+        this->budget ? this->budget->high.load(boost::memory_order_relaxed) : (size_t)0,
+        this->client_pool.size(), this->client_pool.capacity(),
+        this->remote_pool.size(), this->remote_pool.capacity(),
+        this->udp_pool.size(), this->udp_pool.capacity(),
+        (unsigned long long)this->stats.connects, (unsigned long long)this->stats.connect_errors,
+        (unsigned long long)this->stats.connect_timeouts,
+        this->stats.connects ? this->stats.connect_latency * 1000 / this->stats.connects : 0.0,
+        (unsigned long long)this->stats.fastopen, (unsigned long long)this->stats.fastopen_sent,
+        (unsigned long long)this->stats.early_reads,
+        queue_len, queue_max, (unsigned long long)this->stats.accept_aborted,
+        (unsigned long long)this->stats.accept_budget_hits, (unsigned long long)overflows,
+        (int)this->accept_paused, (unsigned long long)this->stats.accept_pauses,
+        (unsigned long long)this->stats.accept_shed,
+        this->loop_lag * 1000, (int)this->overloaded,
+        (unsigned long long)this->stats.overloads, (unsigned long long)this->stats.overload_rejects,
+        this->ip_limits ? this->ip_limits->tracked() : (size_t)0, (unsigned long long)this->stats.ip_table_rejects,
+        (unsigned long long)this->stats.ip_session_rejects, (unsigned long long)this->stats.ip_rate_rejects,
+        (unsigned long long)this->stats.auth_pending, (unsigned long long)this->stats.auth_timeouts,
+        this->auth_cache ? (unsigned long long)this->auth_cache->hits.load(boost::memory_order_relaxed) : 0ull,
+        this->auth_cache ? (unsigned long long)this->auth_cache->misses.load(boost::memory_order_relaxed) : 0ull);
 }
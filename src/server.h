@@ -6,14 +6,24 @@
 #include <memory>
 
 #include <ev.h>
+#include <boost/atomic.hpp>
 
 #include "socksdef.h"
 #include "auth.h"
+#include "authcache.h"
 #include "iochannel.h"
 #include "bufqueue.h"
+#include "chunkqueue.h"
+#include "pipepool.h"
 #include "addr.h"
+#include "net.h"
+#include "resolver.h"
+#include "eyeballs.h"
+#include "iplimit.h"
+#include "uring.h"
 #include "dlist.hpp"
-#include "timeout_list.hpp"
+#include "objpool.hpp"
+#include "timing_wheel.hpp"
 #include "error.h"
 
 
@@ -30,6 +40,8 @@ namespace evsocks {
             INIT = 0,   // receiving methods
             AUTH,       // doing auth
             CMD,        // receiving cmd
+            RESOLVING,  // waiting for the domain name of the connect cmd
+            CONNECTING, // racing connects to the addresses of the domain name
             STREAM,     // connect cmd got
             UDP,        // udp association cmd got
         };
@@ -37,10 +49,11 @@ namespace evsocks {
         ev_io reader_io;
         ev_io writer_io;
         IOChannel iochan;
+        UringFile *file;        // replaces the watchers in STREAM state with Server::io_uring
 
         int fd;
         Addr addr;
-        string addr_str;    // for logging
+        char addr_str[Addr::k_str_size];    // for logging
 
         Server *server;
         RemoteConn *remote;
@@ -52,16 +65,33 @@ namespace evsocks {
         TimeoutTracer idle_timeout_tracer;
 
         uint8_t state;
+        uint8_t auth_method;    // chosen by IServerHandler::auth_begin()
         void *auth_ctx;
         BufQueue input;
 
+        string resolve_domain;  // of the connect cmd with a domain name
+        uint16_t resolve_port;
+        ConnectRace *race;      // CONNECTING state only, also for a single address
+        bool ip_limited;        // counted by Server::ip_limits
+        bool auth_pending;      // AUTH state, waiting for Server::on_auth_result()
+
         ClientConn()
-            : fd(-1), server(NULL), remote(NULL), udp_client(NULL), udp_remote(NULL)
-            , state(INIT), auth_ctx(NULL)
-        {}
+            : file(NULL), fd(-1), server(NULL), remote(NULL), udp_client(NULL), udp_remote(NULL)
+            , state(INIT), auth_method(METHOD_REJECT), auth_ctx(NULL), resolve_port(0), race(NULL), ip_limited(false)
+            , auth_pending(false)
+        {
+            addr_str[0] = '\0';
+        }
 
         Error reply(uint8_t code, const Addr &addr);
         void cmd_connect(const Addr &remote_addr);
+        void cmd_connect_domain(const string &domain, uint16_t port);
+        void on_resolved(const ResolveResult &res);
+        // wait for the first of addrs to connect in CONNECTING state, then reply
+        void connect_to(const string &domain, const vector<Addr> &addrs, uint16_t port);
+        // reply and relay through connfd. Returns false if the reply failed,
+        // connfd is closed and the session is gone then.
+        bool on_connected(int connfd, const Addr &remote_addr);
         void cmd_udp(const Addr &client_from);
     };
 
@@ -69,16 +99,19 @@ namespace evsocks {
         ev_io reader_io;
         ev_io writer_io;
         IOChannel iochan;
+        UringFile *file;        // see ClientConn::file
 
         int fd;
         Addr addr;
-        string addr_str;    // for logging
+        char addr_str[Addr::k_str_size];    // for logging
 
         ClientConn *client;
 
         TimeoutTracer timeout_tracer;
 
-        RemoteConn() : fd(-1), client(NULL) {}
+        RemoteConn() : file(NULL), fd(-1), client(NULL) {
+            addr_str[0] = '\0';
+        }
     };
 
     struct UDPPeer {
@@ -92,6 +125,58 @@ namespace evsocks {
         UDPPeer() : fd(-1), client(NULL) {}
     };
 
+    // a STREAM session moved from one loop to another
+    struct StreamHandoff {
+        int client_fd;
+        Addr client_addr;
+        int remote_fd;
+        Addr remote_addr;
+        ChunkQueue to_client;   // not yet written to client, e.g. the cmd reply
+        ChunkQueue to_remote;   // data received after the cmd
+        IpLimiter *ip_limits;   // holds a session of client_addr if set, released by the adopter
+
+        StreamHandoff() : client_fd(-1), remote_fd(-1), ip_limits(NULL) {}
+    };
+
+    // counters, owned by the loop thread
+    struct ServerStats {
+        uint64_t accepted;
+        IOStats io;
+        // outbound connects of connect cmds, including failures
+        uint64_t connects;
+        uint64_t connect_errors;
+        uint64_t connect_timeouts;
+        ev_tstamp connect_latency;  // sum, from the first attempt to the reply
+        uint64_t fastopen_sent;     // connects with data in the SYN
+        uint64_t fastopen;          // of which the SYN data was acked
+        uint64_t early_reads;       // greetings read right after accept, see TcpListenOpt
+        uint64_t accept_aborted;    // ECONNABORTED or EINTR from accept()
+        uint64_t accept_budget_hits;    // wakeups that stopped accepting at accept_budget
+        uint64_t listen_overflows_base; // host wide counter at start_listen()
+        uint64_t accept_pauses;     // listener stopped at max_sessions or out of fds
+        uint64_t accept_shed;       // connections closed right after accept, out of fds or over max_sessions
+        uint64_t overloads;         // times loop lag went over overload_lag
+        uint64_t overload_rejects;  // greetings answered with METHOD_REJECT while overloaded
+        uint64_t ip_session_rejects;    // closed at accept, over ip_limits.max_sessions
+        uint64_t ip_rate_rejects;       // closed at accept, over ip_limits.rate
+        uint64_t ip_table_rejects;      // closed at accept, ip_limits full
+        uint64_t auth_pending;      // auths decided asynchronously by the handler
+        uint64_t auth_timeouts;     // of which timed out
+
+        ServerStats()
+            : accepted(0), connects(0), connect_errors(0), connect_timeouts(0), connect_latency(0)
+            , fastopen_sent(0), fastopen(0), early_reads(0)
+            , accept_aborted(0), accept_budget_hits(0), listen_overflows_base(0)
+            , accept_pauses(0), accept_shed(0), overloads(0), overload_rejects(0)
+            , ip_session_rejects(0), ip_rate_rejects(0), ip_table_rejects(0), auth_pending(0), auth_timeouts(0)
+        {}
+    };
+
+    // libev backend names: select, poll, epoll, linuxaio, iouring
+    const char *ev_backend_name(unsigned int backend);
+    // "auto" gives EVFLAG_AUTO
+    bool ev_backend_parse(const string &name, unsigned int &flags);
+
     // TODO: config timeout
     struct Server {
         // public
@@ -100,24 +185,107 @@ namespace evsocks {
         bool term_req;
         TermCb term_cb;
         void *term_userdata;
+        // if set, accepted connections are passed to accept_cb instead of on_connection()
+        typedef void (*AcceptCb)(void *userdata, int fd, const Addr &addr);
+        AcceptCb accept_cb;
+        void *accept_userdata;
+        // if set, sessions entering STREAM state are detached and passed to stream_cb,
+        // which takes ownership of the handoff. See adopt_stream().
+        typedef void (*StreamCb)(void *userdata, StreamHandoff *handoff);
+        StreamCb stream_cb;
+        void *stream_userdata;
+        // on_connection() reads the greeting right away with defer_accept or fastopen_qlen
+        TcpListenOpt listen_opt;
+        // log stats periodically if > 0
+        ev_tstamp stats_interval;
+        ServerStats stats;
+        // relay STREAM sessions with splice() through pipes instead of user space buffers.
+        // Not applied to sessions passed to stream_cb, the adopting Server decides.
+        bool splice;
+        // accept with a multishot accept and relay STREAM sessions through io_uring:
+        // multishot recvs into provided buffers, linked sends. Handshakes stay on the watchers,
+        // stream_cb applies as with splice. Falls back to the watchers if the kernel lacks it.
+        bool io_uring;
+        // shared by all servers of the process, optional
+        MemBudget *budget;
+        // for ATYPE_DOMAIN, shared by all servers of the process, optional
+        Resolver *resolver;
+        // max connections accepted per wakeup of the listener, per loop iteration with io_uring
+        size_t accept_budget;
+        // stop accepting at max_sessions, resume below 90% of it. 0 for unlimited.
+        size_t max_sessions;
+        // admission control: when the time spent in callbacks per loop iteration, averaged over time
+        // exceeds overload_lag, stop accepting and reject greetings until it falls below half of it.
+        // Sessions past the greeting are not affected. 0 for off.
+        ev_tstamp overload_lag;
+        // per source IP limits checked at accept, offending connections are closed right away.
+        // Shared by all servers of the process, a session stays counted when handed off to stream_cb.
+        // Optional.
+        IpLimiter *ip_limits;
+        // for auths the handler left pending, see IServerHandler::AUTH_STATE_PENDING
+        ev_tstamp auth_timeout;
+        // the handler or the handler it wraps, shared by all servers of the process.
+        // Optional, only read by log_stats().
+        const CachingServerHandler *auth_cache;
+        // from the connect cmd to the reply, replied with REPLY_TTL_EXPIRED on timeout
+        ev_tstamp connect_timeout;
+        // domains with several addresses are connected with Happy Eyeballs,
+        // next address is tried after connect_attempt_delay seconds
+        ev_tstamp connect_attempt_delay;
+        // shared by all servers of the process, optional
+        EyeballStats *eyeballs;
+        // send data pipelined after the connect cmd with the SYN (TCP Fast Open),
+        // falls back to a regular connect without a cookie
+        bool fastopen;
 
         // private
         struct ev_loop *loop;
 
         ev_io listen_io;
+        UringFile *listen_file; // replaces listen_io with io_uring
         int listen_fd;
+        int spare_fd;           // reserved for shedding connections under EMFILE
+        bool accept_paused;
+        ev_tstamp shed_log_ts;  // last out of fds warning
+        // io_uring: the multishot accept stopped at accept_budget or an error, re-armed
+        // before the next poll like listen_io is called again on the next iteration
+        ev_prepare accept_prepare;
+        unsigned int accept_iteration;  // ev_iteration() of accept_count
+        size_t accept_count;
+
+        ev_prepare lag_prepare;
+        ev_check lag_check;
+        ev_tstamp lag_prepare_ts;
+        ev_tstamp lag_check_ts;
+        ev_tstamp loop_lag;     // moving average over time
+        bool overloaded;
 
         ev_timer timer;
+        ev_timer stats_timer;
+
+        PipePool pipes;
+        Uring uring;            // active with io_uring
+
+        ResolverPort resolver_port;     // tokens are ClientConn pointers
 
-        typedef EVSOCKS_TIMEOUT_LIST(ClientConn, timeout_tracer) ClientTimeoutList;
+        // session objects, see prealloc()
+        tz::ObjectPool<ClientConn> client_pool;
+        tz::ObjectPool<RemoteConn> remote_pool;
+        tz::ObjectPool<UDPPeer> udp_pool;
+
+        typedef EVSOCKS_TIMING_WHEEL(ClientConn, timeout_tracer) ClientTimeoutList;
         ClientTimeoutList client_timeouts;
-        typedef EVSOCKS_TIMEOUT_LIST(RemoteConn, timeout_tracer) RemoteTimeoutList;
+        typedef EVSOCKS_TIMING_WHEEL(RemoteConn, timeout_tracer) RemoteTimeoutList;
         RemoteTimeoutList remote_timeouts;
-        typedef EVSOCKS_TIMEOUT_LIST(ClientConn, idle_timeout_tracer) IdleTimeoutList;
+        typedef EVSOCKS_TIMING_WHEEL(ClientConn, idle_timeout_tracer) IdleTimeoutList;
         IdleTimeoutList idle_timeouts;
 
+        // live sessions, written by the loop thread only, may be read from other threads
+        boost::atomic<size_t> n_clients;
+
         // public
         Server(struct ev_loop *loop, IServerHandler *handler);
+        ~Server();
 
         Error init();
         Error start_listen(const string &host, uint16_t port);
@@ -126,16 +294,37 @@ namespace evsocks {
         Error force_term();
 
         size_t clients() const;
+        void log_stats() const;
+        // reserve session objects for n sessions, of either cmd
+        void prealloc(size_t sessions);
+
+        void adopt_stream(StreamHandoff &handoff);
+        // result of an AUTH_STATE_PENDING auth: DONE, FAIL, or CONT to pass more data.
+        // Called by the handler in the loop thread, may end the session.
+        void on_auth_result(ClientConn &client, uint32_t state);
 
         // private
+        void on_accepted(int fd, const Addr &addr);
+        bool on_accept_error(const Error &err);
         void on_connection(int fd, const Addr &addr);
+        bool shed_connection();
+        void pause_accept();
+        void check_resume_accept();
+        void on_iteration(ev_tstamp idle, ev_tstamp lag);
+        void handoff_stream(ClientConn &client);
+        void setup_splice(ClientConn &client);
+        void setup_uring(ClientConn &client);
+        void release_pipe(IOChannel &iochan);
         void on_client_error(ClientConn &client, Error err);
         void on_client_done(ClientConn &client);
         void on_remote_done(RemoteConn &remote);
         void on_udp_peer_done(UDPPeer &peer);
+        Error create_udp_peer(UDPPeer *&peer);
         void on_client_eof(ClientConn &client);
         void on_remote_eof(ClientConn &client);
         void on_timer();
+        // for timeouts shorter than the one the timer was set for
+        void check_timer_before(ev_tstamp after);
         void update_client_timeout(ClientConn &client);
         void update_remote_timeout(RemoteConn &remote);
         void update_idle_timeout(ClientConn &client);
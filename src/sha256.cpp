@@ -0,0 +1,168 @@
+#include <cstring>
+#include <algorithm>
+#include <string>
+
+#include "sha256.h"
+
+
+using namespace evsocks;
+
+
+static const uint32_t k_round[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr(uint32_t x, unsigned n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+
+Sha256::Sha256() : length(0), block_size(0) {
+    static const uint32_t k_init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    ::memcpy(this->state, k_init, sizeof(this->state));
+}
+
+void Sha256::transform(const uint8_t *chunk) {
+    uint32_t w[64];
+    for (size_t i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)chunk[i * 4] << 24 | (uint32_t)chunk[i * 4 + 1] << 16
+            | (uint32_t)chunk[i * 4 + 2] << 8 | (uint32_t)chunk[i * 4 + 3];
+    }
+    for (size_t i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = this->state[0], b = this->state[1], c = this->state[2], d = this->state[3];
+    uint32_t e = this->state[4], f = this->state[5], g = this->state[6], h = this->state[7];
+    for (size_t i = 0; i < 64; ++i) {
+        uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + k_round[i] + w[i];
+        uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    this->state[0] += a;
+    this->state[1] += b;
+    this->state[2] += c;
+    this->state[3] += d;
+    this->state[4] += e;
+    this->state[5] += f;
+    this->state[6] += g;
+    this->state[7] += h;
+}
+
+void Sha256::update(const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    this->length += size;
+    while (size > 0) {
+        size_t n = std::min(size, sizeof(this->block) - this->block_size);
+        ::memcpy(this->block + this->block_size, p, n);
+        this->block_size += n;
+        p += n;
+        size -= n;
+        if (this->block_size == sizeof(this->block)) {
+            this->transform(this->block);
+            this->block_size = 0;
+        }
+    }
+}
+
+void Sha256::final(uint8_t digest[k_size]) {
+    uint64_t bits = this->length * 8;
+    uint8_t pad[64 + 8] = {0x80};
+    size_t pad_size = (this->block_size < 56 ? 56 : 120) - this->block_size;
+    for (size_t i = 0; i < 8; ++i) {
+        pad[pad_size + i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+    this->update(pad, pad_size + 8);
+
+    for (size_t i = 0; i < 8; ++i) {
+        digest[i * 4] = (uint8_t)(this->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(this->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(this->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)this->state[i];
+    }
+}
+
+void Sha256::hash(const void *data, size_t size, uint8_t digest[k_size]) {
+    Sha256 ctx;
+    ctx.update(data, size);
+    ctx.final(digest);
+}
+
+
+HmacSha256::HmacSha256(const void *key, size_t key_size) {
+    uint8_t pad[64] = {0};
+    if (key_size > sizeof(pad)) {
+        Sha256::hash(key, key_size, pad);
+    } else {
+        ::memcpy(pad, key, key_size);
+    }
+    for (size_t i = 0; i < sizeof(pad); ++i) {
+        pad[i] ^= 0x36;
+    }
+    this->inner.update(pad, sizeof(pad));
+    for (size_t i = 0; i < sizeof(pad); ++i) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    this->outer.update(pad, sizeof(pad));
+}
+
+void HmacSha256::mac(const void *data, size_t size, uint8_t out[Sha256::k_size]) const {
+    Sha256 ctx = this->inner;
+    ctx.update(data, size);
+    ctx.final(out);
+    ctx = this->outer;
+    ctx.update(out, Sha256::k_size);
+    ctx.final(out);
+}
+
+void evsocks::pbkdf2_sha256(const void *pass, size_t pass_size, const void *salt, size_t salt_size,
+                            uint32_t iterations, uint8_t *out, size_t out_size)
+{
+    HmacSha256 hmac(pass, pass_size);
+    // salt + INT(i), the block index is only known per block
+    std::string first((const char *)salt, salt_size);
+    first.resize(salt_size + 4);
+    for (uint32_t block = 1; out_size > 0; ++block) {
+        first[salt_size] = (char)(block >> 24);
+        first[salt_size + 1] = (char)(block >> 16);
+        first[salt_size + 2] = (char)(block >> 8);
+        first[salt_size + 3] = (char)block;
+
+        uint8_t u[Sha256::k_size];
+        uint8_t t[Sha256::k_size];
+        hmac.mac(first.data(), first.size(), u);
+        ::memcpy(t, u, sizeof(t));
+        for (uint32_t i = 1; i < iterations; ++i) {
+            hmac.mac(u, sizeof(u), u);
+            for (size_t j = 0; j < sizeof(t); ++j) {
+                t[j] ^= u[j];
+            }
+        }
+        size_t n = std::min(out_size, sizeof(t));
+        ::memcpy(out, t, n);
+        out += n;
+        out_size -= n;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef EVSOCKS_SHA256_H
+#define EVSOCKS_SHA256_H
+
+
+#include <stdint.h>
+#include <cstddef>
+
+
+namespace evsocks {
+
+    // FIPS 180-4 SHA-256
+    struct Sha256 {
+        static const size_t k_size = 32;
+
+        // private
+        uint32_t state[8];
+        uint64_t length;        // bytes
+        uint8_t block[64];
+        size_t block_size;
+
+        // public
+        Sha256();
+        void update(const void *data, size_t size);
+        void final(uint8_t digest[k_size]);
+
+        static void hash(const void *data, size_t size, uint8_t digest[k_size]);
+
+        // private
+        void transform(const uint8_t *chunk);
+    };
+
+    // HMAC-SHA256 (RFC 2104), the key is hashed into the pads once for many messages
+    struct HmacSha256 {
+        // private
+        Sha256 inner;
+        Sha256 outer;
+
+        // public
+        HmacSha256(const void *key, size_t key_size);
+        void mac(const void *data, size_t size, uint8_t out[Sha256::k_size]) const;
+    };
+
+    // PBKDF2-HMAC-SHA256 (RFC 8018) of out_size bytes
+    void pbkdf2_sha256(const void *pass, size_t pass_size, const void *salt, size_t salt_size,
+                       uint32_t iterations, uint8_t *out, size_t out_size);
+
+}
+
+
+#endif //EVSOCKS_SHA256_H
@@ -30,6 +30,10 @@ namespace evsocks {
     enum SocksReply {
         REPLY_OK = 0,
         REPLY_ERR = 1,
+        REPLY_NET_UNREACHABLE = 3,
+        REPLY_HOST_UNREACHABLE = 4,
+        REPLY_CONN_REFUSED = 5,
+        REPLY_TTL_EXPIRED = 6,
     };
 
     struct SocksAddr {
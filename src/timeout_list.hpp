@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <stdint.h>
 
 #include <ev.h>     // for ev_tstamp
 
@@ -12,8 +13,11 @@ namespace evsocks {
     struct TimeoutTracer {
         tz::DListNode node;
         ev_tstamp last_activity;
+        // TimingWheel only
+        ev_tstamp deadline;
+        uint64_t tick;      // slot the node is filed in
 
-        TimeoutTracer() : last_activity(0) {}
+        TimeoutTracer() : last_activity(0), deadline(0), tick(0) {}
     };
 
     template <class T, size_t offset>
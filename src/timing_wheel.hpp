@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstddef>
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+
+#include <ev.h>     // for ev_tstamp
+
+#include "dlist.hpp"
+#include "timeout_list.hpp"
+
+
+namespace evsocks {
+
+    // Two-level timing wheel with the interface of TimeoutList.
+    //
+    // Objects are filed in the slot of ceil(deadline / tick). touch() only updates
+    // the deadline if it moves later, the object is re-filed when its slot fires,
+    // so relaying data does not relink on every packet. Timeouts fire up to one tick late.
+    // Level 0 covers k_slots0 ticks, level 1 covers k_slots0 * k_slots1 ticks,
+    // farther deadlines wait in the last level 1 slot.
+    template <class T, size_t offset>
+    struct TimingWheel {
+        static const uint64_t k_bits0 = 8;
+        static const uint64_t k_slots0 = 1 << k_bits0;
+        static const uint64_t k_slots1 = 64;
+
+        // param
+        ev_tstamp timeout;      // default timeout of touch()
+        ev_tstamp tick;
+        // readonly
+        size_t size;
+
+        typedef tz::DList<T, offset + offsetof(TimeoutTracer, node)> ListType;
+
+        TimingWheel(ev_tstamp timeout, ev_tstamp tick)
+            : timeout(timeout), tick(tick), size(0), cur(0)
+        {}
+
+        void touch(ev_tstamp now, T &obj) {
+            this->touch(now, obj, this->timeout);
+        }
+
+        // per object timeout
+        void touch(ev_tstamp now, T &obj, ev_tstamp timeout) {
+            TimeoutTracer &tracer = get_tracer(obj);
+            tracer.last_activity = now;
+            tracer.deadline = now + timeout;
+
+            uint64_t k = this->to_tick(tracer.deadline);
+            if (ListType::is_linked(obj)) {
+                if (k >= tracer.tick) {
+                    return;     // coarse touch, re-filed when the slot fires
+                }
+                ListType::unlink(obj);
+            } else {
+                if (this->size == 0) {
+                    this->cur = (uint64_t)(now / this->tick);
+                }
+                this->size++;
+            }
+            this->file(obj, std::max(k, this->cur + 1));
+        }
+
+        void remove(T &obj) {
+            if (ListType::is_linked(obj)) {
+                ListType::unlink(obj);
+                this->size--;
+            }
+        }
+
+        // caller should remove timeouts
+        template <class CB>
+        ev_tstamp each_timeouts(ev_tstamp now, CB cb) {
+            if (now == INFINITY) {
+                this->each_all(cb);
+                return this->timeout;
+            }
+
+            uint64_t target = (uint64_t)(now / this->tick);
+            while (this->cur < target && this->size > 0) {
+                this->cur++;
+                if ((this->cur & (k_slots0 - 1)) == 0) {
+                    this->cascade();
+                }
+
+                // cb may remove any object, so the due ones are taken out of the slot first
+                ListType due;
+                ListType &slot = this->slots0[this->cur & (k_slots0 - 1)];
+                typename ListType::iterator it = slot.begin();
+                while (it != slot.end()) {
+                    T &obj = *it;
+                    ++it;
+                    TimeoutTracer &tracer = get_tracer(obj);
+                    if (tracer.tick != this->cur) {
+                        continue;   // re-filed to a later round of this slot
+                    }
+                    ListType::unlink(obj);
+                    uint64_t k = this->to_tick(tracer.deadline);
+                    if (k <= this->cur) {
+                        due.push_back(obj);
+                    } else {
+                        this->file(obj, k);     // touched later, maybe still within now
+                    }
+                }
+                while (!due.empty()) {
+                    T &obj = due.front();
+                    cb(obj);
+                    if (!due.empty() && &due.front() == &obj) {
+                        // touched or left by cb, fires again if still due
+                        ListType::unlink(obj);
+                        this->file(obj, std::max(this->to_tick(get_tracer(obj).deadline), this->cur + 1));
+                    }
+                }
+            }
+            if (this->cur < target) {
+                this->cur = target;     // empty
+            }
+
+            return this->next_check(now);
+        }
+
+        // private
+        uint64_t cur;   // last processed tick
+        ListType slots0[k_slots0];
+        ListType slots1[k_slots1];
+
+        uint64_t to_tick(ev_tstamp t) const {
+            return (uint64_t)::ceil(t / this->tick);
+        }
+
+        void file(T &obj, uint64_t k) {
+            get_tracer(obj).tick = k;
+            if (k - this->cur <= k_slots0) {
+                this->slots0[k & (k_slots0 - 1)].push_back(obj);
+            } else {
+                uint64_t round = std::min(k >> k_bits0, (this->cur >> k_bits0) + k_slots1 - 1);
+                this->slots1[round % k_slots1].push_back(obj);
+            }
+        }
+
+        // move the level 1 slot of this round to level 0
+        void cascade() {
+            ListType &slot = this->slots1[(this->cur >> k_bits0) % k_slots1];
+            while (!slot.empty()) {
+                T &obj = slot.pop_front();
+                this->file(obj, std::max(get_tracer(obj).tick, this->cur));
+            }
+        }
+
+        ev_tstamp next_check(ev_tstamp now) const {
+            if (this->size == 0) {
+                return this->timeout;
+            }
+            uint64_t next = ((this->cur >> k_bits0) + 1) << k_bits0;     // next cascade
+            for (uint64_t k = this->cur + 1; k < next; ++k) {
+                if (!this->slots0[k & (k_slots0 - 1)].empty()) {
+                    next = k;
+                    break;
+                }
+            }
+            return std::max(next * this->tick - now, 0.0);
+        }
+
+        template <class CB>
+        void each_all(CB cb) {
+            for (size_t i = 0; i < k_slots0 + k_slots1; ++i) {
+                ListType &slot = i < k_slots0 ? this->slots0[i] : this->slots1[i - k_slots0];
+                typename ListType::iterator it = slot.begin();
+                while (it != slot.end()) {
+                    T &obj = *it;
+                    ++it;
+                    cb(obj);
+                }
+            }
+        }
+
+        static TimeoutTracer &get_tracer(T &obj) {
+            return *(TimeoutTracer *)((char *)&obj + offset);
+        }
+    };
+
+#define EVSOCKS_TIMING_WHEEL(T, member) evsocks::TimingWheel<T, offsetof(T, member)>
+
+}
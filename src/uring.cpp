@@ -0,0 +1,492 @@
+#include <cassert>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "string_util.hpp"
+#include "ctxlog/ctxlog_evsocks.hpp"
+
+
+using namespace evsocks;
+
+
+// user_data is the file pointer with the op in the low bits
+static const uint64_t k_op_mask = 3;
+// provided buffer group of the recvs
+static const uint16_t k_buf_group = 0;
+// submit and harvest rounds of a loop iteration, see uring_prepare_cb()
+static const int k_prepare_rounds = 4;
+
+static void uring_io_cb(EV_P_ ev_io *w, int revents);
+static void uring_prepare_cb(EV_P_ ev_prepare *w, int revents);
+
+template <class T>
+static T load_acquire(const T *p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template <class T>
+static void store_release(T *p, T value) {
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+static bool kernel_at_least(int major, int minor) {
+    struct utsname uts;
+    int cur_major = 0;
+    int cur_minor = 0;
+    if (::uname(&uts) != 0 || ::sscanf(uts.release, "%d.%d", &cur_major, &cur_minor) != 2) {
+        return false;
+    }
+    return cur_major > major || (cur_major == major && cur_minor >= minor);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *ptr = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static void *map_anon(size_t size) {
+    void *ptr = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// errno of the failed call, before destroy() touches it
+static Error init_error(Uring &ring, ErrorType type, const char *msg) {
+    Error err(type, errno, msg);
+    ring.destroy();
+    return err;
+}
+
+
+Uring::Uring()
+    : entries(512), buffers(256), buffer_size(16 * 1024), stats(NULL)
+    , loop(NULL), ring_fd(-1)
+    , sq_ptr(NULL), sq_size(0), cq_ptr(NULL), cq_size(0), sqes(NULL), sqes_size(0)
+    , sq_head(NULL), sq_tail(NULL), sq_flags(NULL), sq_array(NULL), sq_mask(0), sq_entries(0), sqe_tail(0)
+    , cq_head(NULL), cq_tail(NULL), cq_mask(0), cqes(NULL)
+    , buf_ring(NULL), buf_ring_size(0), buf_base(NULL), buf_base_size(0)
+    , dispatching(NULL), files(0), ops(0), closing(false)
+{
+    ev_io_init(&this->ring_io, uring_io_cb, -1, EV_READ);
+    ev_prepare_init(&this->submit_prepare, uring_prepare_cb);
+}
+
+Error Uring::init(struct ev_loop *loop) {
+    assert(this->ring_fd < 0);
+    assert(this->buffers > 0 && (this->buffers & (this->buffers - 1)) == 0 && this->buffers <= 32768);
+    if (!kernel_at_least(6, 0)) {
+        return Error(ERR_URING, ENOSYS, "multishot recv needs Linux 6.0");
+    }
+
+    struct io_uring_params params;
+    ::memset(&params, 0, sizeof(params));
+    // sessions get a multishot recv each, keep completions of busy iterations in the CQ
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = this->entries * 4;
+    int fd = (int)::syscall(__NR_io_uring_setup, this->entries, &params);
+    if (fd < 0) {
+        return Error(ERR_URING, errno, "io_uring_setup() error");
+    }
+    this->loop = loop;
+    this->ring_fd = fd;
+    if (!(params.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        return init_error(*this, ERR_URING, "io_uring without IORING_FEAT_NODROP");
+    }
+
+    // rings
+    this->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    this->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        this->sq_size = this->cq_size = std::max(this->sq_size, this->cq_size);
+    }
+    this->sq_ptr = map_ring(fd, this->sq_size, IORING_OFF_SQ_RING);
+    if (this->sq_ptr == NULL) {
+        return init_error(*this, ERR_MMAP, "mmap() error for the SQ ring");
+    }
+    this->cq_ptr = single_mmap ? this->sq_ptr : map_ring(fd, this->cq_size, IORING_OFF_CQ_RING);
+    if (this->cq_ptr == NULL) {
+        return init_error(*this, ERR_MMAP, "mmap() error for the CQ ring");
+    }
+    this->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    this->sqes = (struct io_uring_sqe *)map_ring(fd, this->sqes_size, IORING_OFF_SQES);
+    if (this->sqes == NULL) {
+        return init_error(*this, ERR_MMAP, "mmap() error for the SQEs");
+    }
+
+    char *sq = (char *)this->sq_ptr;
+    this->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    this->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    this->sq_flags = (unsigned int *)(sq + params.sq_off.flags);
+    this->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    this->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    this->sq_entries = params.sq_entries;
+    this->sqe_tail = *this->sq_tail;
+    // SQEs are used in ring order
+    for (unsigned int i = 0; i < this->sq_entries; ++i) {
+        this->sq_array[i] = i;
+    }
+    char *cq = (char *)this->cq_ptr;
+    this->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    this->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    this->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    this->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // provided buffers, all handed to the kernel
+    this->buf_ring_size = this->buffers * sizeof(struct io_uring_buf);
+    this->buf_ring = (struct io_uring_buf_ring *)map_anon(this->buf_ring_size);
+    if (this->buf_ring == NULL) {
+        return init_error(*this, ERR_MMAP, "mmap() error for the buffer ring");
+    }
+    this->buf_base_size = (size_t)this->buffers * this->buffer_size;
+    this->buf_base = (char *)map_anon(this->buf_base_size);
+    if (this->buf_base == NULL) {
+        return init_error(*this, ERR_MMAP, "mmap() error for the buffers");
+    }
+    struct io_uring_buf_reg reg;
+    ::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)this->buf_ring;
+    reg.ring_entries = this->buffers;
+    reg.bgid = k_buf_group;
+    if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        return init_error(*this, ERR_URING, "io_uring_register() error for the buffer ring");
+    }
+    for (unsigned int bid = 0; bid < this->buffers; ++bid) {
+        this->recycle(bid);
+    }
+
+    ev_io_set(&this->ring_io, fd, EV_READ);
+    ev_io_start(this->loop, &this->ring_io);
+    ev_unref(this->loop);
+    ev_prepare_start(this->loop, &this->submit_prepare);
+    ev_unref(this->loop);
+    return Ok();
+}
+
+void Uring::destroy() {
+    if (this->ring_fd < 0) {
+        return;
+    }
+    if (ev_is_active(&this->ring_io)) {
+        ev_ref(this->loop);
+        ev_io_stop(this->loop, &this->ring_io);
+        ev_ref(this->loop);
+        ev_prepare_stop(this->loop, &this->submit_prepare);
+    }
+
+    // the kernel may still read the data of closed files, wait for it to let go
+    if (this->cqes != NULL && this->ops > 0) {
+        this->closing = true;
+        struct io_uring_sqe *sqe = this->get_sqe(NULL, OP_CANCEL);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        for (int i = 0; i < 100 && this->ops > 0; ++i) {
+            unsigned int pending = this->sqe_tail - load_acquire(this->sq_head);
+            store_release(this->sq_tail, this->sqe_tail);
+            this->enter(pending, 1, IORING_ENTER_GETEVENTS);
+            this->harvest();
+        }
+        if (this->ops > 0) {
+            CTXLOG_WARN("io_uring ops left at exit. [ops:%zu]", this->ops);
+        }
+    }
+
+    if (this->buf_base != NULL) {
+        ::munmap(this->buf_base, this->buf_base_size);
+    }
+    if (this->buf_ring != NULL) {
+        ::munmap(this->buf_ring, this->buf_ring_size);
+    }
+    if (this->sqes != NULL) {
+        ::munmap(this->sqes, this->sqes_size);
+    }
+    if (this->cq_ptr != NULL && this->cq_ptr != this->sq_ptr) {
+        ::munmap(this->cq_ptr, this->cq_size);
+    }
+    if (this->sq_ptr != NULL) {
+        ::munmap(this->sq_ptr, this->sq_size);
+    }
+    ::close(this->ring_fd);
+    this->ring_fd = -1;
+    this->buf_base = NULL;
+    this->buf_ring = NULL;
+    this->sqes = NULL;
+    this->cq_ptr = this->sq_ptr = NULL;
+    this->cqes = NULL;
+}
+
+UringFile *Uring::open(int fd, UringFile::Cb cb, void *userdata) {
+    assert(this->active());
+    UringFile *file = new UringFile();
+    file->fd = fd;
+    file->cb = cb;
+    file->userdata = userdata;
+    this->files++;
+    return file;
+}
+
+Error Uring::close(UringFile *file, ChunkQueue *sending) {
+    assert(file->cb != NULL);
+    file->cb = NULL;
+    file->userdata = NULL;
+    file->wanted = false;
+    if (file->armed && !file->cancelling) {
+        this->cancel(*file, file->accept ? OP_ACCEPT : OP_RECV);
+    }
+    if (file->sends > 0) {
+        this->cancel(*file, OP_SEND);
+        if (sending != NULL) {
+            file->orphan.swap(*sending);
+        }
+    }
+
+    // ops in flight hold the socket open until they complete
+    Error err;
+    if (::close(file->fd) != 0) {
+        err = Error(ERR_CLOSE, errno, strfmt("close() failed for [fd:%d]", file->fd));
+    }
+    file->fd = -1;
+    if (file->inflight == 0 && file != this->dispatching) {
+        this->release(file);
+    }
+    return err;
+}
+
+void Uring::start_recv(UringFile &file) {
+    assert(file.cb != NULL);
+    file.wanted = true;
+    file.accept = false;
+    if (!file.armed) {
+        this->arm(file);
+    }
+}
+
+void Uring::start_accept(UringFile &file) {
+    assert(file.cb != NULL);
+    file.wanted = true;
+    file.accept = true;
+    if (!file.armed) {
+        this->arm(file);
+    }
+}
+
+void Uring::stop(UringFile &file) {
+    file.wanted = false;
+    if (file.armed && !file.cancelling) {
+        this->cancel(file, file.accept ? OP_ACCEPT : OP_RECV);
+    }
+}
+
+void Uring::send(UringFile &file, const struct iovec *iov, size_t iovcnt) {
+    assert(file.cb != NULL);
+    assert(iovcnt > 0 && iovcnt < this->sq_entries);
+
+    // a link only spans SQEs submitted together
+    this->reserve((unsigned int)iovcnt);
+    for (size_t i = 0; i < iovcnt; ++i) {
+        struct io_uring_sqe *sqe = this->get_sqe(&file, OP_SEND);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = file.fd;
+        sqe->addr = (uintptr_t)iov[i].iov_base;
+        sqe->len = (uint32_t)iov[i].iov_len;
+        // short sends are retried by the kernel, a failure breaks the link
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        if (i + 1 < iovcnt) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        file.sends++;
+    }
+}
+
+struct io_uring_sqe *Uring::get_sqe(UringFile *file, int op) {
+    this->reserve(1);
+    struct io_uring_sqe *sqe = &this->sqes[this->sqe_tail & this->sq_mask];
+    this->sqe_tail++;
+    ::memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)file | (uint64_t)op;
+    if (file != NULL) {
+        file->inflight++;
+    }
+    this->ops++;
+    return sqe;
+}
+
+// room for n more SQEs
+void Uring::reserve(unsigned int n) {
+    if (this->sqe_tail + n - load_acquire(this->sq_head) > this->sq_entries) {
+        this->submit();
+    }
+    assert(this->sqe_tail + n - load_acquire(this->sq_head) <= this->sq_entries);
+}
+
+void Uring::arm(UringFile &file) {
+    assert(!file.armed);
+    struct io_uring_sqe *sqe = this->get_sqe(&file, file.accept ? OP_ACCEPT : OP_RECV);
+    sqe->fd = file.fd;
+    if (file.accept) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = k_buf_group;
+    }
+    file.armed = true;
+    file.cancelling = false;
+}
+
+// all ops of file with the user_data of op
+void Uring::cancel(UringFile &file, int op) {
+    struct io_uring_sqe *sqe = this->get_sqe(&file, OP_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)&file | (uint64_t)op;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    if (op != OP_SEND) {
+        file.cancelling = true;
+    }
+}
+
+void Uring::submit() {
+    unsigned int pending = this->sqe_tail - load_acquire(this->sq_head);
+    if (pending == 0) {
+        return;
+    }
+    store_release(this->sq_tail, this->sqe_tail);
+    if (this->enter(pending, 0, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        CTXLOG_ERR("io_uring_enter() error. [errno:%d]", errno);
+    }
+}
+
+size_t Uring::harvest() {
+    size_t n = 0;
+    for (;;) {
+        unsigned int head = *this->cq_head;
+        if (head == load_acquire(this->cq_tail)) {
+            // completions that did not fit into the CQ wait in the kernel
+            if (!(load_acquire(this->sq_flags) & IORING_SQ_CQ_OVERFLOW) || this->closing) {
+                break;
+            }
+            this->enter(0, 0, IORING_ENTER_GETEVENTS);
+            if (*this->cq_head == load_acquire(this->cq_tail)) {
+                break;
+            }
+            continue;
+        }
+        const struct io_uring_cqe &cqe = this->cqes[head & this->cq_mask];
+        uint64_t user_data = cqe.user_data;
+        int res = cqe.res;
+        uint32_t flags = cqe.flags;
+        store_release(this->cq_head, head + 1);
+        this->dispatch(user_data, res, flags);
+        n++;
+    }
+    return n;
+}
+
+void Uring::dispatch(uint64_t user_data, int res, uint32_t flags) {
+    UringFile *file = (UringFile *)(uintptr_t)(user_data & ~k_op_mask);
+    int op = (int)(user_data & k_op_mask);
+    bool more = flags & IORING_CQE_F_MORE;
+    const char *data = NULL;
+    unsigned int bid = 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        data = this->buf_base + (size_t)bid * this->buffer_size;
+    }
+    if (!more) {
+        assert(this->ops > 0);
+        this->ops--;
+    }
+    if (file == NULL) {
+        return;     // the cancel of destroy()
+    }
+
+    bool deliver = file->cb != NULL && !this->closing && op != OP_CANCEL;
+    if (!more) {
+        assert(file->inflight > 0);
+        file->inflight--;
+        if (op == OP_SEND) {
+            file->sends--;
+        }
+        if (op == OP_RECV || op == OP_ACCEPT) {
+            file->armed = false;
+            file->cancelling = false;
+            if (res == -ECANCELED || (op == OP_RECV && res == -ENOBUFS)) {
+                deliver = false;    // re-armed below if still wanted
+            } else if (res < 0 || (op == OP_RECV && res == 0)) {
+                file->wanted = false;
+            }
+        }
+    }
+    if (!deliver && op == OP_ACCEPT && res >= 0) {
+        ::close(res);   // the listener is gone
+    }
+
+    if (deliver) {
+        this->dispatching = file;
+        file->cb(file->userdata, op, res, data);
+        this->dispatching = NULL;
+    }
+    if (data != NULL) {
+        this->recycle(bid);
+    }
+    if (file->cb != NULL && file->wanted && !file->armed && !this->closing) {
+        this->arm(*file);
+    }
+    if (file->cb == NULL && file->inflight == 0) {
+        this->release(file);
+    }
+}
+
+void Uring::recycle(unsigned int bid) {
+    uint16_t tail = this->buf_ring->tail;
+    // not bufs[], whose C++ flex array wrapper is offset by an empty struct
+    struct io_uring_buf &buf = ((struct io_uring_buf *)this->buf_ring)[tail & (this->buffers - 1)];
+    buf.addr = (uintptr_t)(this->buf_base + (size_t)bid * this->buffer_size);
+    buf.len = this->buffer_size;
+    buf.bid = (uint16_t)bid;
+    store_release(&this->buf_ring->tail, (uint16_t)(tail + 1));
+}
+
+void Uring::release(UringFile *file) {
+    assert(this->files > 0);
+    this->files--;
+    delete file;
+}
+
+int Uring::enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    if (this->stats != NULL) {
+        this->stats->syscalls++;
+    }
+    return (int)::syscall(__NR_io_uring_enter, this->ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_io_cb(EV_P_ ev_io *w, int revents) {
+    (void)revents;
+    Uring &ring = *(Uring *)((char *)w - offsetof(Uring, ring_io));
+    ring.harvest();
+}
+
+// before polling: submit what callbacks queued. Sends to a socket with room complete
+// during the submit, handling them right away saves a wakeup.
+static void uring_prepare_cb(EV_P_ ev_prepare *w, int revents) {
+    (void)revents;
+    Uring &ring = *(Uring *)((char *)w - offsetof(Uring, submit_prepare));
+    for (int i = 0; i < k_prepare_rounds; ++i) {
+        ring.submit();
+        if (ring.harvest() == 0) {
+            return;
+        }
+    }
+    ring.submit();
+}
@@ -0,0 +1,139 @@
+#ifndef EVSOCKS_URING_H
+#define EVSOCKS_URING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <ev.h>
+
+#include "chunkqueue.h"
+#include "iochannel.h"
+#include "error.h"
+
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+namespace evsocks {
+
+    // a socket whose IO goes through a Uring. Owned by the ring, since completions
+    // may still arrive after the owner is done with it, see Uring::close().
+    struct UringFile {
+        // op: Uring::Op. res: bytes or the accepted fd, 0 at eof, -errno on error.
+        // data: the received bytes of OP_RECV, only valid during the call.
+        typedef void (*Cb)(void *userdata, int op, int res, const char *data);
+
+        int fd;
+        Cb cb;              // NULL once closed
+        void *userdata;
+
+        // private
+        uint32_t inflight;  // submitted ops without their final completion
+        uint32_t sends;     // of which sends
+        bool armed;         // multishot recv or accept submitted
+        bool wanted;        // re-arm the multishot when it ends
+        bool cancelling;    // the multishot is being cancelled
+        bool accept;        // the multishot is an accept
+        ChunkQueue orphan;  // data of the sends still in flight after close()
+
+        UringFile()
+            : fd(-1), cb(NULL), userdata(NULL), inflight(0), sends(0)
+            , armed(false), wanted(false), cancelling(false), accept(false)
+        {}
+    };
+
+    // io_uring driven by a libev loop, owned by the loop thread.
+    // SQEs are queued by the calls below and submitted once per loop iteration,
+    // completions are harvested when the ring fd is readable.
+    // Received data lands in a ring of provided buffers shared by all files,
+    // each buffer goes back to the kernel as soon as the callback returns.
+    // Needs Linux 6.0 for multishot recv.
+    struct Uring {
+        enum Op {
+            OP_RECV = 0,
+            OP_SEND,
+            OP_ACCEPT,
+            OP_CANCEL,
+        };
+
+        // param
+        unsigned int entries;       // SQ size, the CQ gets 4 times as many
+        unsigned int buffers;       // provided recv buffers, a power of 2
+        unsigned int buffer_size;
+        IOStats *stats;             // optional, io_uring_enter() calls count as syscalls
+
+        // private
+        struct ev_loop *loop;
+        int ring_fd;
+        ev_io ring_io;
+        ev_prepare submit_prepare;
+
+        void *sq_ptr;
+        size_t sq_size;
+        void *cq_ptr;               // sq_ptr with IORING_FEAT_SINGLE_MMAP
+        size_t cq_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+        unsigned int *sq_head;
+        unsigned int *sq_tail;
+        unsigned int *sq_flags;
+        unsigned int *sq_array;
+        unsigned int sq_mask;
+        unsigned int sq_entries;
+        unsigned int sqe_tail;      // queued, ahead of *sq_tail until submitted
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int cq_mask;
+        struct io_uring_cqe *cqes;
+
+        struct io_uring_buf_ring *buf_ring;
+        size_t buf_ring_size;
+        char *buf_base;
+        size_t buf_base_size;
+
+        UringFile *dispatching;     // freed by dispatch() rather than close()
+        size_t files;               // open or waiting for their last completion
+        size_t ops;                 // submitted ops without their final completion
+        bool closing;               // destroy(), nothing is delivered anymore
+
+        Uring();
+        ~Uring() { this->destroy(); }
+
+        // public
+        Error init(struct ev_loop *loop);
+        void destroy();
+        bool active() const { return this->ring_fd >= 0; }
+
+        UringFile *open(int fd, UringFile::Cb cb, void *userdata);
+        // cancel the ops of file and close its fd, no more callbacks.
+        // Sends in flight keep their data, taken from sending if given.
+        Error close(UringFile *file, ChunkQueue *sending);
+
+        // multishot recv into the provided buffers until stop(), eof or an error
+        void start_recv(UringFile &file);
+        // multishot accept until stop() or an error, accepted fds are non-blocking
+        void start_accept(UringFile &file);
+        // cancel the multishot, completions already posted are still delivered
+        void stop(UringFile &file);
+        bool is_started(const UringFile &file) const { return file.wanted; }
+        // a chain of linked sends completed in order, one completion per iovec.
+        // The data must stay in place until then, a failed send cancels the rest.
+        void send(UringFile &file, const struct iovec *iov, size_t iovcnt);
+
+        // private
+        struct io_uring_sqe *get_sqe(UringFile *file, int op);
+        void reserve(unsigned int n);
+        void arm(UringFile &file);
+        void cancel(UringFile &file, int op);
+        void submit();
+        // returns the number of completions handled
+        size_t harvest();
+        void dispatch(uint64_t user_data, int res, uint32_t flags);
+        void recycle(unsigned int bid);
+        void release(UringFile *file);
+        int enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags);
+    };
+
+}
+
+#endif //EVSOCKS_URING_H
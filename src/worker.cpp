@@ -0,0 +1,472 @@
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <boost/bind/bind.hpp>
+
+#include "worker.h"
+#include "ctxlog/ctxlog_evsocks.hpp"
+
+
+using namespace evsocks;
+
+
+static void worker_term_async_cb(EV_P_ ev_async *w, int revents);
+static void worker_force_term_async_cb(EV_P_ ev_async *w, int revents);
+static void worker_handoff_async_cb(EV_P_ ev_async *w, int revents);
+static void group_done_async_cb(EV_P_ ev_async *w, int revents);
+
+
+WorkerGroup::WorkerGroup(struct ev_loop *loop, IServerHandler *handler)
+    : mode(MODE_REUSEPORT), handler(handler), relay_workers(0), reuseport_cpu(false), loop_flags(EVFLAG_AUTO), accept_budget(64)
+    , setup_cb(NULL), setup_userdata(NULL)
+    , term_req(false), term_cb(NULL), term_userdata(NULL)
+    , loop(loop), acceptor(NULL), next_worker(0), relay_term_sent(false)
+    , port(0), workers_num(0), running(0), handshake_running(0)
+{
+    ev_async_init(&this->done_async, group_done_async_cb);
+}
+
+WorkerGroup::~WorkerGroup() {
+    // workers must be terminated before destruction
+    this->join();
+}
+
+static void drop_stream(StreamHandoff *handoff) {
+    close_fd(handoff->client_fd);
+    close_fd(handoff->remote_fd);
+    if (handoff->ip_limits != NULL) {
+        handoff->ip_limits->release(handoff->client_addr);
+    }
+    delete handoff;
+}
+
+static void worker_term_cb(void *userdata) {
+    Worker &worker = *(Worker *)userdata;
+    CTXLOG_INFO("exiting loop");
+    ev_break(worker.loop, EVBREAK_ALL);
+}
+
+static void worker_stream_cb(void *userdata, StreamHandoff *handoff) {
+    Worker &worker = *(Worker *)userdata;
+    worker.group->dispatch_stream(handoff);
+}
+
+static Error pin_thread(int cpu) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    int rv = ::pthread_setaffinity_np(::pthread_self(), sizeof(cpuset), &cpuset);
+    if (rv != 0) {
+        return Error(ERR_THREAD, rv, strfmt("pthread_setaffinity_np() error for [cpu:%d]", cpu));
+    }
+    return Ok();
+}
+
+static void worker_main(Worker *w) {
+    Worker &worker = *w;
+    WorkerGroup &group = *worker.group;
+    CTXLOG_PUSH_FUNC().set("worker", worker.index).push(worker.relay ? "[relay]" : "");
+
+    // Pin before anything is allocated: with the default memory policy pages are placed
+    // on the node of the faulting CPU, so the loop, the Server and its buffers stay NUMA-local.
+    Error err;
+    if (!group.cpus.empty()) {
+        int cpu = group.cpus[worker.index % group.cpus.size()];
+        err = pin_thread(cpu);
+        if (err.ok()) {
+            CTXLOG_INFO("pinned to [cpu:%d]", cpu);
+        }
+    }
+
+    if (err.ok()) {
+        worker.loop = ev_loop_new(group.loop_flags);
+        if (worker.loop == NULL) {
+            err = Error(ERR_EV_LOOP, 0, "ev_loop_new() error");
+        }
+    }
+
+    if (worker.loop != NULL) {
+        worker.server = new Server(worker.loop, group.handler);
+        if (group.setup_cb != NULL) {
+            group.setup_cb(group.setup_userdata, *worker.server);
+        }
+        if (group.reuseport_cpu && group.mode == WorkerGroup::MODE_REUSEPORT) {
+            // listeners join the group in worker order, so socket i is the one of worker i
+            vector<int> &steer = worker.server->listen_opt.reuseport_cpus;
+            steer.clear();
+            for (size_t i = 0; i < group.workers_num; ++i) {
+                steer.push_back(group.cpus[i % group.cpus.size()]);
+            }
+        }
+        if (!worker.relay && group.relay_workers > 0) {
+            worker.server->stream_cb = worker_stream_cb;
+            worker.server->stream_userdata = &worker;
+        }
+
+        err = worker.server->init();
+        if (err.ok() && !worker.relay && group.mode == WorkerGroup::MODE_REUSEPORT) {
+            err = worker.server->start_listen(group.host, group.port);
+        }
+
+        ev_async_init(&worker.term_async, worker_term_async_cb);
+        ev_async_init(&worker.force_term_async, worker_force_term_async_cb);
+        ev_async_init(&worker.handoff_async, worker_handoff_async_cb);
+        ev_async_start(worker.loop, &worker.term_async);
+        ev_async_start(worker.loop, &worker.force_term_async);
+        ev_async_start(worker.loop, &worker.handoff_async);
+    }
+
+    bool ok = err.ok();
+    {
+        boost::lock_guard<boost::mutex> lock(group.mutex);
+        worker.start_err = err;
+        worker.started = true;
+        group.cond.notify_all();
+    }
+
+    if (ok) {
+        ev_run(worker.loop, 0);
+        assert(worker.server->clients() == 0);
+    }
+
+    // clean up
+    if (worker.loop != NULL) {
+        ev_async_stop(worker.loop, &worker.term_async);
+        ev_async_stop(worker.loop, &worker.force_term_async);
+        ev_async_stop(worker.loop, &worker.handoff_async);
+        if (!ok) {
+            worker.server->stop_listen();
+        }
+
+        struct ev_loop *loop = worker.loop;
+        Server *server = worker.server;
+        {
+            // no more ev_async_send() to this loop
+            boost::lock_guard<boost::mutex> lock(group.mutex);
+            worker.loop = NULL;
+            worker.server = NULL;
+        }
+        delete server;
+        ev_loop_destroy(loop);
+    }
+
+    // connections handed off after termination, none is pushed once loop is NULL
+    PendingConn conn;
+    while (worker.handoff_queue->pop(conn)) {
+        close_fd(conn.fd);
+    }
+    StreamHandoff *handoff = NULL;
+    while (worker.stream_queue->pop(handoff)) {
+        drop_stream(handoff);
+    }
+
+    group.on_worker_exit(worker);
+}
+
+static void acceptor_accept_cb(void *userdata, int fd, const Addr &addr) {
+    WorkerGroup &group = *(WorkerGroup *)userdata;
+    group.dispatch(fd, addr);
+}
+
+static void acceptor_term_cb(void *userdata) {
+    // nothing to wait for, the acceptor has no clients
+    (void)userdata;
+}
+
+Error WorkerGroup::start(size_t num, const string &host, uint16_t port) {
+    assert(this->workers.empty());
+    assert(num > 0);
+
+    this->host = host;
+    this->port = port;
+    this->workers_num = num;
+    if (this->reuseport_cpu && this->cpus.empty()) {
+        for (size_t i = 0; i < num; ++i) {
+            this->cpus.push_back((int)i);
+        }
+    }
+    ev_async_start(this->loop, &this->done_async);
+    this->workers.assign(num + this->relay_workers, NULL);
+
+    // Workers are started one by one, so listeners join the reuseport group in index order.
+    // The relay tier is started first, it must be ready before handshakes complete.
+    Error err;
+    for (size_t i = 0; i < this->relay_workers && err.ok(); ++i) {
+        err = this->start_worker(num + i, true);
+    }
+    for (size_t i = 0; i < num && err.ok(); ++i) {
+        err = this->start_worker(i, false);
+    }
+
+    if (err.ok() && this->mode == MODE_ACCEPTOR) {
+        this->acceptor = new Server(this->loop, this->handler);
+        this->acceptor->accept_cb = acceptor_accept_cb;
+        this->acceptor->accept_userdata = this;
+        this->acceptor->listen_opt = this->listen_opt;
+        this->acceptor->accept_budget = this->accept_budget;
+        err = this->acceptor->init();
+        if (err.ok()) {
+            err = this->acceptor->start_listen(host, port);
+        }
+        if (!err.ok()) {
+            this->acceptor->term(acceptor_term_cb, this);
+        }
+    }
+
+    if (!err.ok()) {
+        // tear down started workers
+        this->force_term();
+        this->join();
+    }
+    return err;
+}
+
+Error WorkerGroup::start_worker(size_t index, bool relay) {
+    Worker *worker = new Worker();
+    worker->index = index;
+    worker->group = this;
+    worker->relay = relay;
+    {
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        this->running++;
+        if (!relay) {
+            this->handshake_running++;
+        }
+    }
+
+    try {
+        worker->thread = new boost::thread(boost::bind(worker_main, worker));
+    } catch (boost::thread_resource_error &ex) {
+        {
+            boost::lock_guard<boost::mutex> lock(this->mutex);
+            this->running--;
+            if (!relay) {
+                this->handshake_running--;
+            }
+        }
+        delete worker;
+        return Error(ERR_THREAD, 0, strfmt("failed to create thread for worker #%zu: %s", index, ex.what()));
+    }
+
+    boost::unique_lock<boost::mutex> lock(this->mutex);
+    this->workers[index] = worker;
+    while (!worker->started) {
+        this->cond.wait(lock);
+    }
+    return worker->start_err;   // transferred
+}
+
+Worker *WorkerGroup::pick_worker(size_t begin, size_t end, bool with_pending) {
+    // pick the worker with the fewest sessions, ties are broken round-robin
+    Worker *target = NULL;
+    size_t target_load = 0;
+    size_t num = end - begin;
+    size_t start = this->next_worker.fetch_add(1, boost::memory_order_relaxed);
+
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    for (size_t i = 0; i < num; ++i) {
+        Worker *worker = this->workers[begin + (start + i) % num];
+        if (worker == NULL || worker->server == NULL) {
+            continue;   // not started or exited
+        }
+        size_t load = worker->server->n_clients.load(boost::memory_order_relaxed);
+        if (with_pending) {
+            load += worker->pending();
+        }
+        if (target == NULL || load < target_load) {
+            target = worker;
+            target_load = load;
+        }
+    }
+    return target;
+}
+
+void WorkerGroup::dispatch(int fd, const Addr &addr) {
+    // include connections not yet picked up by the worker
+    Worker *target = this->pick_worker(0, this->workers_num, true);
+    if (target != NULL) {
+        // The exiting worker clears loop under the mutex before its last drain of the queue,
+        // so nothing is pushed after that drain.
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        if (target->loop != NULL && target->handoff_queue->push(PendingConn(fd, addr))) {
+            ev_async_send(target->loop, &target->handoff_async);
+            return;
+        }
+    }
+    CTXLOG_WARN("no worker available, drop [client:%s][fd:%d]", addr.str().c_str(), fd);
+    close_fd(fd);
+}
+
+void WorkerGroup::dispatch_stream(StreamHandoff *handoff) {
+    // called in handshake workers
+    Worker *target = this->pick_worker(this->workers_num, this->workers_num + this->relay_workers, false);
+    if (target != NULL) {
+        // see dispatch()
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        if (target->loop != NULL && target->stream_queue->push(handoff)) {
+            ev_async_send(target->loop, &target->handoff_async);
+            return;
+        }
+    }
+    CTXLOG_WARN("no relay worker available, drop stream");
+    drop_stream(handoff);
+}
+
+Error WorkerGroup::term(TermCb cb, void *userdata) {
+    this->term_req = true;
+    this->term_cb = cb;
+    this->term_userdata = userdata;
+
+    if (this->acceptor != NULL) {
+        Error err = this->acceptor->term(acceptor_term_cb, this);
+        if (!err.ok()) {
+            CTXLOG_ERR("%s", err.str().c_str());
+        }
+    }
+
+    // the relay tier is terminated after all handshake workers exit
+    this->notify_workers(offsetof(Worker, term_async), 0, this->workers_num);
+
+    // invoke termination cb if no worker is running
+    ev_async_send(this->loop, &this->done_async);
+    return Ok();
+}
+
+Error WorkerGroup::force_term() {
+    if (this->acceptor != NULL && this->acceptor->listen_fd >= 0) {
+        this->acceptor->term(acceptor_term_cb, this);
+    }
+    this->notify_workers(offsetof(Worker, force_term_async), 0, this->workers.size());
+    return Ok();
+}
+
+void WorkerGroup::notify_workers(size_t offset, size_t begin, size_t end) {
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    for (size_t i = begin; i < end && i < this->workers.size(); ++i) {
+        Worker *worker = this->workers[i];
+        if (worker != NULL && worker->loop != NULL) {
+            ev_async_send(worker->loop, (ev_async *)((char *)worker + offset));
+        }
+    }
+}
+
+void WorkerGroup::join() {
+    for (size_t i = 0; i < this->workers.size(); ++i) {
+        if (Worker *worker = this->workers[i]) {
+            worker->thread->join();
+            delete worker->thread;
+            delete worker;
+        }
+    }
+    this->workers.clear();
+    ev_async_stop(this->loop, &this->done_async);
+
+    delete this->acceptor;
+    this->acceptor = NULL;
+}
+
+size_t WorkerGroup::clients() const {
+    size_t total = 0;
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    for (size_t i = 0; i < this->workers.size(); ++i) {
+        Worker *worker = this->workers[i];
+        if (Server *server = worker ? worker->server : NULL) {
+            total += server->n_clients.load(boost::memory_order_relaxed);
+        }
+    }
+    return total;
+}
+
+void WorkerGroup::on_worker_exit(Worker &worker) {
+    // called in worker thread
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    assert(this->running > 0);
+    this->running--;
+    if (!worker.relay) {
+        assert(this->handshake_running > 0);
+        this->handshake_running--;
+    }
+    ev_async_send(this->loop, &this->done_async);
+}
+
+static void worker_term_async_cb(EV_P_ ev_async *w, int revents) {
+    (void)revents;
+    Worker &worker = *(Worker *)((char *)w - offsetof(Worker, term_async));
+    CTXLOG_PUSH_FUNC();
+
+    worker.terminating = true;
+    Error err = worker.server->term(worker_term_cb, &worker);
+    if (!err.ok()) {
+        CTXLOG_ERR("%s", err.str().c_str());
+    }
+}
+
+static void worker_force_term_async_cb(EV_P_ ev_async *w, int revents) {
+    (void)revents;
+    Worker &worker = *(Worker *)((char *)w - offsetof(Worker, force_term_async));
+    CTXLOG_PUSH_FUNC();
+
+    worker.terminating = true;
+    Error err;
+    if (!worker.server->term_req) {
+        // the loop exits once the last client is kicked
+        err = worker.server->term(worker_term_cb, &worker);
+    }
+    if (err.ok()) {
+        err = worker.server->force_term();
+    }
+    if (!err.ok()) {
+        CTXLOG_ERR("%s", err.str().c_str());
+    }
+}
+
+static void worker_handoff_async_cb(EV_P_ ev_async *w, int revents) {
+    (void)revents;
+    Worker &worker = *(Worker *)((char *)w - offsetof(Worker, handoff_async));
+
+    PendingConn conn;
+    while (worker.handoff_queue->pop(conn)) {
+        if (worker.terminating) {
+            close_fd(conn.fd);
+        } else {
+            worker.server->on_connection(conn.fd, conn.addr);
+        }
+    }
+
+    StreamHandoff *handoff = NULL;
+    while (worker.stream_queue->pop(handoff)) {
+        if (worker.terminating) {
+            drop_stream(handoff);
+        } else {
+            worker.server->adopt_stream(*handoff);
+            delete handoff;
+        }
+    }
+}
+
+static void group_done_async_cb(EV_P_ ev_async *w, int revents) {
+    (void)revents;
+    WorkerGroup &group = *(WorkerGroup *)((char *)w - offsetof(WorkerGroup, done_async));
+
+    size_t running = 0;
+    size_t handshake_running = 0;
+    {
+        boost::lock_guard<boost::mutex> lock(group.mutex);
+        running = group.running;
+        handshake_running = group.handshake_running;
+    }
+    if (!group.term_req) {
+        return;
+    }
+
+    if (handshake_running == 0 && !group.relay_term_sent) {
+        // no more streams will be handed off
+        group.relay_term_sent = true;
+        group.notify_workers(offsetof(Worker, term_async), group.workers_num, group.workers.size());
+    }
+    if (running == 0) {
+        group.term_req = false;
+        group.term_cb(group.term_userdata);
+    }
+}
@@ -0,0 +1,155 @@
+#ifndef EVSOCKS_WORKER_H
+#define EVSOCKS_WORKER_H
+
+
+#include <string>
+#include <vector>
+
+#include <ev.h>
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/lockfree/queue.hpp>
+
+#include "auth.h"
+#include "server.h"
+#include "error.h"
+
+
+namespace evsocks {
+    using namespace std;
+
+
+    struct WorkerGroup;
+
+    // accepted connection passed from the acceptor to a worker
+    struct PendingConn {
+        int fd;
+        Addr addr;
+
+        PendingConn() : fd(-1) {}
+        PendingConn(int fd, const Addr &addr) : fd(fd), addr(addr) {}
+    };
+
+    // one thread running its own loop and Server
+    struct Worker {
+        size_t index;
+        WorkerGroup *group;
+        bool relay;         // relay tier, only runs sessions handed off in STREAM state
+
+        // acceptor mode: single producer (acceptor) and single consumer (worker)
+        static const size_t k_handoff_capacity = 4096;
+        typedef boost::lockfree::spsc_queue<PendingConn, boost::lockfree::capacity<k_handoff_capacity> > HandoffQueue;
+        HandoffQueue *handoff_queue;
+        // relay tier: multiple producers (handshake workers)
+        typedef boost::lockfree::queue<StreamHandoff *, boost::lockfree::capacity<k_handoff_capacity> > StreamQueue;
+        StreamQueue *stream_queue;
+        ev_async handoff_async;
+        bool terminating;   // worker thread only
+
+        // guarded by group mutex, NULL after the worker thread exits
+        struct ev_loop *loop;
+        Server *server;
+        boost::thread *thread;
+
+        ev_async term_async;
+        ev_async force_term_async;
+
+        // set by the worker thread after startup
+        bool started;
+        Error start_err;
+
+        Worker()
+            : index(0), group(NULL), relay(false)
+            , handoff_queue(new HandoffQueue()), stream_queue(new StreamQueue()), terminating(false)
+            , loop(NULL), server(NULL), thread(NULL), started(false)
+        {}
+
+        ~Worker() {
+            delete this->handoff_queue;
+            delete this->stream_queue;
+        }
+
+        // acceptor thread only
+        size_t pending() const {
+            return k_handoff_capacity - this->handoff_queue->write_available();
+        }
+    };
+
+    // N workers, either each listening on the same port with SO_REUSEPORT,
+    // or fed by a single acceptor running on the controlling loop (usually EV_DEFAULT).
+    // Optionally a relay tier takes over sessions once they reach STREAM state,
+    // so handshakes do not add latency to established sessions.
+    struct WorkerGroup {
+        enum Mode {
+            MODE_REUSEPORT = 0,
+            MODE_ACCEPTOR,      // hand connections off to the least-loaded worker
+        };
+
+        // public
+        uint8_t mode;
+        IServerHandler *handler;
+        // number of relay workers, in addition to the handshake workers passed to start()
+        size_t relay_workers;
+        // if not empty, worker i is pinned to cpus[i % cpus.size()]
+        vector<int> cpus;
+        // reuseport mode: steer connections to the worker pinned on the receiving CPU
+        bool reuseport_cpu;
+        // flags for ev_loop_new(), selects the backend, e.g. EVBACKEND_IOURING
+        unsigned int loop_flags;
+        // acceptor mode: options of the acceptor's listener, workers get theirs from setup_cb
+        TcpListenOpt listen_opt;
+        size_t accept_budget;
+        typedef void (*SetupCb)(void *userdata, Server &server);
+        SetupCb setup_cb;       // called in the worker thread before Server::init()
+        void *setup_userdata;
+
+        typedef void (*TermCb)(void *userdata);
+        bool term_req;
+        TermCb term_cb;
+        void *term_userdata;
+
+        // private
+        struct ev_loop *loop;
+        ev_async done_async;
+        Server *acceptor;   // acceptor mode only
+        boost::atomic<size_t> next_worker;
+        bool relay_term_sent;
+
+        string host;
+        uint16_t port;
+        size_t workers_num;     // handshake workers, workers[workers_num:] are relay workers
+
+        mutable boost::mutex mutex;
+        boost::condition_variable cond;
+        size_t running;             // guarded by mutex
+        size_t handshake_running;   // guarded by mutex
+
+        vector<Worker *> workers;
+
+        // public
+        WorkerGroup(struct ev_loop *loop, IServerHandler *handler);
+        ~WorkerGroup();
+
+        Error start(size_t num, const string &host, uint16_t port);
+        Error term(TermCb cb, void *userdata);
+        Error force_term();
+        void join();
+
+        // approximate, for logging
+        size_t clients() const;
+
+        // private
+        Error start_worker(size_t index, bool relay);
+        void on_worker_exit(Worker &worker);
+        Worker *pick_worker(size_t begin, size_t end, bool with_pending);
+        void dispatch(int fd, const Addr &addr);
+        void dispatch_stream(StreamHandoff *handoff);
+        void notify_workers(size_t offset, size_t begin, size_t end);
+    };
+}
+
+
+#endif //EVSOCKS_WORKER_H
@@ -0,0 +1,348 @@
+// AuthDaemonHandler against a stub daemon: pipelined requests answered out of order,
+// a request never answered, a daemon restart, and CachingServerHandler in front of it,
+// including decisions made across a reload.
+// The proxy runs on its own loop thread, the daemon and the SOCKS clients are blocking
+// sockets of the main thread.
+
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/un.h>
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "testing.hpp"
+#include "server.h"
+#include "authdaemon.h"
+#include "authcache.h"
+
+
+using namespace evsocks;
+using namespace testing;
+
+
+static const char k_path[] = "/tmp/evsocks_test_authd.sock";
+
+struct Proxy {
+    struct ev_loop *loop;
+    AuthDaemonHandler handler;
+    CachingServerHandler cache;
+    Server *server;
+    ev_async stop_async;
+    boost::thread *thread;
+    uint16_t port;
+};
+
+static void stop_async_cb(EV_P_ ev_async *w, int revents) {
+    (void)w;
+    (void)revents;
+    ev_break(EV_A_ EVBREAK_ALL);
+}
+
+static void proxy_main(Proxy *proxy) {
+    ev_run(proxy->loop, 0);
+}
+
+static void start_proxy(Proxy &proxy, bool cached) {
+    proxy.loop = ev_loop_new(EVFLAG_AUTO);
+    proxy.handler.path = k_path;
+    proxy.handler.max_pending = 16;
+    IServerHandler *handler = &proxy.handler;
+    if (cached) {
+        proxy.cache.inner = &proxy.handler;
+        CHECK(proxy.cache.init().ok());
+        handler = &proxy.cache;
+    }
+    proxy.server = new Server(proxy.loop, handler);
+    proxy.server->auth_timeout = 0.5;
+    CHECK(proxy.server->init().ok());
+    CHECK(proxy.server->start_listen("127.0.0.1", 0).ok());
+
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    CHECK(::getsockname(proxy.server->listen_fd, (struct sockaddr *)&sa, &len) == 0);
+    proxy.port = ntohs(sa.sin_port);
+
+    ev_async_init(&proxy.stop_async, stop_async_cb);
+    ev_async_start(proxy.loop, &proxy.stop_async);
+    proxy.thread = new boost::thread(boost::bind(proxy_main, &proxy));
+}
+
+static void stop_proxy(Proxy &proxy) {
+    ev_async_send(proxy.loop, &proxy.stop_async);
+    proxy.thread->join();
+    delete proxy.thread;
+}
+
+static void set_timeout(int fd) {
+    struct timeval tv = {5, 0};
+    CHECK(::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+}
+
+static int daemon_listen() {
+    ::unlink(k_path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    struct sockaddr_un sa;
+    ::memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    ::strcpy(sa.sun_path, k_path);
+    CHECK(::bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+    CHECK(::listen(fd, 4) == 0);
+    set_timeout(fd);
+    return fd;
+}
+
+static int daemon_accept(int lfd) {
+    int fd = ::accept(lfd, NULL, NULL);
+    CHECK(fd >= 0);
+    set_timeout(fd);
+    return fd;
+}
+
+static std::string unhex(const std::string &hex) {
+    std::string out;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        out += (char)::strtol(hex.substr(i, 2).c_str(), NULL, 16);
+    }
+    return out;
+}
+
+// "ID USER PASS" lines, user by id
+static std::map<uint64_t, std::string> daemon_read(int fd, size_t count) {
+    std::map<uint64_t, std::string> requests;
+    std::string input;
+    while (requests.size() < count) {
+        char buf[1024];
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        CHECK(n > 0);
+        input.append(buf, (size_t)n);
+        size_t eol;
+        while ((eol = input.find('\n')) != std::string::npos) {
+            std::string line = input.substr(0, eol);
+            input.erase(0, eol + 1);
+            char *end = NULL;
+            uint64_t id = ::strtoull(line.c_str(), &end, 10);
+            CHECK(*end == ' ');
+            std::string user = std::string(end + 1);
+            requests[id] = unhex(user.substr(0, user.find(' ')));
+        }
+    }
+    return requests;
+}
+
+static void daemon_write(int fd, const std::string &data) {
+    CHECK(::write(fd, data.data(), data.size()) == (ssize_t)data.size());
+}
+
+// greeting and auth request pipelined
+static int socks_auth(uint16_t port, const std::string &user, const std::string &pass) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    struct sockaddr_in sa;
+    ::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(port);
+    CHECK(::connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+    set_timeout(fd);
+
+    std::string req("\x05\x01\x02\x01", 4);
+    req += (char)user.size();
+    req += user;
+    req += (char)pass.size();
+    req += pass;
+    CHECK(::write(fd, req.data(), req.size()) == (ssize_t)req.size());
+    char method[2];
+    CHECK(::recv(fd, method, 2, MSG_WAITALL) == 2);
+    CHECK(method[0] == 0x05 && method[1] == 0x02);
+    return fd;
+}
+
+// status of the auth reply, -1 if closed without one
+static int auth_reply(int fd) {
+    char reply[2];
+    int status = ::recv(fd, reply, 2, MSG_WAITALL) == 2 ? reply[1] : -1;
+    return status;
+}
+
+static void test_out_of_order(uint16_t port, int lfd, int &dfd) {
+    int alice = socks_auth(port, "alice", "a");
+    dfd = daemon_accept(lfd);
+    int bob = socks_auth(port, "bob", "b");
+    int carol = socks_auth(port, "carol", "c");
+    std::map<uint64_t, std::string> requests = daemon_read(dfd, 3);
+
+    // reversed, bob fails, an unknown id is ignored
+    std::string replies = "999 OK\n";
+    for (std::map<uint64_t, std::string>::reverse_iterator it = requests.rbegin(); it != requests.rend(); ++it) {
+        replies += strfmt("%llu %s\n", (unsigned long long)it->first, it->second == "bob" ? "FAIL" : "OK");
+    }
+    daemon_write(dfd, replies);
+
+    CHECK(auth_reply(alice) == 0);
+    CHECK(auth_reply(bob) == 1);
+    CHECK(auth_reply(carol) == 0);
+    ::close(alice);
+    ::close(bob);
+    ::close(carol);
+}
+
+static void test_timeout(uint16_t port, int dfd) {
+    int dave = socks_auth(port, "dave", "d");
+    std::map<uint64_t, std::string> requests = daemon_read(dfd, 1);
+    ev_tstamp start = ev_time();
+    CHECK(auth_reply(dave) == -1);
+    CHECK(ev_time() - start < 3);
+    ::close(dave);
+
+    // answered too late, dropped
+    daemon_write(dfd, strfmt("%llu OK\n", (unsigned long long)requests.begin()->first));
+    int erin = socks_auth(port, "erin", "e");
+    requests = daemon_read(dfd, 1);
+    CHECK(requests.begin()->second == "erin");
+    daemon_write(dfd, strfmt("%llu OK\n", (unsigned long long)requests.begin()->first));
+    CHECK(auth_reply(erin) == 0);
+    ::close(erin);
+}
+
+static void test_restart(uint16_t port, int &lfd, int dfd) {
+    int frank = socks_auth(port, "frank", "f");
+    daemon_read(dfd, 1);
+    ::close(dfd);
+    ::close(lfd);
+    ::unlink(k_path);
+    // pending auths fail with the connection
+    CHECK(auth_reply(frank) == 1);
+    ::close(frank);
+
+    // no daemon
+    int gina = socks_auth(port, "gina", "g");
+    CHECK(auth_reply(gina) == 1);
+    ::close(gina);
+
+    // reconnected by the next auth
+    lfd = daemon_listen();
+    int hank = socks_auth(port, "hank", "h");
+    dfd = daemon_accept(lfd);
+    std::map<uint64_t, std::string> requests = daemon_read(dfd, 1);
+    CHECK(requests.begin()->second == "hank");
+    daemon_write(dfd, strfmt("%llu OK\n", (unsigned long long)requests.begin()->first));
+    CHECK(auth_reply(hank) == 0);
+    ::close(hank);
+    ::close(dfd);
+}
+
+static void test_cache_skips_errors(uint16_t port, int &lfd, int &dfd) {
+    // daemon down, not a decision
+    ::close(lfd);
+    ::unlink(k_path);
+    int ivy = socks_auth(port, "ivy", "i");
+    CHECK(auth_reply(ivy) == 1);
+    ::close(ivy);
+
+    lfd = daemon_listen();
+    ivy = socks_auth(port, "ivy", "i");
+    dfd = daemon_accept(lfd);
+    std::map<uint64_t, std::string> requests = daemon_read(dfd, 1);
+    CHECK(requests.begin()->second == "ivy");
+    daemon_write(dfd, strfmt("%llu OK\n", (unsigned long long)requests.begin()->first));
+    CHECK(auth_reply(ivy) == 0);
+    ::close(ivy);
+
+    // lost connection, not a decision either
+    int jack = socks_auth(port, "jack", "j");
+    daemon_read(dfd, 1);
+    ::close(dfd);
+    CHECK(auth_reply(jack) == 1);
+    ::close(jack);
+
+    jack = socks_auth(port, "jack", "j");
+    dfd = daemon_accept(lfd);
+    requests = daemon_read(dfd, 1);
+    CHECK(requests.begin()->second == "jack");
+    daemon_write(dfd, strfmt("%llu FAIL\n", (unsigned long long)requests.begin()->first));
+    CHECK(auth_reply(jack) == 1);
+    ::close(jack);
+
+    // decisions are cached, the daemon is not asked again
+    ivy = socks_auth(port, "ivy", "i");
+    CHECK(auth_reply(ivy) == 0);
+    ::close(ivy);
+    jack = socks_auth(port, "jack", "j");
+    CHECK(auth_reply(jack) == 1);
+    ::close(jack);
+}
+
+// a reload while the daemon decides: the answer is used but not cached
+static void test_cache_reload(Proxy &proxy, int dfd) {
+    int kim = socks_auth(proxy.port, "kim", "k");
+    std::map<uint64_t, std::string> requests = daemon_read(dfd, 1);
+    proxy.cache.clear();
+    daemon_write(dfd, strfmt("%llu OK\n", (unsigned long long)requests.begin()->first));
+    CHECK(auth_reply(kim) == 0);
+    ::close(kim);
+
+    kim = socks_auth(proxy.port, "kim", "k");
+    requests = daemon_read(dfd, 1);
+    CHECK(requests.begin()->second == "kim");
+    daemon_write(dfd, strfmt("%llu OK\n", (unsigned long long)requests.begin()->first));
+    CHECK(auth_reply(kim) == 0);
+    ::close(kim);
+    ::close(dfd);
+}
+
+// the same with the cache alone, decided before and stored after clear()
+static void test_cache_generation() {
+    DefaultServerHandler inner;
+    CachingServerHandler cache;
+    cache.inner = &inner;
+    cache.capacity = 16;
+    CHECK(cache.init().ok());
+    CachingServerHandler::Key key = cache.make_key("u", 1, "p", 1);
+
+    uint64_t generation = 0;
+    CHECK(cache.lookup(key, 1, generation) == -1);
+    cache.clear();
+    cache.store(key, true, 1, generation);
+    CHECK(cache.lookup(key, 1, generation) == -1);
+    cache.store(key, true, 1, generation);
+    CHECK(cache.lookup(key, 2, generation) == 1);
+    cache.clear();
+    CHECK(cache.lookup(key, 2, generation) == -1);
+}
+
+static void wait_idle(Proxy &proxy) {
+    // sessions are gone once the daemon connection is
+    for (int i = 0; i < 100 && proxy.server->clients() > 0; ++i) {
+        ::usleep(10000);
+    }
+    stop_proxy(proxy);
+    CHECK(proxy.server->clients() == 0);
+}
+
+int main() {
+    int lfd = daemon_listen();
+    Proxy proxy;
+    start_proxy(proxy, false);
+    int dfd = -1;
+    test_out_of_order(proxy.port, lfd, dfd);
+    test_timeout(proxy.port, dfd);
+    test_restart(proxy.port, lfd, dfd);
+    wait_idle(proxy);
+    CHECK(proxy.server->stats.auth_timeouts == 1);
+
+    Proxy cached;
+    start_proxy(cached, true);
+    test_cache_skips_errors(cached.port, lfd, dfd);
+    test_cache_reload(cached, dfd);
+    wait_idle(cached);
+    CHECK(cached.cache.hits == 2);
+    ::close(lfd);
+    ::unlink(k_path);
+
+    test_cache_generation();
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,127 @@
+// HMAC-SHA256 and PBKDF2-HMAC-SHA256 against RFC 4231 and RFC 7914 vectors, and
+// CredentialStore: hashed, legacy and plain users of a file, empty names, unknown users.
+
+#include <cstdio>
+#include <string>
+
+#include "testing.hpp"
+#include "credentials.h"
+#include "crypto_util.h"
+
+
+using namespace evsocks;
+
+
+static const char k_path[] = "/tmp/evsocks_test_users";
+
+static std::string to_hex(const uint8_t *data, size_t size) {
+    std::string hex;
+    append_hex(hex, data, size);
+    return hex;
+}
+
+static void test_hmac() {
+    uint8_t out[Sha256::k_size];
+    std::string key(20, '\x0b');
+    HmacSha256(key.data(), key.size()).mac("Hi There", 8, out);
+    CHECK(to_hex(out, sizeof(out)) == "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7");
+
+    // hashed into the pad
+    key.assign(131, '\xaa');
+    std::string data = "Test Using Larger Than Block-Size Key - Hash Key First";
+    HmacSha256(key.data(), key.size()).mac(data.data(), data.size(), out);
+    CHECK(to_hex(out, sizeof(out)) == "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54");
+}
+
+static void test_pbkdf2() {
+    // 2 blocks
+    uint8_t out[64];
+    pbkdf2_sha256("passwd", 6, "salt", 4, 1, out, sizeof(out));
+    CHECK(to_hex(out, sizeof(out)) ==
+        "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc"
+        "49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783");
+    pbkdf2_sha256("Password", 8, "NaCl", 4, 80000, out, sizeof(out));
+    CHECK(to_hex(out, sizeof(out)) ==
+        "4ddcd8f60b98be21830cee5ef22701f9641a4418d04c0414aeff08876b34ab56"
+        "a1d425a1225833549adb841b51c9b3176a272bdebba1d078478f62b397f33c8d");
+    pbkdf2_sha256("password", 8, "salt", 4, 4096, out, 32);
+    CHECK(to_hex(out, 32) == "c5e478d59288c841aa530db6845c4c8d962893a001ce4e11a4963873aa98134a");
+}
+
+static bool verify(const CredentialStore &creds, const std::string &user, const std::string &pass) {
+    return creds.verify(user.data(), user.size(), pass.data(), pass.size());
+}
+
+static void write_file(const std::string &content) {
+    FILE *file = ::fopen(k_path, "w");
+    CHECK(file != NULL);
+    CHECK(::fwrite(content.data(), 1, content.size(), file) == content.size());
+    ::fclose(file);
+}
+
+static void test_store() {
+    std::string hashed;
+    CHECK(CredentialStore::hash_password("alice pw", 1000, hashed).ok());
+    CHECK(hashed.compare(0, 11, "$p256$1000$") == 0);
+    // salt "0123456789abcdef", SHA-256 of salt + "bob pw"
+    uint8_t digest[Sha256::k_size];
+    Sha256::hash("0123456789abcdefbob pw", 22, digest);
+    std::string legacy = "$s256$30313233343536373839616263646566$" + to_hex(digest, sizeof(digest));
+
+    write_file("# users\n\nalice:" + hashed + "\r\nbob:" + legacy + "\ncarol:carol pw\ncarol:new pw\n");
+    CredentialStore creds;
+    creds.iterations = 100;
+    CHECK(creds.load(k_path).ok());
+    creds.build();
+    CHECK(creds.size() == 4);
+    CHECK(verify(creds, "alice", "alice pw"));
+    CHECK(!verify(creds, "alice", "alice pW"));
+    CHECK(verify(creds, "bob", "bob pw"));
+    CHECK(!verify(creds, "bob", "bob"));
+    // the later line wins
+    CHECK(verify(creds, "carol", "new pw"));
+    CHECK(!verify(creds, "carol", "carol pw"));
+    CHECK(!verify(creds, "dave", ""));
+    CHECK(creds.nobody_iterations == 1000);
+
+    const char *bad[] = {
+        "x:$p256$$00$00\n",
+        "x:$p256$-1$30313233343536373839616263646566$00\n",
+        "x:$p256$99999999999$30313233343536373839616263646566$00\n",
+        "x:$p256$10$3031$00\n",
+        "x:$s256$30313233343536373839616263646566\n",
+        ":nobody\n",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        write_file(bad[i]);
+        CredentialStore other;
+        CHECK(!other.load(k_path).ok());
+    }
+    ::unlink(k_path);
+}
+
+// -u "" -p "": the name buffer stays empty
+static void test_empty_names() {
+    CredentialStore creds;
+    creds.iterations = 10;
+    CHECK(creds.add("", "pw").ok());
+    CHECK(creds.add("", "").ok());
+    creds.build();
+    CHECK(creds.names.empty());
+    CHECK(verify(creds, "", ""));
+    CHECK(!verify(creds, "", "pw"));
+    CHECK(!verify(creds, "x", ""));
+
+    CredentialStore none;
+    none.build();
+    CHECK(!verify(none, "", ""));
+}
+
+int main() {
+    test_hmac();
+    test_pbkdf2();
+    test_store();
+    test_empty_names();
+    printf("OK\n");
+    return 0;
+}
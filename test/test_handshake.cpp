@@ -0,0 +1,288 @@
+// The SOCKS handshake parser against a real Server: greeting, auth and connect cmd
+// pipelined in one read or split at every byte, the shortest username/password
+// requests, and clients reset while their replies are corked. The proxy runs on its
+// own loop thread, the clients and the remote are blocking sockets of the main thread.
+
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <netinet/tcp.h>
+
+#include <boost/bind/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "testing.hpp"
+#include "server.h"
+#include "credentials.h"
+
+
+using namespace evsocks;
+
+
+struct Proxy {
+    struct ev_loop *loop;
+    PasswordServerHandler handler;
+    Server *server;
+    ev_async stop_async;
+    boost::thread *thread;
+    uint16_t port;
+};
+
+static void stop_async_cb(EV_P_ ev_async *w, int revents) {
+    (void)w;
+    (void)revents;
+    ev_break(EV_A_ EVBREAK_ALL);
+}
+
+static void proxy_main(Proxy *proxy) {
+    ev_run(proxy->loop, 0);
+}
+
+static void start_proxy(Proxy &proxy) {
+    boost::shared_ptr<CredentialStore> creds = boost::make_shared<CredentialStore>();
+    CHECK(creds->add("user", "secret").ok());
+    CHECK(creds->add("e", "").ok());
+    creds->build();
+    proxy.handler.set_credentials(creds);
+
+    proxy.loop = ev_loop_new(EVFLAG_AUTO);
+    proxy.server = new Server(proxy.loop, &proxy.handler);
+    CHECK(proxy.server->init().ok());
+    CHECK(proxy.server->start_listen("127.0.0.1", 0).ok());
+
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    CHECK(::getsockname(proxy.server->listen_fd, (struct sockaddr *)&sa, &len) == 0);
+    proxy.port = ntohs(sa.sin_port);
+
+    ev_async_init(&proxy.stop_async, stop_async_cb);
+    ev_async_start(proxy.loop, &proxy.stop_async);
+    proxy.thread = new boost::thread(boost::bind(proxy_main, &proxy));
+}
+
+static void stop_proxy(Proxy &proxy) {
+    ev_async_send(proxy.loop, &proxy.stop_async);
+    proxy.thread->join();
+    delete proxy.thread;
+}
+
+static void set_timeout(int fd) {
+    struct timeval tv = {5, 0};
+    CHECK(::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+}
+
+static int listen_remote(uint16_t &port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    struct sockaddr_in sa;
+    ::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(::bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+    CHECK(::listen(fd, 128) == 0);
+    socklen_t len = sizeof(sa);
+    CHECK(::getsockname(fd, (struct sockaddr *)&sa, &len) == 0);
+    port = ntohs(sa.sin_port);
+    set_timeout(fd);
+    return fd;
+}
+
+static int connect_proxy(uint16_t port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    struct sockaddr_in sa;
+    ::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(port);
+    CHECK(::connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+    int one = 1;
+    CHECK(::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0);
+    set_timeout(fd);
+    return fd;
+}
+
+static std::string userpass(const std::string &user, const std::string &pass) {
+    std::string req("\x01", 1);
+    req += (char)user.size();
+    req += user;
+    req += (char)pass.size();
+    req += pass;
+    return req;
+}
+
+static std::string connect_cmd(uint16_t port) {
+    std::string cmd("\x05\x01\x00\x01\x7f\x00\x00\x01", 8);
+    cmd += (char)(port >> 8);
+    cmd += (char)(port & 0xff);
+    return cmd;
+}
+
+static const std::string k_greeting("\x05\x01\x02", 3);
+static const std::string k_payload("hello");
+
+// writes the parts apart, so that each arrives in its own read
+static void write_parts(int fd, const std::vector<std::string> &parts) {
+    for (size_t i = 0; i < parts.size(); ++i) {
+        if (i > 0) {
+            ::usleep(2000);
+        }
+        CHECK(::write(fd, parts[i].data(), parts[i].size()) == (ssize_t)parts[i].size());
+    }
+}
+
+// status of the auth reply after the method reply, -1 if closed without one
+static int read_auth(int fd) {
+    char reply[4];
+    if (::recv(fd, reply, 4, MSG_WAITALL) != 4) {
+        return -1;
+    }
+    CHECK(reply[0] == 0x05 && reply[1] == 0x02);
+    CHECK(reply[2] == 0x01);
+    return reply[3];
+}
+
+// the connect reply, then the payload sent after the cmd reaches the remote
+static void check_connected(int fd, int rfd) {
+    int remote = ::accept(rfd, NULL, NULL);
+    CHECK(remote >= 0);
+    set_timeout(remote);
+    char reply[10];
+    CHECK(::recv(fd, reply, sizeof(reply), MSG_WAITALL) == (ssize_t)sizeof(reply));
+    CHECK(reply[0] == 0x05 && reply[1] == 0x00 && reply[3] == 0x01);
+
+    char buf[16];
+    CHECK(::recv(remote, buf, k_payload.size(), MSG_WAITALL) == (ssize_t)k_payload.size());
+    CHECK(std::string(buf, k_payload.size()) == k_payload);
+    ::close(remote);
+}
+
+static std::vector<std::string> split(const std::string &data, const std::vector<size_t> &cuts) {
+    std::vector<std::string> parts;
+    size_t pos = 0;
+    for (size_t i = 0; i < cuts.size(); ++i) {
+        parts.push_back(data.substr(pos, cuts[i] - pos));
+        pos = cuts[i];
+    }
+    parts.push_back(data.substr(pos));
+    return parts;
+}
+
+static void test_pipelined(uint16_t port, int rfd, uint16_t rport) {
+    std::string data = k_greeting + userpass("user", "secret") + connect_cmd(rport) + k_payload;
+    int fd = connect_proxy(port);
+    CHECK(::write(fd, data.data(), data.size()) == (ssize_t)data.size());
+    CHECK(read_auth(fd) == 0);
+    check_connected(fd, rfd);
+    ::close(fd);
+}
+
+// cut once at every offset, then every byte on its own
+static void test_split(uint16_t port, int rfd, uint16_t rport) {
+    std::string data = k_greeting + userpass("user", "secret") + connect_cmd(rport) + k_payload;
+    size_t handshake = data.size() - k_payload.size();
+    for (size_t cut = 1; cut <= handshake; ++cut) {
+        int fd = connect_proxy(port);
+        write_parts(fd, split(data, std::vector<size_t>(1, cut)));
+        CHECK(read_auth(fd) == 0);
+        check_connected(fd, rfd);
+        ::close(fd);
+    }
+
+    std::vector<size_t> cuts;
+    for (size_t i = 1; i < data.size(); ++i) {
+        cuts.push_back(i);
+    }
+    int fd = connect_proxy(port);
+    write_parts(fd, split(data, cuts));
+    CHECK(read_auth(fd) == 0);
+    check_connected(fd, rfd);
+    ::close(fd);
+}
+
+// 3 bytes with an empty user and password, 4 bytes with an empty password
+static void test_short_userpass(uint16_t port, int rfd, uint16_t rport) {
+    std::string empty = userpass("", "");
+    CHECK(empty.size() == 3);
+    int fd = connect_proxy(port);
+    std::string data = k_greeting + empty;
+    CHECK(::write(fd, data.data(), data.size()) == (ssize_t)data.size());
+    CHECK(read_auth(fd) == 1);
+    ::close(fd);
+
+    std::string no_pass = userpass("e", "");
+    CHECK(no_pass.size() == 4);
+    for (size_t cut = 0; cut < no_pass.size(); ++cut) {
+        fd = connect_proxy(port);
+        std::vector<std::string> parts;
+        parts.push_back(k_greeting + no_pass.substr(0, cut));
+        parts.push_back(no_pass.substr(cut) + connect_cmd(rport) + k_payload);
+        write_parts(fd, parts);
+        CHECK(read_auth(fd) == 0);
+        check_connected(fd, rfd);
+        ::close(fd);
+    }
+
+    // a bad version is refused once its first byte is in
+    fd = connect_proxy(port);
+    data = k_greeting + "\x02";
+    CHECK(::write(fd, data.data(), data.size()) == (ssize_t)data.size());
+    CHECK(read_auth(fd) == -1);
+    ::close(fd);
+}
+
+// reset right after the pipelined handshake, before or after the replies are flushed
+static void test_reset_while_corked(Proxy &proxy, int rfd, uint16_t rport) {
+    std::string data = k_greeting + userpass("user", "secret") + connect_cmd(rport) + k_payload;
+    for (int i = 0; i < 20; ++i) {
+        int fd = connect_proxy(proxy.port);
+        struct linger lin;
+        lin.l_onoff = 1;
+        lin.l_linger = 0;
+        CHECK(::setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin)) == 0);
+        CHECK(::write(fd, data.data(), data.size()) == (ssize_t)data.size());
+        ::usleep(i * 100);
+        ::close(fd);
+    }
+    // the remotes that got connected are dropped with their clients
+    CHECK(::fcntl(rfd, F_SETFL, O_NONBLOCK) == 0);
+    for (int i = 0; i < 500 && proxy.server->clients() > 0; ++i) {
+        ::usleep(10000);
+        int remote;
+        while ((remote = ::accept(rfd, NULL, NULL)) >= 0) {
+            ::close(remote);
+        }
+    }
+    CHECK(::fcntl(rfd, F_SETFL, 0) == 0);
+    CHECK(proxy.server->clients() == 0);
+
+    // still serving
+    int fd = connect_proxy(proxy.port);
+    CHECK(::write(fd, data.data(), data.size()) == (ssize_t)data.size());
+    CHECK(read_auth(fd) == 0);
+    check_connected(fd, rfd);
+    ::close(fd);
+}
+
+int main() {
+    ::signal(SIGPIPE, SIG_IGN);
+    Proxy proxy;
+    start_proxy(proxy);
+    uint16_t rport = 0;
+    int rfd = listen_remote(rport);
+
+    test_pipelined(proxy.port, rfd, rport);
+    test_split(proxy.port, rfd, rport);
+    test_short_userpass(proxy.port, rfd, rport);
+    test_reset_while_corked(proxy, rfd, rport);
+
+    for (int i = 0; i < 100 && proxy.server->clients() > 0; ++i) {
+        ::usleep(10000);
+    }
+    stop_proxy(proxy);
+    CHECK(proxy.server->clients() == 0);
+    ::close(rfd);
+    printf("OK\n");
+    return 0;
+}
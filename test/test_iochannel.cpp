@@ -0,0 +1,211 @@
+// IOChannel splice mode: many small segments use up the pipe buffers long before
+// pipe.cap bytes, the producer must pause instead of spinning on EAGAIN.
+// Corked writes: gathered into one writev(), or dropped with the error of a reset peer.
+
+#include <signal.h>
+#include <netinet/tcp.h>
+
+#include "testing.hpp"
+#include "iochannel.h"
+#include "pipepool.h"
+
+
+using namespace evsocks;
+using namespace testing;
+
+
+static const size_t k_segments = 2000;
+
+struct Relay {
+    IOChannel chan;
+    ev_io producer;
+    ev_io consumer;
+    ev_io sink;         // peer of the consumer
+    size_t splices;     // producer callbacks
+    size_t received;    // by sink
+    size_t expected;
+
+    Relay() : splices(0), received(0), expected(0) {}
+};
+
+static void producer_cb(EV_P_ ev_io *w, int revents) {
+    (void)revents;
+    Relay &relay = *(Relay *)w->data;
+    relay.splices++;
+    bool eof = false;
+    CHECK(relay.chan.splice_from(w->fd, eof).ok());
+    CHECK(!eof);
+}
+
+static void consumer_cb(EV_P_ ev_io *w, int revents) {
+    (void)revents;
+    Relay &relay = *(Relay *)w->data;
+    CHECK(relay.chan.on_write().ok());
+}
+
+static void sink_cb(EV_P_ ev_io *w, int revents) {
+    (void)revents;
+    Relay &relay = *(Relay *)w->data;
+    char buf[65536];
+    ssize_t n = ::read(w->fd, buf, sizeof(buf));
+    if (n > 0) {
+        relay.received += (size_t)n;
+    }
+    if (relay.received == relay.expected) {
+        ev_break(EV_A_ EVBREAK_ALL);
+    }
+}
+
+static void test_splice_pause(struct ev_loop *loop) {
+    int src_w, src_r, dst_w, dst_r;
+    tcp_pair(src_w, src_r);
+    tcp_pair(dst_w, dst_r);
+    int one = 1;
+    CHECK(::setsockopt(src_w, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0);
+
+    // consumer can not take more
+    char fill[65536];
+    ::memset(fill, 'f', sizeof(fill));
+    size_t prefill = 0;
+    for (;;) {
+        ssize_t n = ::write(dst_w, fill, sizeof(fill));
+        if (n < 0) {
+            CHECK(errno == EAGAIN);
+            break;
+        }
+        prefill += (size_t)n;
+    }
+
+    // one skb per segment, mostly
+    for (size_t i = 0; i < k_segments; ++i) {
+        CHECK(::write(src_w, "x", 1) == 1);
+        if (i % 8 == 0) {
+            ::usleep(50);
+        }
+    }
+
+    PipePool pipes;
+    Pipe pipe;
+    CHECK(pipes.acquire(pipe).ok());
+
+    Relay relay;
+    relay.expected = prefill + k_segments;
+    relay.chan.init(loop, 65536);
+    relay.chan.set_pipe(pipe);
+    ev_io_init(&relay.producer, producer_cb, src_r, EV_READ);
+    ev_io_init(&relay.consumer, consumer_cb, dst_w, EV_WRITE);
+    ev_io_init(&relay.sink, sink_cb, dst_r, EV_READ);
+    relay.producer.data = relay.consumer.data = relay.sink.data = &relay;
+    relay.chan.producer = &relay.producer;
+    relay.chan.consumer = &relay.consumer;
+
+    // the pipe fills up with far less than its capacity, then the producer is paused
+    ev_io_start(loop, &relay.producer);
+    run_for(loop, 0.3);
+    printf("stalled: [splices:%zu][pipe_bytes:%zu][cap:%zu]\n", relay.splices, relay.chan.pipe_bytes, pipe.cap);
+    CHECK(relay.splices < 10);
+    CHECK(!ev_is_active(&relay.producer));
+    CHECK(relay.chan.pipe_full);
+    CHECK(relay.chan.is_full());
+    CHECK(relay.chan.pipe_bytes > 0);
+    CHECK(relay.chan.pipe_bytes < pipe.cap);
+
+    // draining the consumer resumes the producer until everything is relayed
+    ev_io_start(loop, &relay.sink);
+    run_for(loop, 10);
+    printf("drained: [splices:%zu][received:%zu][expected:%zu]\n", relay.splices, relay.received, relay.expected);
+    CHECK(relay.received == relay.expected);
+    CHECK(relay.chan.empty());
+    CHECK(!relay.chan.pipe_full);
+
+    ev_io_stop(loop, &relay.producer);
+    ev_io_stop(loop, &relay.consumer);
+    ev_io_stop(loop, &relay.sink);
+    pipes.release(pipe, true);
+    ::close(src_w);
+    ::close(src_r);
+    ::close(dst_w);
+    ::close(dst_r);
+}
+
+static void noop_cb(EV_P_ ev_io *w, int revents) {
+    (void)w;
+    (void)revents;
+}
+
+// the handshake replies, written while corked, leave with one writev()
+static void test_cork(struct ev_loop *loop) {
+    int w, r;
+    tcp_pair(w, r);
+    IOStats stats;
+    IOChannel chan;
+    ev_io consumer;
+    chan.init(loop, 65536, &stats);
+    ev_io_init(&consumer, noop_cb, w, EV_WRITE);
+    chan.consumer = &consumer;
+
+    chan.cork();
+    CHECK(chan.write("\x05\x02", 2).ok());
+    CHECK(chan.write("\x01\x00", 2).ok());
+    CHECK(chan.write("\x05\x00\x00\x01\x7f\x00\x00\x01\x04\x38", 10).ok());
+    CHECK(stats.syscalls == 0);
+    CHECK(!ev_is_active(&consumer));
+    char buf[64];
+    CHECK(::recv(r, buf, sizeof(buf), MSG_DONTWAIT) == -1 && errno == EAGAIN);
+
+    CHECK(chan.uncork().ok());
+    CHECK(stats.syscalls == 1);
+    CHECK(stats.relayed == 14);
+    CHECK(chan.empty());
+    CHECK(!ev_is_active(&consumer));
+    run_for(loop, 0.05);
+    CHECK(::recv(r, buf, sizeof(buf), MSG_DONTWAIT) == 14);
+    CHECK(buf[0] == 0x05 && buf[2] == 0x01 && buf[4] == 0x05);
+
+    // uncorked, writes go out at once again
+    CHECK(chan.write("x", 1).ok());
+    CHECK(stats.syscalls == 2);
+    ::close(w);
+    ::close(r);
+}
+
+// the peer is gone by the time the replies are flushed: uncork() fails without
+// leaving the consumer started
+static void test_cork_reset(struct ev_loop *loop) {
+    int w, r;
+    tcp_pair(w, r);
+    struct linger lin;
+    lin.l_onoff = 1;
+    lin.l_linger = 0;
+    CHECK(::setsockopt(r, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin)) == 0);
+    ::close(r);
+    run_for(loop, 0.05);
+
+    IOStats stats;
+    IOChannel chan;
+    ev_io consumer;
+    chan.init(loop, 65536, &stats);
+    ev_io_init(&consumer, noop_cb, w, EV_WRITE);
+    chan.consumer = &consumer;
+
+    chan.cork();
+    CHECK(chan.write("\x05\x02", 2).ok());
+    CHECK(chan.write("\x01\x00", 2).ok());
+    Error err = chan.uncork();
+    CHECK(!err.ok());
+    CHECK(err.type() == ERR_WRITE);
+    CHECK(stats.syscalls == 1);
+    CHECK(!chan.corked);
+    CHECK(!ev_is_active(&consumer));
+    ::close(w);
+}
+
+int main() {
+    ::signal(SIGPIPE, SIG_IGN);
+    struct ev_loop *loop = ev_default_loop(0);
+    test_splice_pause(loop);
+    test_cork(loop);
+    test_cork_reset(loop);
+    printf("OK\n");
+    return 0;
+}
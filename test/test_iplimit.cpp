@@ -0,0 +1,147 @@
+// IpLimiter: a full table rejects new IPs instead of admitting them uncounted,
+// sweeps across the end of the table, and hosts split over shards.
+
+#include "testing.hpp"
+#include "iplimit.h"
+
+
+using namespace evsocks;
+
+
+static Addr ip(uint32_t n) {
+    char data[4] = {10, (char)(n >> 16), (char)(n >> 8), (char)n};
+    return Addr::from_ipv4(data, 1080);
+}
+
+static void test_full_table() {
+    IpLimiter limits;
+    limits.max_sessions = 2;
+    limits.capacity = 12;
+    limits.init();
+    ev_tstamp now = 100;
+
+    uint32_t n = 0;
+    while (limits.acquire(ip(n), now) == IpLimiter::ADMIT) {
+        ++n;
+    }
+    CHECK(n >= limits.capacity);
+    CHECK(limits.tracked() == n);
+    // still full after the sweep, every host holds a session
+    now += 2;
+    CHECK(limits.acquire(ip(n), now) == IpLimiter::TABLE_FULL);
+    // known hosts are still limited
+    CHECK(limits.acquire(ip(0), now) == IpLimiter::ADMIT);
+    CHECK(limits.acquire(ip(0), now) == IpLimiter::TOO_MANY_SESSIONS);
+
+    // an idle host makes room
+    limits.release(ip(1), now);
+    CHECK(limits.tracked() == n - 1);
+    CHECK(limits.acquire(ip(n), now) == IpLimiter::ADMIT);
+    CHECK(limits.acquire(ip(n + 1), now) == IpLimiter::TABLE_FULL);
+}
+
+static void test_rate_kept_while_full() {
+    IpLimiter limits;
+    limits.rate = 1;
+    limits.capacity = 12;
+    limits.init();
+    ev_tstamp now = 100;
+
+    uint32_t n = 0;
+    while (limits.acquire(ip(n), now) == IpLimiter::ADMIT) {
+        limits.release(ip(n), now);
+        ++n;
+    }
+    // buckets not refilled yet, nothing to sweep
+    CHECK(limits.acquire(ip(n), now + 0.5) == IpLimiter::TABLE_FULL);
+    CHECK(limits.acquire(ip(0), now + 0.5) == IpLimiter::TOO_FAST);
+    // refilled, swept
+    CHECK(limits.acquire(ip(n), now + 2) == IpLimiter::ADMIT);
+    CHECK(limits.tracked() == 1);
+}
+
+// first host after start whose home slot is slot
+static uint32_t ip_at(IpLimiter &limits, size_t slot, uint32_t start) {
+    for (uint32_t n = start;; ++n) {
+        Addr addr = ip(n);
+        if (limits.slot_of(limits.hash(addr.ip_data(), addr.ip_size())) == slot) {
+            return n;
+        }
+    }
+}
+
+// a cluster wrapping from the last slot: every erase shifts the next entry into the
+// slot just checked
+static void test_sweep_wraps() {
+    IpLimiter limits;
+    limits.rate = 1;
+    limits.capacity = 12;
+    limits.init();
+    CHECK(limits.shard_mask == 0);
+    CHECK(limits.mask == 15);
+    ev_tstamp now = 100;
+
+    uint32_t a = ip_at(limits, 15, 0);
+    uint32_t b = ip_at(limits, 15, a + 1);
+    uint32_t c = ip_at(limits, 0, 0);
+    uint32_t d = ip_at(limits, 0, c + 1);
+    uint32_t hosts[] = {a, b, c, d};
+    for (int i = 0; i < 4; ++i) {
+        CHECK(limits.acquire(ip(hosts[i]), now) == IpLimiter::ADMIT);
+    }
+    IpLimiter::Shard &shard = limits.shards[0];
+    CHECK(shard.slots[15].ip_size != 0 && shard.slots[0].ip_size != 0 && shard.slots[1].ip_size != 0);
+    CHECK(shard.slots[2].ip_size != 0);
+
+    // a, b and c out of tokens, d still holding its session
+    for (int i = 0; i < 3; ++i) {
+        limits.release(ip(hosts[i]), now);
+    }
+    CHECK(limits.tracked() == 4);
+    limits.sweep(shard, now + 2);
+    CHECK(limits.tracked() == 1);
+    CHECK(shard.slots[0].ip_size != 0);
+    for (size_t i = 1; i < shard.slots.size(); ++i) {
+        CHECK(shard.slots[i].ip_size == 0);
+    }
+    CHECK(limits.acquire(ip(d), now + 2) == IpLimiter::ADMIT);
+    limits.release(ip(d), now + 2);
+    limits.release(ip(d), now + 2);
+    // out of tokens again
+    CHECK(limits.tracked() == 1);
+    limits.sweep(shard, now + 4);
+    CHECK(limits.tracked() == 0);
+}
+
+// each host stays in its shard, all shards count
+static void test_shards() {
+    IpLimiter limits;
+    limits.max_sessions = 1;
+    limits.capacity = 16384;
+    limits.init();
+    CHECK(limits.shard_mask == IpLimiter::k_max_shards - 1);
+
+    ev_tstamp now = IpLimiter::clock();
+    const uint32_t hosts = 10000;
+    for (uint32_t n = 0; n < hosts; ++n) {
+        CHECK(limits.acquire(ip(n), now) == IpLimiter::ADMIT);
+    }
+    CHECK(limits.tracked() == hosts);
+    for (size_t i = 0; i <= limits.shard_mask; ++i) {
+        CHECK(limits.shards[i].size > 0);
+    }
+    for (uint32_t n = 0; n < hosts; ++n) {
+        CHECK(limits.acquire(ip(n)) == IpLimiter::TOO_MANY_SESSIONS);
+        limits.release(ip(n));
+    }
+    CHECK(limits.tracked() == 0);
+}
+
+int main() {
+    test_full_table();
+    test_rate_kept_while_full();
+    test_sweep_wraps();
+    test_shards();
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,154 @@
+// Resolver cache eviction and waiter bookkeeping.
+
+#include "testing.hpp"
+#include "resolver.h"
+
+
+using namespace evsocks;
+using namespace testing;
+
+
+struct Results {
+    vector<uint64_t> tokens;
+    size_t expected;
+
+    Results() : expected(0) {}
+};
+
+static void done_cb(void *userdata, uint64_t token, const ResolveResult &res) {
+    (void)res;
+    Results &results = *(Results *)userdata;
+    results.tokens.push_back(token);
+    if (results.tokens.size() == results.expected) {
+        ev_break(ev_default_loop(0), EVBREAK_ALL);
+    }
+}
+
+static bool cached(Resolver &resolver, const string &name) {
+    boost::lock_guard<boost::mutex> lock(resolver.mutex);
+    return resolver.cache.count(name) > 0;
+}
+
+static void test_evict_soonest_expiry() {
+    Resolver resolver;
+    resolver.max_entries = 3;
+    ResolveResult res;
+    ev_tstamp now = ev_time();
+    {
+        boost::lock_guard<boost::mutex> lock(resolver.mutex);
+        resolver.put_cache("a", res, now + 30);
+        resolver.put_cache("b", res, now + 10);
+        resolver.put_cache("c", res, now + 20);
+        // refreshed, no longer the first to expire
+        resolver.put_cache("b", res, now + 50);
+        resolver.put_cache("d", res, now + 40);
+        CHECK(resolver.cache.size() == 3);
+        CHECK(resolver.expires.size() == 3);
+    }
+    CHECK(cached(resolver, "a"));
+    CHECK(cached(resolver, "b"));
+    CHECK(!cached(resolver, "c"));
+    CHECK(cached(resolver, "d"));
+
+    {
+        boost::lock_guard<boost::mutex> lock(resolver.mutex);
+        resolver.put_cache("e", res, now + 60);
+    }
+    CHECK(!cached(resolver, "a"));
+    CHECK(cached(resolver, "e"));
+}
+
+static bool idle(Resolver &resolver) {
+    for (int i = 0; i < 500; ++i) {
+        {
+            boost::lock_guard<boost::mutex> lock(resolver.mutex);
+            if (resolver.inflight.empty()) {
+                return true;
+            }
+        }
+        ::usleep(10000);
+    }
+    return false;
+}
+
+static void test_failed_prefetch_keeps_entry() {
+    Resolver resolver;
+    resolver.prefetch = 5;
+    CHECK(resolver.start(1).ok());
+
+    // does not resolve
+    const string name = "bad..name";
+    ResolveResult res;
+    res.addrs.push_back(Addr::from_ipv4("\x0a\x00\x00\x01", 0));
+    ev_tstamp expire = ev_time() + 2;
+    {
+        boost::lock_guard<boost::mutex> lock(resolver.mutex);
+        resolver.put_cache(name, res, expire);
+    }
+
+    // hit near expiry starts a refresh
+    ResolveResult hit;
+    CHECK(resolver.lookup(name, hit));
+    CHECK(hit.err == 0 && hit.addrs.size() == 1);
+    CHECK(idle(resolver));
+    {
+        boost::lock_guard<boost::mutex> lock(resolver.mutex);
+        const Resolver::Entry &entry = resolver.cache[name];
+        CHECK(entry.res.err == 0);
+        CHECK(entry.res.addrs.size() == 1);
+        CHECK(entry.expire == expire);
+    }
+    // and the next hit may refresh again
+    CHECK(resolver.lookup(name, hit));
+    CHECK(hit.err == 0);
+    CHECK(idle(resolver));
+
+    // without a positive entry the failure is cached
+    CHECK(!resolver.lookup("other..name", hit));
+    CHECK(idle(resolver));
+    CHECK(resolver.lookup("other..name", hit));
+    CHECK(hit.err != 0);
+
+    resolver.stop();
+}
+
+static void test_cancel_and_detach() {
+    struct ev_loop *loop = ev_default_loop(0);
+    Resolver resolver;
+
+    Results results;
+    ResolverPort port;
+    port.init(loop, done_cb, &results);
+
+    ResolveResult res;
+    results.expected = 2;
+    CHECK(!resolver.resolve(port, "10.0.0.1", 1, res));
+    CHECK(!resolver.resolve(port, "10.0.0.1", 2, res));
+    CHECK(!resolver.resolve(port, "10.0.0.2", 3, res));
+    resolver.cancel(port, 2);
+    // queries wait for the thread
+    CHECK(resolver.start(1).ok());
+    run_for(loop, 5);
+    CHECK(results.tokens.size() == 2);
+    CHECK(results.tokens[0] != 2 && results.tokens[1] != 2);
+    CHECK(cached(resolver, "10.0.0.1"));
+
+    // nothing is delivered to a detached port
+    CHECK(!resolver.resolve(port, "10.0.0.3", 4, res));
+    resolver.detach(port);
+    {
+        boost::lock_guard<boost::mutex> lock(resolver.mutex);
+        CHECK(resolver.waiting.empty());
+    }
+
+    resolver.stop();
+    port.stop();
+}
+
+int main() {
+    test_evict_soonest_expiry();
+    test_cancel_and_detach();
+    test_failed_prefetch_keeps_entry();
+    printf("OK\n");
+    return 0;
+}
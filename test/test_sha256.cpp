@@ -0,0 +1,71 @@
+// Sha256 against the FIPS 180-2 examples, one-shot and fed in pieces across blocks.
+
+#include <algorithm>
+#include <string>
+
+#include "testing.hpp"
+#include "sha256.h"
+#include "crypto_util.h"
+
+
+using namespace evsocks;
+
+
+static std::string digest_hex(const std::string &data) {
+    uint8_t digest[Sha256::k_size];
+    Sha256::hash(data.data(), data.size(), digest);
+    std::string hex;
+    append_hex(hex, digest, sizeof(digest));
+    return hex;
+}
+
+// update() with pieces of size step, crossing block boundaries in different places
+static std::string digest_hex(const std::string &data, size_t step) {
+    Sha256 ctx;
+    for (size_t pos = 0; pos < data.size(); pos += step) {
+        ctx.update(data.data() + pos, std::min(step, data.size() - pos));
+    }
+    uint8_t digest[Sha256::k_size];
+    ctx.final(digest);
+    std::string hex;
+    append_hex(hex, digest, sizeof(digest));
+    return hex;
+}
+
+struct Vector {
+    std::string data;
+    const char *digest;
+};
+
+int main() {
+    Vector vectors[4];
+    vectors[0].data = "";
+    vectors[0].digest = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+    vectors[1].data = "abc";
+    vectors[1].digest = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+    // 448 bits, the padding takes an extra block
+    vectors[2].data = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    vectors[2].digest = "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1";
+    // 15625 blocks
+    vectors[3].data = std::string(1000000, 'a');
+    vectors[3].digest = "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0";
+
+    const size_t steps[] = {1, 3, 55, 56, 63, 64, 65, 1000};
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+        CHECK(digest_hex(vectors[i].data) == vectors[i].digest);
+        if (vectors[i].data.size() > 100000) {
+            CHECK(digest_hex(vectors[i].data, 4096) == vectors[i].digest);
+            continue;
+        }
+        for (size_t j = 0; j < sizeof(steps) / sizeof(steps[0]); ++j) {
+            CHECK(digest_hex(vectors[i].data, steps[j]) == vectors[i].digest);
+        }
+    }
+
+    // lengths around the padding boundary
+    CHECK(digest_hex(std::string(55, 'a')) == "9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318");
+    CHECK(digest_hex(std::string(64, 'a')) == "ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb");
+
+    printf("OK\n");
+    return 0;
+}
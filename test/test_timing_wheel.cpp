@@ -0,0 +1,313 @@
+// TimingWheel: firing order, deadlines cascaded from level 1, coarse touches re-filed
+// when their slot fires, removals from the callback, and a randomized run against a
+// map of deadlines.
+
+#include <math.h>
+#include <map>
+#include <vector>
+
+#include "testing.hpp"
+#include "timing_wheel.hpp"
+
+
+using namespace evsocks;
+
+
+struct Obj {
+    int id;
+    TimeoutTracer tracer;
+
+    Obj() : id(0) {}
+};
+
+typedef EVSOCKS_TIMING_WHEEL(Obj, tracer) Wheel;
+
+static uint64_t fire_tick(ev_tstamp deadline, ev_tstamp tick) {
+    return (uint64_t)::ceil(deadline / tick);
+}
+
+
+// removes what fires, records the order
+struct Recorder {
+    Wheel *wheel;
+    std::vector<Obj *> *fired;
+
+    void operator()(Obj &obj) {
+        this->fired->push_back(&obj);
+        this->wheel->remove(obj);
+    }
+};
+
+static size_t advance(Wheel &wheel, ev_tstamp now, std::vector<Obj *> &fired) {
+    fired.clear();
+    Recorder rec;
+    rec.wheel = &wheel;
+    rec.fired = &fired;
+    wheel.each_timeouts(now, rec);
+    return fired.size();
+}
+
+// filed out of order, fired by deadline
+static void test_ordering() {
+    Wheel wheel(10, 1);
+    Obj objs[8];
+    for (int i = 0; i < 8; ++i) {
+        objs[i].id = i;
+        wheel.touch(0, objs[i], 8 - i);
+    }
+    CHECK(wheel.size == 8);
+
+    std::vector<Obj *> fired;
+    CHECK(advance(wheel, 4.5, fired) == 4);
+    for (int i = 0; i < 4; ++i) {
+        CHECK(fired[i]->id == 7 - i);
+    }
+    CHECK(advance(wheel, 100, fired) == 4);
+    for (int i = 0; i < 4; ++i) {
+        CHECK(fired[i]->id == 3 - i);
+    }
+    CHECK(wheel.size == 0);
+}
+
+// deadlines past level 0, past level 1, and exactly at the wheel boundaries
+static void test_cascade() {
+    const ev_tstamp timeouts[] = {1, 255, 256, 257, 300, 511, 512, 1000, 16383, 16384, 20000, 70000};
+    const size_t count = sizeof(timeouts) / sizeof(timeouts[0]);
+    Wheel wheel(10, 1);
+    Obj objs[count];
+    for (size_t i = 0; i < count; ++i) {
+        objs[i].id = (int)i;
+        wheel.touch(3, objs[i], timeouts[i]);
+    }
+
+    std::vector<Obj *> fired;
+    size_t done = 0;
+    for (ev_tstamp now = 4; done < count; now += 1) {
+        CHECK(now <= 3 + 70000);
+        advance(wheel, now, fired);
+        for (size_t i = 0; i < fired.size(); ++i) {
+            CHECK(now == 3 + timeouts[fired[i]->id]);
+            CHECK(fired[i]->id == (int)done);
+            done++;
+        }
+        CHECK(wheel.size == count - done);
+    }
+}
+
+// a later deadline keeps the object in its slot, the slot re-files it
+static void test_coarse_touch() {
+    Wheel wheel(10, 1);
+    Obj obj;
+    wheel.touch(0, obj);
+    CHECK(obj.tracer.tick == 10);
+    wheel.touch(5, obj);
+    CHECK(obj.tracer.tick == 10);
+    CHECK(obj.tracer.deadline == 15);
+    CHECK(wheel.size == 1);
+
+    std::vector<Obj *> fired;
+    CHECK(advance(wheel, 10, fired) == 0);
+    CHECK(obj.tracer.tick == 15);
+    CHECK(wheel.size == 1);
+    CHECK(advance(wheel, 14.5, fired) == 0);
+    CHECK(advance(wheel, 15, fired) == 1);
+    CHECK(wheel.size == 0);
+
+    // an earlier deadline moves it at once
+    wheel.touch(20, obj, 300);
+    wheel.touch(21, obj, 2);
+    CHECK(obj.tracer.tick == 23);
+    CHECK(advance(wheel, 23, fired) == 1);
+    CHECK(wheel.size == 0);
+}
+
+
+// removes the next due objects as well, or touches itself
+struct Remover {
+    Wheel *wheel;
+    Obj *others;
+    size_t count;
+    std::vector<Obj *> *fired;
+    ev_tstamp now;
+
+    void operator()(Obj &obj) {
+        this->fired->push_back(&obj);
+        if (obj.id == 0) {
+            for (size_t i = 1; i < this->count; ++i) {
+                this->wheel->remove(this->others[i]);
+            }
+            this->wheel->remove(obj);
+        } else {
+            this->wheel->touch(this->now, obj, 5);
+        }
+    }
+};
+
+static void test_remove_while_iterating() {
+    Wheel wheel(10, 1);
+    Obj objs[4];
+    for (int i = 0; i < 4; ++i) {
+        objs[i].id = i;
+        wheel.touch(0, objs[i], 3);
+    }
+    Obj later;
+    later.id = 9;
+    wheel.touch(0, later, 4);
+
+    std::vector<Obj *> fired;
+    Remover rm;
+    rm.wheel = &wheel;
+    rm.others = objs;
+    rm.count = 3;
+    rm.fired = &fired;
+    rm.now = 3;
+    wheel.each_timeouts(3, rm);
+    // 1 and 2 removed before they fired, 3 fired and touched itself
+    CHECK(fired.size() == 2);
+    CHECK(fired[0] == &objs[0]);
+    CHECK(fired[1] == &objs[3]);
+    CHECK(wheel.size == 2);
+    CHECK(objs[3].tracer.tick == 8);
+
+    CHECK(advance(wheel, 4, fired) == 1);
+    CHECK(fired[0] == &later);
+    CHECK(advance(wheel, 7.5, fired) == 0);
+    CHECK(advance(wheel, 8, fired) == 1);
+    CHECK(fired[0] == &objs[3]);
+    CHECK(wheel.size == 0);
+
+    // removing every object, force_term style
+    for (int i = 0; i < 4; ++i) {
+        wheel.touch(10, objs[i], 100 * i + 1);
+    }
+    CHECK(advance(wheel, INFINITY, fired) == 4);
+    CHECK(wheel.size == 0);
+}
+
+
+// reference model: the deadline of each filed object
+typedef std::map<Obj *, ev_tstamp> Model;
+
+struct Random {
+    uint32_t state;
+
+    explicit Random(uint32_t seed) : state(seed) {}
+
+    uint32_t next(uint32_t n) {
+        this->state = this->state * 1103515245 + 12345;
+        return (this->state >> 8) % n;
+    }
+};
+
+struct Checker {
+    Wheel *wheel;
+    Model *model;
+    Random *rnd;
+    Obj *objs;
+    size_t count;
+    ev_tstamp now;
+    uint64_t last;      // fire tick of the previous callback
+    size_t *fired;
+
+    void operator()(Obj &obj) {
+        Model::iterator it = this->model->find(&obj);
+        CHECK(it != this->model->end());
+        uint64_t k = fire_tick(it->second, this->wheel->tick);
+        CHECK(it->second <= this->now);
+        CHECK(k <= (uint64_t)(this->now / this->wheel->tick));
+        CHECK(k >= this->last);
+        this->last = k;
+        (*this->fired)++;
+
+        uint32_t r = this->rnd->next(10);
+        if (r < 2) {
+            // re-armed from the callback
+            ev_tstamp timeout = this->wheel->tick + 0.25 * this->rnd->next(200);
+            this->wheel->touch(this->now, obj, timeout);
+            it->second = this->now + timeout;
+            return;
+        }
+        this->model->erase(it);
+        this->wheel->remove(obj);
+        if (r < 5) {
+            // any other object, due in this slot or not
+            Obj &other = this->objs[this->rnd->next((uint32_t)this->count)];
+            this->model->erase(&other);
+            this->wheel->remove(other);
+        }
+    }
+};
+
+static void test_random(ev_tstamp tick, uint32_t seed) {
+    const size_t count = 300;
+    Wheel wheel(10, tick);
+    Obj objs[count];
+    Model model;
+    Random rnd(seed);
+    ev_tstamp now = 1000;
+
+    for (int step = 0; step < 200000; ++step) {
+        if (rnd.next(1000) == 0) {
+            now += 0.25 * rnd.next(8 * 1024);     // an idle loop
+        } else {
+            now += 0.25 * rnd.next(4);
+        }
+
+        uint32_t op = rnd.next(10);
+        Obj &obj = objs[rnd.next(count)];
+        if (op < 4) {
+            ev_tstamp timeout = tick;
+            switch (rnd.next(4)) {
+            case 0: timeout += 0.25 * rnd.next(64); break;
+            case 1: timeout += 0.25 * rnd.next(4 * 1024); break;
+            case 2: timeout += 0.25 * rnd.next(128 * 1024); break;
+            default: timeout = wheel.timeout; break;
+            }
+            wheel.touch(now, obj, timeout);
+            model[&obj] = now + timeout;
+        } else if (op < 5) {
+            wheel.remove(obj);
+            model.erase(&obj);
+        } else {
+            size_t fired = 0;
+            Checker checker;
+            checker.wheel = &wheel;
+            checker.model = &model;
+            checker.rnd = &rnd;
+            checker.objs = objs;
+            checker.count = count;
+            checker.now = now;
+            checker.last = 0;
+            checker.fired = &fired;
+            ev_tstamp next = wheel.each_timeouts(now, checker);
+
+            // everything due fired, the next check comes no later than the next deadline
+            uint64_t target = (uint64_t)(now / tick);
+            ev_tstamp earliest = INFINITY;
+            for (Model::iterator it = model.begin(); it != model.end(); ++it) {
+                uint64_t k = fire_tick(it->second, tick);
+                CHECK(k > target);
+                earliest = std::min(earliest, k * tick);
+            }
+            CHECK(next >= 0);
+            if (!model.empty()) {
+                CHECK(now + next <= earliest);
+            }
+        }
+        CHECK(wheel.size == model.size());
+    }
+}
+
+
+int main() {
+    test_ordering();
+    test_cascade();
+    test_coarse_touch();
+    test_remove_while_iterating();
+    test_random(1, 1);
+    test_random(0.5, 2);
+    test_random(0.25, 3);
+
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,335 @@
+// Uring against loopback sockets: multishot accept and recv, re-armed after a stop
+// and after the provided buffers run out, linked sends of an IOChannel including a
+// failed chain, and close() with sends still in flight.
+
+#include <string>
+#include <vector>
+
+#include "testing.hpp"
+#include "uring.h"
+#include "iochannel.h"
+
+
+using namespace evsocks;
+using namespace testing;
+
+
+static int listen_loopback(uint16_t &port) {
+    int lfd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    CHECK(lfd >= 0);
+    struct sockaddr_in sa;
+    ::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(::bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+    CHECK(::listen(lfd, 16) == 0);
+    socklen_t len = sizeof(sa);
+    CHECK(::getsockname(lfd, (struct sockaddr *)&sa, &len) == 0);
+    port = ntohs(sa.sin_port);
+    return lfd;
+}
+
+// completes against the backlog, accepted or not
+static int connect_loopback(uint16_t port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    struct sockaddr_in sa;
+    ::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(port);
+    CHECK(::connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+    return fd;
+}
+
+static std::string pattern(size_t size) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = (char)('a' + (i * 7 + i / 251) % 26);
+    }
+    return data;
+}
+
+
+struct Accepts {
+    std::vector<int> fds;
+    size_t expected;
+
+    Accepts() : expected(0) {}
+};
+
+static void accept_cb(void *userdata, int op, int res, const char *data) {
+    (void)data;
+    Accepts &accepts = *(Accepts *)userdata;
+    CHECK(op == Uring::OP_ACCEPT);
+    CHECK(res >= 0);
+    CHECK(::fcntl(res, F_GETFL) & O_NONBLOCK);
+    accepts.fds.push_back(res);
+    if (accepts.fds.size() == accepts.expected) {
+        ev_break(ev_default_loop(0), EVBREAK_ALL);
+    }
+}
+
+static void test_accept(struct ev_loop *loop, Uring &ring) {
+    uint16_t port = 0;
+    int lfd = listen_loopback(port);
+    Accepts accepts;
+    UringFile *file = ring.open(lfd, accept_cb, &accepts);
+    ring.start_accept(*file);
+
+    std::vector<int> clients;
+    for (int i = 0; i < 3; ++i) {
+        clients.push_back(connect_loopback(port));
+    }
+    accepts.expected = 3;
+    run_for(loop, 2);
+    CHECK(accepts.fds.size() == 3);
+    CHECK(ring.is_started(*file));
+
+    // started again before the cancel completes: the ECANCELED end of the multishot re-arms it
+    ring.stop(*file);
+    ring.start_accept(*file);
+    for (int i = 0; i < 3; ++i) {
+        clients.push_back(connect_loopback(port));
+    }
+    accepts.expected = 6;
+    run_for(loop, 2);
+    CHECK(accepts.fds.size() == 6);
+
+    // stopped: connections wait in the backlog until the next start
+    ring.stop(*file);
+    run_for(loop, 0.1);
+    CHECK(!ring.is_started(*file));
+    clients.push_back(connect_loopback(port));
+    run_for(loop, 0.2);
+    CHECK(accepts.fds.size() == 6);
+    ring.start_accept(*file);
+    accepts.expected = 7;
+    run_for(loop, 2);
+    CHECK(accepts.fds.size() == 7);
+
+    CHECK(ring.close(file, NULL).ok());
+    for (size_t i = 0; i < clients.size(); ++i) {
+        ::close(clients[i]);
+        ::close(accepts.fds[i]);
+    }
+}
+
+
+struct Recvs {
+    std::string data;
+    size_t calls;
+    bool eof;
+
+    Recvs() : calls(0), eof(false) {}
+};
+
+static void recv_cb(void *userdata, int op, int res, const char *data) {
+    Recvs &recvs = *(Recvs *)userdata;
+    CHECK(op == Uring::OP_RECV);
+    CHECK(res >= 0);
+    recvs.calls++;
+    if (res == 0) {
+        recvs.eof = true;
+        ev_break(ev_default_loop(0), EVBREAK_ALL);
+        return;
+    }
+    CHECK(data != NULL);
+    recvs.data.append(data, (size_t)res);
+}
+
+// 2 buffers of 16 bytes: each multishot recv ends with ENOBUFS long before the data is in
+static void test_recv_enobufs(struct ev_loop *loop) {
+    Uring ring;
+    ring.buffers = 2;
+    ring.buffer_size = 16;
+    CHECK(ring.init(loop).ok());
+
+    int writer, reader;
+    tcp_pair(writer, reader);
+    Recvs recvs;
+    UringFile *file = ring.open(reader, recv_cb, &recvs);
+    ring.start_recv(*file);
+
+    std::string sent = pattern(4096);
+    CHECK(::write(writer, sent.data(), sent.size()) == (ssize_t)sent.size());
+    ::close(writer);
+    run_for(loop, 2);
+    CHECK(recvs.eof);
+    CHECK(recvs.data == sent);
+    CHECK(recvs.calls >= sent.size() / 16 + 1);
+    // eof ended the multishot for good
+    CHECK(!ring.is_started(*file));
+
+    CHECK(ring.close(file, NULL).ok());
+    run_for(loop, 0.1);
+    CHECK(ring.files == 0);
+}
+
+
+struct Sender {
+    IOChannel chan;
+    ev_io dummy;        // IOChannel wants a consumer, the ring replaces it
+    size_t completions;
+    size_t errors;
+
+    Sender() : completions(0), errors(0) {}
+};
+
+static void send_cb(void *userdata, int op, int res, const char *data) {
+    (void)data;
+    Sender &sender = *(Sender *)userdata;
+    CHECK(op == Uring::OP_SEND);
+    sender.completions++;
+    if (!sender.chan.on_sent(res).ok()) {
+        sender.errors++;
+    }
+}
+
+struct Sink {
+    std::string data;
+    size_t expected;
+};
+
+static void sink_cb(EV_P_ ev_io *w, int revents) {
+    (void)revents;
+    Sink &sink = *(Sink *)w->data;
+    char buf[65536];
+    ssize_t n = ::read(w->fd, buf, sizeof(buf));
+    if (n > 0) {
+        sink.data.append(buf, (size_t)n);
+    }
+    if (sink.data.size() == sink.expected) {
+        ev_break(EV_A_ EVBREAK_ALL);
+    }
+}
+
+static void init_sender(struct ev_loop *loop, Uring &ring, Sender &sender, int fd,
+                        UringFile::Cb cb = send_cb) {
+    sender.chan.init(loop, 64 * 1024 * 1024);
+    ev_io_init(&sender.dummy, NULL, fd, EV_WRITE);
+    sender.chan.consumer = &sender.dummy;
+    UringFile *file = ring.open(fd, cb, &sender);
+    sender.chan.set_uring(&ring, NULL, file);
+}
+
+// MSG_WAITALL sends to a socket with far less room: each send completes whole, in order
+static void test_send_chain(struct ev_loop *loop, Uring &ring) {
+    int writer, reader;
+    tcp_pair(writer, reader);
+    Sender sender;
+    init_sender(loop, ring, sender, writer);
+
+    std::string sent = pattern(40 * Chunk::k_size + 123);
+    CHECK(sender.chan.write(sent.data(), sent.size()).ok());
+    CHECK(sender.chan.sends > 1);
+
+    Sink sink;
+    sink.expected = sent.size();
+    ev_io sink_io;
+    ev_io_init(&sink_io, sink_cb, reader, EV_READ);
+    sink_io.data = &sink;
+    ev_io_start(loop, &sink_io);
+    run_for(loop, 5);
+    ev_io_stop(loop, &sink_io);
+    // the last completions may trail the data
+    for (int i = 0; i < 100 && sender.chan.sends > 0; ++i) {
+        run_for(loop, 0.01);
+    }
+
+    CHECK(sink.data == sent);
+    CHECK(sender.errors == 0);
+    // one completion per chunk, none short
+    CHECK(sender.completions == 41);
+    CHECK(sender.chan.sends == 0);
+    CHECK(sender.chan.buf.empty());
+
+    CHECK(ring.close(sender.chan.consumer_file, &sender.chan.buf).ok());
+    ::close(reader);
+}
+
+// the first send fails on a reset connection, the rest of the chain is cancelled
+static void test_send_chain_failure(struct ev_loop *loop, Uring &ring) {
+    int writer, reader;
+    tcp_pair(writer, reader);
+    struct linger lin;
+    lin.l_onoff = 1;
+    lin.l_linger = 0;
+    CHECK(::setsockopt(reader, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin)) == 0);
+    ::close(reader);
+    run_for(loop, 0.1);     // the RST arrives
+
+    Sender sender;
+    init_sender(loop, ring, sender, writer);
+    std::string data = pattern(3 * Chunk::k_size);
+    CHECK(sender.chan.write(data.data(), data.size()).ok());
+    CHECK(sender.chan.sends == 3);
+    for (int i = 0; i < 100 && sender.completions < 3; ++i) {
+        run_for(loop, 0.01);
+    }
+    CHECK(sender.completions == 3);
+    CHECK(sender.errors == 1);
+    CHECK(sender.chan.sends == 0);
+    CHECK(!sender.chan.send_failed);
+
+    CHECK(ring.close(sender.chan.consumer_file, &sender.chan.buf).ok());
+}
+
+static void recv_send_cb(void *userdata, int op, int res, const char *data) {
+    (void)data;
+    Sender &sender = *(Sender *)userdata;
+    sender.completions++;
+    if (op == Uring::OP_SEND) {
+        CHECK(sender.chan.on_sent(res).ok());
+    }
+}
+
+// sends blocked on a peer that never reads and a recv, all cancelled by close()
+static void test_close_in_flight(struct ev_loop *loop, Uring &ring) {
+    size_t files = ring.files;
+    int fd, peer;
+    tcp_pair(fd, peer);
+
+    Sender sender;
+    init_sender(loop, ring, sender, fd, recv_send_cb);
+    UringFile *file = sender.chan.consumer_file;
+    ring.start_recv(*file);
+
+    // more than the socket buffers of both ends take
+    std::string data = pattern(2048 * Chunk::k_size);
+    CHECK(sender.chan.write(data.data(), data.size()).ok());
+    run_for(loop, 0.5);
+    CHECK(sender.chan.sends > 0);
+    CHECK(file->inflight > sender.chan.sends);
+    size_t completions = sender.completions;
+
+    // the sends keep their data in file->orphan until they complete
+    CHECK(ring.close(file, &sender.chan.buf).ok());
+    CHECK(sender.chan.buf.empty());
+    CHECK(::write(peer, "late", 4) == 4);
+    run_for(loop, 0.2);
+    CHECK(sender.completions == completions);
+    CHECK(ring.files == files);
+    CHECK(ring.ops == 0);
+    ::close(peer);
+}
+
+int main() {
+    struct ev_loop *loop = ev_default_loop(0);
+    Uring ring;
+    Error err = ring.init(loop);
+    if (!err.ok()) {
+        printf("SKIP: %s\n", err.str().c_str());
+        return 0;
+    }
+
+    test_accept(loop, ring);
+    test_recv_enobufs(loop);
+    test_send_chain(loop, ring);
+    test_send_chain_failure(loop, ring);
+    test_close_in_flight(loop, ring);
+
+    CHECK(ring.files == 0);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <ev.h>
+
+
+// abort the test with the failed expression
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+
+namespace testing {
+
+    // connected loopback TCP sockets, non-blocking
+    inline void tcp_pair(int &client, int &server) {
+        int lfd = ::socket(AF_INET, SOCK_STREAM, 0);
+        CHECK(lfd >= 0);
+        struct sockaddr_in sa;
+        ::memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        CHECK(::bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+        CHECK(::listen(lfd, 1) == 0);
+        socklen_t len = sizeof(sa);
+        CHECK(::getsockname(lfd, (struct sockaddr *)&sa, &len) == 0);
+
+        client = ::socket(AF_INET, SOCK_STREAM, 0);
+        CHECK(client >= 0);
+        CHECK(::connect(client, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+        server = ::accept(lfd, NULL, NULL);
+        CHECK(server >= 0);
+        ::close(lfd);
+
+        CHECK(::fcntl(client, F_SETFL, O_NONBLOCK) == 0);
+        CHECK(::fcntl(server, F_SETFL, O_NONBLOCK) == 0);
+    }
+
+    inline void timeout_cb(EV_P_ ev_timer *w, int revents) {
+        (void)w;
+        (void)revents;
+        ev_break(EV_A_ EVBREAK_ALL);
+    }
+
+    // run loop for at most seconds, or until a callback breaks it
+    inline void run_for(struct ev_loop *loop, ev_tstamp seconds) {
+        ev_timer timer;
+        ev_timer_init(&timer, timeout_cb, seconds, 0);
+        ev_timer_start(loop, &timer);
+        ev_run(loop, 0);
+        ev_timer_stop(loop, &timer);
+    }
+
+}